@@ -24,4 +24,43 @@
 
 int _oath_strcmp_callback (void *handle, const char *test_otp);
 
+/* Statistics counters, see oath_stats_get. */
+extern struct oath_stats _oath_stats;
+
+#ifdef __ATOMIC_RELAXED
+#define OATH_STATS_LOAD(p) __atomic_load_n (p, __ATOMIC_RELAXED)
+#define OATH_STATS_STORE(p, v) __atomic_store_n (p, v, __ATOMIC_RELAXED)
+#define OATH_STATS_ADD(field, n) \
+  __atomic_fetch_add (&_oath_stats.field, n, __ATOMIC_RELAXED)
+#else
+#define OATH_STATS_LOAD(p) (*(p))
+#define OATH_STATS_STORE(p, v) (*(p) = (v))
+#define OATH_STATS_ADD(field, n) (_oath_stats.field += (n))
+#endif
+#define OATH_STATS_INC(field) OATH_STATS_ADD (field, 1)
+
+/* Count a validation hit at window position POS. */
+#define OATH_STATS_HIT(pos)						\
+  do {									\
+    size_t _p = (pos) < 0 ? -(pos) : (pos);				\
+    OATH_STATS_INC (validations_ok);					\
+    OATH_STATS_INC (window_hits[_p < OATH_STATS_WINDOW_BUCKETS	\
+				? _p : OATH_STATS_WINDOW_BUCKETS - 1]);	\
+  } while (0)
+
+/* USDT probes for tracing with e.g. bpftrace or perf, enabled with
+   --enable-sdt.  Otherwise they expand to nothing. */
+#ifdef ENABLE_SDT
+#include <sys/sdt.h>
+#define OATH_PROBE(name) DTRACE_PROBE (liboath, name)
+#define OATH_PROBE1(name, a) DTRACE_PROBE1 (liboath, name, a)
+#define OATH_PROBE2(name, a, b) DTRACE_PROBE2 (liboath, name, a, b)
+#define OATH_PROBE3(name, a, b, c) DTRACE_PROBE3 (liboath, name, a, b, c)
+#else
+#define OATH_PROBE(name) do { } while (0)
+#define OATH_PROBE1(name, a) do { } while (0)
+#define OATH_PROBE2(name, a, b) do { } while (0)
+#define OATH_PROBE3(name, a, b, c) do { } while (0)
+#endif
+
 #endif /* AUX_H */
@@ -56,7 +56,9 @@ static const err_t errors[] = {
   ERR (OATH_MALLOC_ERROR, "Memory allocation failed"),
   ERR (OATH_FILE_FLUSH_ERROR, "System error when flushing file buffer"),
   ERR (OATH_FILE_SYNC_ERROR, "System error when syncing file to disk"),
-  ERR (OATH_FILE_CLOSE_ERROR, "System error when closing file")
+  ERR (OATH_FILE_CLOSE_ERROR, "System error when closing file"),
+  ERR (OATH_THROTTLED, "Too many failed authentications, try again later"),
+  ERR (OATH_THREAD_ERROR, "System error when starting or stopping threads")
 };
 
 /**
@@ -25,9 +25,25 @@
 
 #include <stdio.h>		/* For snprintf, getline. */
 #include <string.h>		/* For strverscmp. */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "gc.h"
 
+/* Number of outstanding oath_init calls.  The crypto backend is set up
+   by the first and torn down by the last matching oath_done. */
+static unsigned init_count;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+#define INIT_LOCK() pthread_mutex_lock (&init_lock)
+#define INIT_UNLOCK() pthread_mutex_unlock (&init_lock)
+#else
+#define INIT_LOCK() do { } while (0)
+#define INIT_UNLOCK() do { } while (0)
+#endif
+
 /**
  * oath_init:
  *
@@ -43,16 +59,28 @@
  * useful in cases you want to disable libgcrypt's internal lockings
  * etc.
  *
+ * Since version 2.6.0 calls are reference counted and thread-safe:
+ * only the first call initializes the crypto backend, and it stays
+ * initialized until every call has been matched by oath_done().
+ * Long-lived callers, such as PAM modules, should initialize once
+ * rather than around each use.
+ *
  * Returns: On success, %OATH_OK (zero) is returned, otherwise an
  *   error code is returned.
  **/
 int
 oath_init (void)
 {
-  if (gc_init () != GC_OK)
-    return OATH_CRYPTO_ERROR;
+  int rc = OATH_OK;
 
-  return OATH_OK;
+  INIT_LOCK ();
+  if (init_count == 0 && gc_init () != GC_OK)
+    rc = OATH_CRYPTO_ERROR;
+  else
+    init_count++;
+  INIT_UNLOCK ();
+
+  return rc;
 }
 
 /**
@@ -61,7 +89,9 @@ oath_init (void)
  * This function deinitializes the OATH library, which were
  * initialized using oath_init().  After calling this function, no
  * other OATH library function may be called except for to
- * re-initialize the library using oath_init().
+ * re-initialize the library using oath_init().  When oath_init() has
+ * been called several times, only the last matching call to this
+ * function deinitializes the library.
  *
  * Returns: On success, %OATH_OK (zero) is returned, otherwise an
  *   error code is returned.
@@ -69,7 +99,10 @@ oath_init (void)
 int
 oath_done (void)
 {
-  gc_done ();
+  INIT_LOCK ();
+  if (init_count > 0 && --init_count == 0)
+    gc_done ();
+  INIT_UNLOCK ();
 
   return OATH_OK;
 }
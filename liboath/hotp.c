@@ -26,6 +26,12 @@
 #include "aux.h"		/* _oath_strcmp_callback */
 
 #include <stdio.h>		/* For snprintf. */
+#include <stdlib.h>		/* For malloc, free. */
+#include <string.h>		/* For strcmp, strlen. */
+#include <limits.h>		/* For INT_MAX. */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "gc.h"
 
@@ -100,24 +106,32 @@ _oath_hotp_generate2 (const char *secret,
     if (flags & OATH_TOTP_HMAC_SHA256)
       {
 	hssize = GC_SHA256_DIGEST_SIZE;
+	OATH_STATS_INC (hmac_sha256);
 	rc = gc_hmac_sha256 (secret, secret_length,
 			     counter, sizeof (moving_factor), hs);
       }
     else if (flags & OATH_TOTP_HMAC_SHA512)
       {
 	hssize = GC_SHA512_DIGEST_SIZE;
+	OATH_STATS_INC (hmac_sha512);
 	rc = gc_hmac_sha512 (secret, secret_length,
 			     counter, sizeof (moving_factor), hs);
       }
     else
-      rc = gc_hmac_sha1 (secret, secret_length,
-			 counter, sizeof (moving_factor), hs);
+      {
+	OATH_STATS_INC (hmac_sha1);
+	rc = gc_hmac_sha1 (secret, secret_length,
+			   counter, sizeof (moving_factor), hs);
+      }
     if (rc != GC_OK)
       return OATH_CRYPTO_ERROR;
   }
 
   {
     uint8_t offset = hs[hssize - 1] & 0x0f;
+#if DEBUG
+    size_t i;
+#endif
 
     S = (((hs[offset] & 0x7f) << 24)
 	 | ((hs[offset + 1] & 0xff) << 16)
@@ -125,11 +139,11 @@ _oath_hotp_generate2 (const char *secret,
 
 #if DEBUG
     printf ("offset is %d hash is ", offset);
-    for (i = 0; i < 20; i++)
+    for (i = 0; i < hssize; i++)
       printf ("%02x ", hs[i] & 0xFF);
     printf ("\n");
 
-    printf ("value: %d\n", S);
+    printf ("value: %ld\n", S);
 #endif
   }
 
@@ -215,6 +229,9 @@ oath_hotp_validate_callback (const char *secret,
   char tmp_otp[10];
   int rc;
 
+  OATH_PROBE2 (hotp_validate_entry, start_moving_factor, window);
+  OATH_STATS_INC (validations);
+
   do
     {
       rc = oath_hotp_generate (secret,
@@ -223,16 +240,31 @@ oath_hotp_validate_callback (const char *secret,
 			       digits,
 			       false, OATH_HOTP_DYNAMIC_TRUNCATION, tmp_otp);
       if (rc != OATH_OK)
-	return rc;
+	goto done;
 
       if ((rc = strcmp_otp (strcmp_handle, tmp_otp)) == 0)
-	return iter;
+	{
+	  rc = iter;
+	  goto done;
+	}
       if (rc < 0)
-	return OATH_STRCMP_ERROR;
+	{
+	  rc = OATH_STRCMP_ERROR;
+	  goto done;
+	}
     }
   while (window - iter++ > 0);
 
-  return OATH_INVALID_OTP;
+  rc = OATH_INVALID_OTP;
+
+done:
+  if (rc >= 0)
+    OATH_STATS_HIT (rc);
+  else if (rc == OATH_INVALID_OTP)
+    OATH_STATS_INC (validations_failed);
+  OATH_PROBE2 (hotp_validate_return, window, rc);
+
+  return rc;
 }
 
 /**
@@ -264,3 +296,201 @@ oath_hotp_validate (const char *secret,
 				      window, strlen (otp),
 				      _oath_strcmp_callback, (void *) otp);
 }
+
+/* Counters searched by a resync worker between looks at the others. */
+#define RESYNC_BLOCK 1024
+
+/* State shared by the threads of one oath_hotp_resync call. */
+struct resync
+{
+  const char *secret;
+  size_t secret_length;
+  uint64_t start_moving_factor;
+  size_t window;
+  const char *const *otps;
+  unsigned digits;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+  /* Next position to hand out, lowest match so far (or window + 1)
+     and the first error. */
+  size_t next;
+  size_t best;
+  int rc;
+};
+
+static void
+resync_lock (struct resync *r)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&r->lock);
+#else
+  (void) r;
+#endif
+}
+
+static void
+resync_unlock (struct resync *r)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&r->lock);
+#else
+  (void) r;
+#endif
+}
+
+/* Whether all of the OTPs match, starting at @pos. */
+static int
+resync_matches (const struct resync *r, size_t pos)
+{
+  char tmp_otp[10];
+  size_t i;
+  int rc;
+
+  for (i = 0; r->otps[i]; i++)
+    {
+      rc = oath_hotp_generate (r->secret, r->secret_length,
+			       r->start_moving_factor + pos + i,
+			       r->digits, false,
+			       OATH_HOTP_DYNAMIC_TRUNCATION, tmp_otp);
+      if (rc != OATH_OK)
+	return rc;
+      if (strcmp (tmp_otp, r->otps[i]) != 0)
+	return 0;
+    }
+
+  return 1;
+}
+
+/* Take blocks of positions until the window is done or a match
+   before the next block has been found, so that the lowest match is
+   the result no matter how the threads are scheduled. */
+static void *
+resync_worker (void *arg)
+{
+  struct resync *r = arg;
+
+  for (;;)
+    {
+      size_t first, last, pos;
+      int m = 0;
+
+      resync_lock (r);
+      first = r->next;
+      if (r->rc != OATH_OK || first > r->window || first >= r->best)
+	{
+	  resync_unlock (r);
+	  return NULL;
+	}
+      last = first + RESYNC_BLOCK - 1;
+      if (last > r->window)
+	last = r->window;
+      r->next = last + 1;
+      resync_unlock (r);
+
+      for (pos = first; pos <= last; pos++)
+	{
+	  m = resync_matches (r, pos);
+	  if (m != 0)
+	    break;
+	}
+
+      if (m == 0)
+	continue;
+
+      resync_lock (r);
+      if (m < 0 && r->rc == OATH_OK)
+	r->rc = m;
+      else if (m > 0 && pos < r->best)
+	r->best = pos;
+      resync_unlock (r);
+    }
+}
+
+/**
+ * oath_hotp_resync:
+ * @secret: the shared secret string
+ * @secret_length: length of @secret
+ * @start_moving_factor: start counter in OTP stream
+ * @window: how many OTPs after start counter to test, at most %INT_MAX
+ * @otps: NULL terminated array of consecutive OTPs from the token
+ * @threads: number of threads to search with, or 0 for one
+ *
+ * Resynchronize an HOTP token whose counter has moved far ahead of
+ * the server, for example because its button was pressed many times.
+ * The window is searched for a counter at which all of @otps match
+ * consecutively, which with two or more OTPs makes a false match in a
+ * large window unlikely.  All OTPs must have the same length.
+ *
+ * The search is split over @threads threads, including the calling
+ * one, which all stop as soon as no earlier match can be found.
+ *
+ * Returns: Returns position in OTP window of the first OTP in @otps
+ *   (zero is first position), or %OATH_INVALID_OTP if no match was
+ *   found in the window, or an error code.  The next OTP from the
+ *   token has counter @start_moving_factor plus the position plus
+ *   the number of OTPs.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_hotp_resync (const char *secret,
+		  size_t secret_length,
+		  uint64_t start_moving_factor,
+		  size_t window, const char *const *otps, unsigned threads)
+{
+  struct resync r;
+  size_t i;
+
+  if (otps == NULL || otps[0] == NULL)
+    return OATH_INVALID_OTP;
+
+  /* The position is returned as an int, and window + 1 must not
+     wrap around. */
+  if (window > INT_MAX)
+    window = INT_MAX;
+
+  r.secret = secret;
+  r.secret_length = secret_length;
+  r.start_moving_factor = start_moving_factor;
+  r.window = window;
+  r.otps = otps;
+  r.digits = strlen (otps[0]);
+  r.next = 0;
+  r.best = window + 1;
+  r.rc = OATH_OK;
+
+  for (i = 1; otps[i]; i++)
+    if (strlen (otps[i]) != r.digits)
+      return OATH_INVALID_OTP;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init (&r.lock, NULL);
+  {
+    pthread_t *tid = NULL;
+    size_t started = 0;
+
+    if (threads > 1)
+      tid = malloc ((threads - 1) * sizeof (*tid));
+    if (tid)
+      for (; started < threads - 1; started++)
+	if (pthread_create (&tid[started], NULL, resync_worker, &r) != 0)
+	  break;
+    resync_worker (&r);
+    for (i = 0; i < started; i++)
+      pthread_join (tid[i], NULL);
+    free (tid);
+  }
+  pthread_mutex_destroy (&r.lock);
+#else
+  (void) threads;
+  resync_worker (&r);
+#endif
+
+  if (r.rc != OATH_OK)
+    return r.rc;
+  if (r.best > window)
+    return OATH_INVALID_OTP;
+
+  return r.best;
+}
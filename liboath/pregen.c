@@ -0,0 +1,746 @@
+/*
+ * pregen.c - implementation of TOTP pre-generation
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+#include "hotp.h"
+#include "aux.h"
+
+#include <stdlib.h>		/* For malloc, free, strtoul. */
+#include <string.h>		/* For strdup, memcpy. */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#define RDLOCK(pg) pthread_rwlock_rdlock (&(pg)->lock)
+#define WRLOCK(pg) pthread_rwlock_wrlock (&(pg)->lock)
+#define UNLOCK(pg) pthread_rwlock_unlock (&(pg)->lock)
+#else
+#define RDLOCK(pg) do { } while (0)
+#define WRLOCK(pg) do { } while (0)
+#define UNLOCK(pg) do { } while (0)
+#endif
+
+struct pregen_key
+{
+  char *secret;
+  size_t secret_length;
+};
+
+/* Slot of the code hash table of a time step, empty if key is 0. */
+struct pregen_entry
+{
+  uint32_t code;
+  uint32_t key;			/* Key index plus one. */
+};
+
+/* The codes of the first nkeys keys at one time step, in an open
+   addressing hash table keyed by the code. */
+struct pregen_step
+{
+  uint64_t step;
+  size_t nkeys;
+  size_t mask;
+  struct pregen_entry *entries;
+};
+
+struct oath_totp_pregen
+{
+  unsigned time_step_size;
+  time_t start_offset;
+  unsigned digits;
+  size_t window;
+  int flags;
+
+  struct pregen_key *keys;
+  size_t nkeys;
+
+  /* Ring of tables indexed by time step modulo nsteps, large enough
+     for the window around the current and the next time step. */
+  struct pregen_step *steps;
+  size_t nsteps;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_rwlock_t lock;
+
+  /* Background scheduler, see oath_totp_pregen_start. */
+  pthread_t thread;
+  pthread_mutex_t stop_lock;
+  pthread_cond_t stop_cond;
+  bool running;
+  bool stop;
+  unsigned threads;
+  unsigned lead;
+#endif
+};
+
+static size_t
+code_hash (uint32_t code, size_t mask)
+{
+  return (code * 2654435761U) & mask;
+}
+
+static int
+compute_code (const oath_totp_pregen_t * pg, size_t key, uint64_t step,
+	      uint32_t * code)
+{
+  char otp[10];
+  int rc;
+
+  rc = _oath_hotp_generate2 (pg->keys[key].secret,
+			     pg->keys[key].secret_length, step,
+			     pg->digits, false,
+			     OATH_HOTP_DYNAMIC_TRUNCATION, pg->flags, otp);
+  if (rc != OATH_OK)
+    return rc;
+
+  *code = strtoul (otp, NULL, 10);
+
+  return OATH_OK;
+}
+
+/* Keys [first, last) of one table computed by one thread. */
+struct pregen_work
+{
+  const oath_totp_pregen_t *pg;
+  uint64_t step;
+  uint32_t *codes;
+  size_t first, last;
+  int rc;
+};
+
+static void *
+compute_codes (void *arg)
+{
+  struct pregen_work *w = arg;
+  size_t i;
+
+  w->rc = OATH_OK;
+  for (i = w->first; i < w->last && w->rc == OATH_OK; i++)
+    w->rc = compute_code (w->pg, i, w->step, &w->codes[i]);
+
+  return NULL;
+}
+
+/* Build the table for @step with the first @nkeys keys, computing
+   the codes with up to @threads threads.  The caller holds the lock
+   for reading, which keeps the keys in place. */
+static int
+build_step (const oath_totp_pregen_t * pg, uint64_t step, size_t nkeys,
+	    unsigned threads, struct pregen_step *out)
+{
+  struct pregen_work work[16];
+  uint32_t *codes;
+  size_t size = 16, i, nthreads;
+  int rc = OATH_OK;
+
+  while (size < 2 * nkeys)
+    size *= 2;
+
+  codes = malloc ((nkeys ? nkeys : 1) * sizeof (*codes));
+  out->entries = calloc (size, sizeof (*out->entries));
+  if (codes == NULL || out->entries == NULL)
+    {
+      free (codes);
+      free (out->entries);
+      return OATH_MALLOC_ERROR;
+    }
+  out->step = step;
+  out->nkeys = nkeys;
+  out->mask = size - 1;
+
+  nthreads = threads ? threads : 1;
+  if (nthreads > sizeof (work) / sizeof (work[0]))
+    nthreads = sizeof (work) / sizeof (work[0]);
+  if (nthreads > nkeys)
+    nthreads = nkeys ? nkeys : 1;
+
+  for (i = 0; i < nthreads; i++)
+    {
+      work[i].pg = pg;
+      work[i].step = step;
+      work[i].codes = codes;
+      work[i].first = nkeys * i / nthreads;
+      work[i].last = nkeys * (i + 1) / nthreads;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  {
+    pthread_t tid[sizeof (work) / sizeof (work[0])];
+    size_t started;
+
+    /* The calling thread takes the first share itself. */
+    for (started = 1; started < nthreads; started++)
+      if (pthread_create (&tid[started], NULL, compute_codes,
+			  &work[started]) != 0)
+	break;
+    compute_codes (&work[0]);
+    for (i = 1; i < started; i++)
+      pthread_join (tid[i], NULL);
+    /* Whatever could not be handed out is done here. */
+    for (i = started; i < nthreads; i++)
+      compute_codes (&work[i]);
+  }
+#else
+  for (i = 0; i < nthreads; i++)
+    compute_codes (&work[i]);
+#endif
+
+  for (i = 0; i < nthreads && rc == OATH_OK; i++)
+    rc = work[i].rc;
+
+  for (i = 0; i < nkeys && rc == OATH_OK; i++)
+    {
+      size_t h = code_hash (codes[i], out->mask);
+
+      while (out->entries[h].key)
+	h = (h + 1) & out->mask;
+      out->entries[h].code = codes[i];
+      out->entries[h].key = i + 1;
+    }
+
+  free (codes);
+  if (rc != OATH_OK)
+    {
+      free (out->entries);
+      out->entries = NULL;
+    }
+
+  return rc;
+}
+
+/* Whether @key has @code at @step, from the table if it is there or
+   computed otherwise.  The caller holds the lock. */
+static int
+step_matches (const oath_totp_pregen_t * pg, uint64_t step, size_t key,
+	      uint32_t code)
+{
+  const struct pregen_step *s = &pg->steps[step % pg->nsteps];
+  uint32_t computed;
+  size_t h;
+  int rc;
+
+  if (s->entries && s->step == step && key < s->nkeys)
+    {
+      for (h = code_hash (code, s->mask); s->entries[h].key;
+	   h = (h + 1) & s->mask)
+	if (s->entries[h].code == code && s->entries[h].key == key + 1)
+	  return 1;
+      return 0;
+    }
+
+  rc = compute_code (pg, key, step, &computed);
+  if (rc != OATH_OK)
+    return rc;
+
+  return computed == code;
+}
+
+/* Parse @otp into *@code, if it has the right number of digits. */
+static bool
+parse_code (const oath_totp_pregen_t * pg, const char *otp, uint32_t * code)
+{
+  size_t i;
+
+  if (strlen (otp) != pg->digits)
+    return false;
+
+  for (i = 0; i < pg->digits; i++)
+    if (otp[i] < '0' || otp[i] > '9')
+      return false;
+
+  *code = strtoul (otp, NULL, 10);
+
+  return true;
+}
+
+static uint64_t
+current_step (const oath_totp_pregen_t * pg, time_t now)
+{
+  return (now - pg->start_offset) / pg->time_step_size;
+}
+
+/**
+ * oath_totp_pregen_init:
+ * @pregen: output pointer to a #oath_totp_pregen_t handle.
+ * @time_step_size: time step system parameter (typically 30)
+ * @start_offset: Unix time of when to start counting time steps (typically 0)
+ * @digits: number of digits in the OTPs
+ * @window: how many OTPs after/before the current one to accept
+ * @flags: flags indicating mode, one of #oath_totp_flags
+ *
+ * Create a handle that keeps the TOTP codes of a set of keys computed
+ * ahead of time, for a long-running validator with a known set of
+ * users.  Add the keys with oath_totp_pregen_add(), compute the codes
+ * with oath_totp_pregen_generate() or let a background thread do it
+ * shortly before each time step starts with oath_totp_pregen_start(),
+ * and validate OTPs with oath_totp_pregen_validate(), which then only
+ * needs to look the OTP up in a table.
+ *
+ * The codes of all keys are kept for the 2 * @window + 2 time steps
+ * around the current and the next time step.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_pregen_init (oath_totp_pregen_t ** pregen,
+		       unsigned time_step_size, time_t start_offset,
+		       unsigned digits, size_t window, int flags)
+{
+  oath_totp_pregen_t *pg;
+
+  if (digits != 6 && digits != 7 && digits != 8)
+    return OATH_INVALID_DIGITS;
+
+  pg = calloc (1, sizeof (*pg));
+  if (pg == NULL)
+    return OATH_MALLOC_ERROR;
+
+  pg->time_step_size = time_step_size ? time_step_size
+    : OATH_TOTP_DEFAULT_TIME_STEP_SIZE;
+  pg->start_offset = start_offset;
+  pg->digits = digits;
+  pg->window = window;
+  pg->flags = flags;
+  pg->nsteps = 2 * window + 2;
+
+  pg->steps = calloc (pg->nsteps, sizeof (*pg->steps));
+  if (pg->steps == NULL)
+    {
+      free (pg);
+      return OATH_MALLOC_ERROR;
+    }
+
+#ifdef HAVE_PTHREAD_H
+  if (pthread_rwlock_init (&pg->lock, NULL) != 0)
+    {
+      free (pg->steps);
+      free (pg);
+      return OATH_THREAD_ERROR;
+    }
+  pthread_mutex_init (&pg->stop_lock, NULL);
+  pthread_cond_init (&pg->stop_cond, NULL);
+#endif
+
+  *pregen = pg;
+
+  return OATH_OK;
+}
+
+/**
+ * oath_totp_pregen_add:
+ * @pregen: a #oath_totp_pregen_t handle, from oath_totp_pregen_init().
+ * @secret: the shared secret string
+ * @secret_length: length of @secret
+ * @key: output index of the new key (may be NULL).
+ *
+ * Add a key to @pregen.  Keys are identified by their index, which
+ * counts from zero in the order they are added.  A copy of @secret is
+ * kept.  The codes of the new key are computed from the next time
+ * step that oath_totp_pregen_generate() computes; until then
+ * oath_totp_pregen_validate() computes them on demand.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_pregen_add (oath_totp_pregen_t * pregen,
+		      const char *secret, size_t secret_length, size_t * key)
+{
+  struct pregen_key *tmp;
+  char *copy;
+  int rc = OATH_OK;
+
+  copy = malloc (secret_length ? secret_length : 1);
+  if (copy == NULL)
+    return OATH_MALLOC_ERROR;
+  memcpy (copy, secret, secret_length);
+
+  WRLOCK (pregen);
+
+  tmp = realloc (pregen->keys, (pregen->nkeys + 1) * sizeof (*tmp));
+  if (tmp == NULL)
+    {
+      free (copy);
+      rc = OATH_MALLOC_ERROR;
+    }
+  else
+    {
+      pregen->keys = tmp;
+      tmp[pregen->nkeys].secret = copy;
+      tmp[pregen->nkeys].secret_length = secret_length;
+      if (key)
+	*key = pregen->nkeys;
+      pregen->nkeys++;
+    }
+
+  UNLOCK (pregen);
+
+  return rc;
+}
+
+/**
+ * oath_totp_pregen_generate:
+ * @pregen: a #oath_totp_pregen_t handle, from oath_totp_pregen_init().
+ * @now: Unix time value to compute codes for
+ * @threads: number of threads to compute with, or 0 for one
+ *
+ * Compute the codes of all keys for the time steps in the window
+ * around the time step of @now and the next one, unless they have
+ * been computed already.  At a time step boundary, this is usually
+ * just the codes for one new time step.  The work is spread over up
+ * to @threads threads, including the calling one.
+ *
+ * Validation with oath_totp_pregen_validate() may go on in other
+ * threads meanwhile.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_pregen_generate (oath_totp_pregen_t * pregen, time_t now,
+			   unsigned threads)
+{
+  uint64_t first = current_step (pregen, now), step;
+  int rc = OATH_OK;
+
+  first = first > pregen->window ? first - pregen->window : 0;
+
+  for (step = first; step < first + pregen->nsteps && rc == OATH_OK; step++)
+    {
+      struct pregen_step *slot = &pregen->steps[step % pregen->nsteps];
+      struct pregen_step s;
+      bool fresh;
+
+      RDLOCK (pregen);
+      fresh = slot->entries && slot->step == step
+	&& slot->nkeys == pregen->nkeys;
+      if (!fresh)
+	rc = build_step (pregen, step, pregen->nkeys, threads, &s);
+      UNLOCK (pregen);
+
+      if (fresh || rc != OATH_OK)
+	continue;
+
+      WRLOCK (pregen);
+      free (slot->entries);
+      *slot = s;
+      UNLOCK (pregen);
+    }
+
+  return rc;
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *
+scheduler (void *arg)
+{
+  oath_totp_pregen_t *pg = arg;
+
+  pthread_mutex_lock (&pg->stop_lock);
+  while (!pg->stop)
+    {
+      time_t now = time (NULL), wake;
+      struct timespec ts;
+
+      pthread_mutex_unlock (&pg->stop_lock);
+      oath_totp_pregen_generate (pg, now, pg->threads);
+      pthread_mutex_lock (&pg->stop_lock);
+
+      /* The next time step is ready now, so wake up shortly before
+	 the one after it starts. */
+      wake = pg->start_offset
+	+ (time_t) (current_step (pg, now) + 2) * pg->time_step_size
+	- pg->lead;
+      if (wake <= now)
+	wake = now + 1;
+
+      ts.tv_sec = wake;
+      ts.tv_nsec = 0;
+      while (!pg->stop && time (NULL) < wake)
+	pthread_cond_timedwait (&pg->stop_cond, &pg->stop_lock, &ts);
+    }
+  pthread_mutex_unlock (&pg->stop_lock);
+
+  return NULL;
+}
+#endif
+
+/**
+ * oath_totp_pregen_start:
+ * @pregen: a #oath_totp_pregen_t handle, from oath_totp_pregen_init().
+ * @threads: number of threads to compute with, or 0 for one
+ * @lead: how many seconds before each time step to compute its codes
+ *
+ * Start a background thread that calls oath_totp_pregen_generate()
+ * now and then @lead seconds before each time step starts, so that
+ * the codes are ready before they are needed and validation never
+ * has to compute them.  The thread is stopped by
+ * oath_totp_pregen_done().
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, or
+ *   %OATH_THREAD_ERROR if the thread could not be started or threads
+ *   are not supported.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_pregen_start (oath_totp_pregen_t * pregen, unsigned threads,
+			unsigned lead)
+{
+#ifdef HAVE_PTHREAD_H
+  if (pregen->running)
+    return OATH_THREAD_ERROR;
+
+  pregen->threads = threads;
+  pregen->lead = lead < pregen->time_step_size ? lead
+    : pregen->time_step_size - 1;
+  pregen->stop = false;
+
+  if (pthread_create (&pregen->thread, NULL, scheduler, pregen) != 0)
+    return OATH_THREAD_ERROR;
+  pregen->running = true;
+
+  return OATH_OK;
+#else
+  (void) pregen;
+  (void) threads;
+  (void) lead;
+
+  return OATH_THREAD_ERROR;
+#endif
+}
+
+/**
+ * oath_totp_pregen_validate:
+ * @pregen: a #oath_totp_pregen_t handle, from oath_totp_pregen_init().
+ * @now: Unix time value to validate TOTP for
+ * @key: index of the key, from oath_totp_pregen_add().
+ * @otp: the OTP to validate.
+ * @otp_pos: output search position in search window (may be NULL).
+ * @otp_counter: counter value used to calculate OTP value (may be NULL).
+ *
+ * Validate an OTP for key @key like oath_totp_validate4() does, with
+ * the parameters given to oath_totp_pregen_init(), but by looking
+ * the OTP up in the precomputed codes.  Codes for time steps that
+ * have not been computed are computed on demand.
+ *
+ * Returns: Returns absolute value of position in OTP window (zero is
+ *   first position), or %OATH_INVALID_OTP if no OTP was found in OTP
+ *   window, %OATH_UNKNOWN_USER if there is no key @key, or an error
+ *   code.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_pregen_validate (oath_totp_pregen_t * pregen, time_t now,
+			   size_t key, const char *otp,
+			   int *otp_pos, uint64_t * otp_counter)
+{
+  uint64_t nts = current_step (pregen, now);
+  uint32_t code;
+  size_t iter;
+  int rc = OATH_INVALID_OTP;
+
+  OATH_STATS_INC (validations);
+
+  if (!parse_code (pregen, otp, &code))
+    {
+      OATH_STATS_INC (validations_failed);
+      return OATH_INVALID_OTP;
+    }
+
+  RDLOCK (pregen);
+
+  if (key >= pregen->nkeys)
+    {
+      UNLOCK (pregen);
+      return OATH_UNKNOWN_USER;
+    }
+
+  for (iter = 0; iter <= pregen->window && rc == OATH_INVALID_OTP; iter++)
+    {
+      int pos = iter, m;
+
+      m = step_matches (pregen, nts + iter, key, code);
+      if (m == 0 && iter > 0 && iter <= nts)
+	{
+	  pos = -pos;
+	  m = step_matches (pregen, nts - iter, key, code);
+	}
+      if (m < 0)
+	rc = m;
+      else if (m)
+	{
+	  if (otp_pos)
+	    *otp_pos = pos;
+	  if (otp_counter)
+	    *otp_counter = nts + pos;
+	  OATH_STATS_HIT (pos);
+	  rc = iter;
+	}
+    }
+
+  UNLOCK (pregen);
+
+  if (rc == OATH_INVALID_OTP)
+    OATH_STATS_INC (validations_failed);
+
+  return rc;
+}
+
+/**
+ * oath_totp_pregen_lookup:
+ * @pregen: a #oath_totp_pregen_t handle, from oath_totp_pregen_init().
+ * @now: Unix time value to look up the OTP for
+ * @otp: the OTP to look up.
+ * @keys: output array for the indexes of matching keys (may be NULL).
+ * @max_keys: number of entries in @keys.
+ *
+ * Find the keys that have @otp as a valid code within the window
+ * around @now, for example to find the candidate users of an OTP
+ * entered without a username.  At most @max_keys of them are stored
+ * in @keys.
+ *
+ * Returns: The number of matching keys, which may be larger than
+ *   @max_keys, or an error code.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_pregen_lookup (oath_totp_pregen_t * pregen, time_t now,
+			 const char *otp, size_t * keys, size_t max_keys)
+{
+  uint64_t nts = current_step (pregen, now), step, first;
+  bool *matched;
+  uint32_t code;
+  size_t found = 0, key;
+  int rc = OATH_OK;
+
+  if (!parse_code (pregen, otp, &code))
+    return 0;
+
+  first = nts > pregen->window ? nts - pregen->window : 0;
+
+  RDLOCK (pregen);
+
+  matched = calloc (pregen->nkeys ? pregen->nkeys : 1, sizeof (*matched));
+  if (matched == NULL)
+    {
+      UNLOCK (pregen);
+      return OATH_MALLOC_ERROR;
+    }
+
+  for (step = first; step <= nts + pregen->window && rc == OATH_OK; step++)
+    {
+      const struct pregen_step *s = &pregen->steps[step % pregen->nsteps];
+      size_t h;
+
+      /* Keys in the table are found by the code ... */
+      if (s->entries && s->step == step)
+	for (h = code_hash (code, s->mask); s->entries[h].key;
+	     h = (h + 1) & s->mask)
+	  if (s->entries[h].code == code)
+	    matched[s->entries[h].key - 1] = true;
+
+      /* ... and the codes of any others are computed. */
+      for (key = s->entries && s->step == step ? s->nkeys : 0;
+	   key < pregen->nkeys && rc == OATH_OK; key++)
+	if (!matched[key])
+	  {
+	    int m = step_matches (pregen, step, key, code);
+
+	    if (m < 0)
+	      rc = m;
+	    else if (m)
+	      matched[key] = true;
+	  }
+    }
+
+  for (key = 0; key < pregen->nkeys; key++)
+    if (matched[key])
+      {
+	if (keys && found < max_keys)
+	  keys[found] = key;
+	found++;
+      }
+
+  UNLOCK (pregen);
+
+  free (matched);
+
+  return rc == OATH_OK ? (int) found : rc;
+}
+
+/**
+ * oath_totp_pregen_done:
+ * @pregen: a #oath_totp_pregen_t handle, from oath_totp_pregen_init().
+ *
+ * Stop the background thread, if any, and release the resources
+ * associated with @pregen, wiping the copies of the secrets.  It is
+ * safe to pass NULL.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_totp_pregen_done (oath_totp_pregen_t * pregen)
+{
+  size_t i;
+
+  if (pregen == NULL)
+    return;
+
+#ifdef HAVE_PTHREAD_H
+  if (pregen->running)
+    {
+      pthread_mutex_lock (&pregen->stop_lock);
+      pregen->stop = true;
+      pthread_cond_signal (&pregen->stop_cond);
+      pthread_mutex_unlock (&pregen->stop_lock);
+      pthread_join (pregen->thread, NULL);
+    }
+  pthread_cond_destroy (&pregen->stop_cond);
+  pthread_mutex_destroy (&pregen->stop_lock);
+  pthread_rwlock_destroy (&pregen->lock);
+#endif
+
+  for (i = 0; i < pregen->nkeys; i++)
+    {
+      memset (pregen->keys[i].secret, 0, pregen->keys[i].secret_length);
+      free (pregen->keys[i].secret);
+    }
+  free (pregen->keys);
+
+  for (i = 0; i < pregen->nsteps; i++)
+    free (pregen->steps[i].entries);
+  free (pregen->steps);
+
+  free (pregen);
+}
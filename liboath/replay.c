@@ -0,0 +1,261 @@
+/*
+ * replay.c - implementation of in-memory TOTP replay cache
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+#include "aux.h"
+
+#include <stdlib.h>		/* For malloc, free. */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* Number of entries that a key may be stored in. */
+#define REPLAY_WAYS 4
+
+#define REPLAY_MAGIC 0x4f525043	/* "ORPC" */
+
+/* Serializes access to caches by threads of this process. */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+#define REPLAY_LOCK() pthread_mutex_lock (&replay_lock)
+#define REPLAY_UNLOCK() pthread_mutex_unlock (&replay_lock)
+#else
+#define REPLAY_LOCK() do { } while (0)
+#define REPLAY_UNLOCK() do { } while (0)
+#endif
+
+struct replay_entry
+{
+  uint64_t key;
+  uint64_t counter;
+  int64_t expires;
+};
+
+/* The cache is one flat block of memory without pointers, so that it
+   may be placed in memory shared between processes. */
+struct oath_replay_cache
+{
+  uint32_t magic;
+  uint32_t allocated;
+  uint64_t nbuckets;
+  struct replay_entry entries[];
+};
+
+static uint64_t
+replay_key (const char *username, size_t token)
+{
+  /* FNV-1a. */
+  uint64_t h = 0xcbf29ce484222325ULL;
+  size_t i;
+
+  for (; *username; username++)
+    {
+      h ^= (unsigned char) *username;
+      h *= 0x100000001b3ULL;
+    }
+
+  for (i = 0; i < sizeof (token); i++)
+    {
+      h ^= (token >> (i * 8)) & 0xFF;
+      h *= 0x100000001b3ULL;
+    }
+
+  return h;
+}
+
+static uint64_t
+replay_buckets (size_t entries)
+{
+  if (entries < REPLAY_WAYS)
+    return 1;
+
+  return (entries + REPLAY_WAYS - 1) / REPLAY_WAYS;
+}
+
+/**
+ * oath_replay_cache_size:
+ * @entries: number of entries the cache should hold
+ *
+ * Compute how many bytes of memory a replay cache holding @entries
+ * entries needs, for use with oath_replay_cache_init() when the
+ * memory is provided by the caller.
+ *
+ * Returns: Size in bytes of a replay cache with room for @entries.
+ *
+ * Since: 2.6.0
+ **/
+size_t
+oath_replay_cache_size (size_t entries)
+{
+  return sizeof (struct oath_replay_cache)
+    + replay_buckets (entries) * REPLAY_WAYS * sizeof (struct replay_entry);
+}
+
+/**
+ * oath_replay_cache_init:
+ * @cache: output pointer to a #oath_replay_cache_t handle.
+ * @entries: number of entries the cache should hold
+ * @mem: memory to hold the cache, or NULL.
+ *
+ * Create a replay cache.  The cache remembers, for each user and
+ * token, the most recent TOTP time-step counter that has been
+ * accepted, until the search window has moved past it.  It replaces
+ * the replay protection that otherwise requires the usersfile to be
+ * rewritten on each TOTP authentication, see
+ * oath_usersfile_set_replay_cache().
+ *
+ * The cache has a fixed size.  Each user is hashed to a small set of
+ * entries, and when all of them are in use the entry closest to
+ * expiry is reused, so @entries should be larger than the number of
+ * authentications expected within one search window.
+ *
+ * If @mem is NULL, memory for the cache is allocated and is released
+ * by oath_replay_cache_done().  Otherwise @mem must point to
+ * oath_replay_cache_size(@entries) bytes owned by the caller, for
+ * example a shared memory mapping.  Memory that already holds a
+ * cache of the same size is used as it is, so several processes may
+ * attach to the same cache, but then they must serialize calls to
+ * oath_replay_cache_check() themselves.  Threads within one process
+ * are serialized by liboath.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_replay_cache_init (oath_replay_cache_t ** cache, size_t entries,
+			void *mem)
+{
+  size_t len = oath_replay_cache_size (entries);
+  oath_replay_cache_t *c = mem;
+
+  if (c == NULL)
+    {
+      c = malloc (len);
+      if (c == NULL)
+	return OATH_MALLOC_ERROR;
+      memset (c, 0, len);
+      c->allocated = 1;
+    }
+  else if (c->magic == REPLAY_MAGIC && c->allocated == 0
+	   && c->nbuckets == replay_buckets (entries))
+    {
+      *cache = c;
+      return OATH_OK;
+    }
+  else
+    memset (c, 0, len);
+
+  c->nbuckets = replay_buckets (entries);
+  c->magic = REPLAY_MAGIC;
+
+  *cache = c;
+
+  return OATH_OK;
+}
+
+/**
+ * oath_replay_cache_done:
+ * @cache: a #oath_replay_cache_t handle, from oath_replay_cache_init().
+ *
+ * Release the resources associated with @cache.  Memory that was
+ * provided by the caller to oath_replay_cache_init() is left
+ * untouched.  It is safe to pass NULL.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_replay_cache_done (oath_replay_cache_t * cache)
+{
+  if (cache && cache->allocated)
+    free (cache);
+}
+
+/**
+ * oath_replay_cache_check:
+ * @cache: a #oath_replay_cache_t handle, from oath_replay_cache_init().
+ * @username: string with name of user
+ * @token: index of the token among the user's tokens, or 0
+ * @otp_counter: time-step counter of the validated OTP
+ * @now: Unix time value used to expire entries
+ * @expires: Unix time value after which @otp_counter is no longer
+ *   inside the search window
+ *
+ * Check whether a TOTP, which has already been validated and found to
+ * have the time-step counter @otp_counter (see the @otp_counter
+ * output of oath_totp_validate3()), has been replayed.  An OTP is
+ * considered replayed if an OTP with the same or a later counter has
+ * been accepted for the same user and token before.  If it was not
+ * replayed, @otp_counter is recorded until @expires.
+ *
+ * Returns: %OATH_OK if the OTP has not been seen before, or
+ *   %OATH_REPLAYED_OTP if it has.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_replay_cache_check (oath_replay_cache_t * cache,
+			 const char *username,
+			 size_t token,
+			 uint64_t otp_counter, time_t now, time_t expires)
+{
+  uint64_t key = replay_key (username, token);
+  struct replay_entry *bucket, *victim = NULL;
+  int rc = OATH_OK;
+  size_t i;
+
+  bucket = &cache->entries[(key % cache->nbuckets) * REPLAY_WAYS];
+
+  REPLAY_LOCK ();
+
+  for (i = 0; i < REPLAY_WAYS; i++)
+    {
+      struct replay_entry *e = &bucket[i];
+
+      if (e->expires > now && e->key == key)
+	{
+	  if (e->counter >= otp_counter)
+	    rc = OATH_REPLAYED_OTP;
+	  victim = e;
+	  break;
+	}
+
+      if (victim == NULL || e->expires < victim->expires)
+	victim = e;
+    }
+
+  if (rc == OATH_OK)
+    {
+      victim->key = key;
+      victim->counter = otp_counter;
+      victim->expires = expires;
+    }
+
+  REPLAY_UNLOCK ();
+
+  if (rc == OATH_REPLAYED_OTP)
+    OATH_STATS_INC (replays);
+
+  return rc;
+}
@@ -0,0 +1,85 @@
+/*
+ * stats.c - implementation of library statistics counters
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+#include "aux.h"
+
+#include <string.h>		/* For memset. */
+
+struct oath_stats _oath_stats;
+
+/* The counters are only ever added to and read one by one, so relaxed
+   atomic operations are enough: a snapshot is not consistent between
+   counters, but no increment is lost. */
+#define NCOUNTERS (sizeof (oath_stats_t) / sizeof (uint64_t))
+
+/**
+ * oath_stats_get:
+ * @stats: output structure to hold the current counters.
+ * @size: size of @stats in bytes, normally sizeof (oath_stats_t).
+ *
+ * Copy the current values of the per-process statistics counters to
+ * @stats.  Only the first @size bytes of @stats are written, so an
+ * application built against an older, smaller #oath_stats_t gets the
+ * counters it knows about and nothing is written past the end of its
+ * structure.  Counters that this library does not know about, at the
+ * end of a larger structure, are left untouched.
+ *
+ * The counters are updated by all threads without locking, so while
+ * other threads are busy the copied counters may not be exactly
+ * consistent with each other, e.g. @validations may briefly be ahead
+ * of @validations_ok and @validations_failed.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_stats_get (oath_stats_t * stats, size_t size)
+{
+  const uint64_t *src = (const uint64_t *) &_oath_stats;
+  uint64_t *dst = (uint64_t *) stats;
+  size_t n = size / sizeof (uint64_t);
+  size_t i;
+
+  if (n > NCOUNTERS)
+    n = NCOUNTERS;
+
+  for (i = 0; i < n; i++)
+    dst[i] = OATH_STATS_LOAD (&src[i]);
+}
+
+/**
+ * oath_stats_reset:
+ *
+ * Set all the per-process statistics counters to zero.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_stats_reset (void)
+{
+  uint64_t *dst = (uint64_t *) &_oath_stats;
+  size_t i;
+
+  for (i = 0; i < NCOUNTERS; i++)
+    OATH_STATS_STORE (&dst[i], 0);
+}
@@ -24,10 +24,15 @@
 #include "oath.h"
 
 #include <stdio.h>
+#include <string.h>
+
+/* From RFC 4226. */
+#define SECRET "12345678901234567890"
 
 int
 main (void)
 {
+  char otp[10];
   oath_rc rc;
 
   /* Check version. */
@@ -60,6 +65,33 @@ main (void)
       return 1;
     }
 
+  /* Nested initialization is reference counted. */
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_init[2]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_done ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_done[2]: %d\n", rc);
+      return 1;
+    }
+
+  /* The library is still usable until the outer oath_done. */
+
+  rc = oath_hotp_generate (SECRET, sizeof (SECRET) - 1, 0, 6, false,
+			   OATH_HOTP_DYNAMIC_TRUNCATION, otp);
+  if (rc != OATH_OK || strcmp (otp, "755224") != 0)
+    {
+      printf ("oath_hotp_generate after nested oath_done: %d %s\n",
+	      rc, otp);
+      return 1;
+    }
+
   /* Test deinitialization. */
 
   rc = oath_done ();
@@ -69,5 +101,14 @@ main (void)
       return 1;
     }
 
+  /* Unbalanced deinitialization is harmless. */
+
+  rc = oath_done ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_done[3]: %d\n", rc);
+      return 1;
+    }
+
   return 0;
 }
@@ -191,6 +191,49 @@ main (void)
 	  }
       }
 
+  {
+    const char *pair[] = { "969429", "338314", NULL };
+    const char *gap[] = { "755224", "969429", NULL };
+    const char *last[] = { "578337", NULL };
+
+    /* Two consecutive OTPs, found by several threads. */
+    rc = oath_hotp_resync (secret, secretlen, 0, 100000, pair, 4);
+    if (rc != 3)
+      {
+	printf ("oath_hotp_resync[1]: %d\n", rc);
+	return 1;
+      }
+
+    /* The largest window must not wrap around. */
+    rc = oath_hotp_resync (secret, secretlen, 0, (size_t) -1, pair, 2);
+    if (rc != 3)
+      {
+	printf ("oath_hotp_resync[huge window]: %d\n", rc);
+	return 1;
+      }
+
+    rc = oath_hotp_resync (secret, secretlen, 0, 100, gap, 2);
+    if (rc != OATH_INVALID_OTP)
+      {
+	printf ("oath_hotp_resync[2]: %d\n", rc);
+	return 1;
+      }
+
+    rc = oath_hotp_resync (secret, secretlen, 0, 19, last, 0);
+    if (rc != 19)
+      {
+	printf ("oath_hotp_resync[3]: %d\n", rc);
+	return 1;
+      }
+
+    rc = oath_hotp_resync (secret, secretlen, 0, 18, last, 3);
+    if (rc != OATH_INVALID_OTP)
+      {
+	printf ("oath_hotp_resync[4]: %d\n", rc);
+	return 1;
+      }
+  }
+
   rc = oath_done ();
   if (rc != OATH_OK)
     {
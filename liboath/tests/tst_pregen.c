@@ -0,0 +1,149 @@
+/*
+ * tst_pregen.c - self-tests for liboath TOTP pre-generation
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+
+#include <stdio.h>
+
+/* From RFC 6238. */
+#define SECRET "12345678901234567890"
+#define NOW 1111111109
+
+int
+main (void)
+{
+  oath_totp_pregen_t *pg;
+  size_t key, other, keys[4];
+  uint64_t otp_counter;
+  int otp_pos;
+  int rc;
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_init (&pg, 30, 0, 8, 10, 0);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_totp_pregen_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_add (pg, "other secret", 12, &other);
+  if (rc != OATH_OK || other != 0)
+    {
+      printf ("oath_totp_pregen_add[1]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_add (pg, SECRET, 20, &key);
+  if (rc != OATH_OK || key != 1)
+    {
+      printf ("oath_totp_pregen_add[2]: %d\n", rc);
+      return 1;
+    }
+
+  /* Codes that have not been generated are computed on demand. */
+  rc = oath_totp_pregen_validate (pg, NOW, key, "07081804", &otp_pos,
+				  &otp_counter);
+  if (rc != 0 || otp_pos != 0 || otp_counter != 37037036)
+    {
+      printf ("oath_totp_pregen_validate[1]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_generate (pg, NOW, 2);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_totp_pregen_generate: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_validate (pg, NOW, key, "07081804", &otp_pos,
+				  &otp_counter);
+  if (rc != 0 || otp_pos != 0 || otp_counter != 37037036)
+    {
+      printf ("oath_totp_pregen_validate[2]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_validate (pg, NOW, key, "14050471", &otp_pos,
+				  &otp_counter);
+  if (rc != 1 || otp_pos != 1 || otp_counter != 37037037)
+    {
+      printf ("oath_totp_pregen_validate[3]: %d\n", rc);
+      return 1;
+    }
+
+  /* Partly outside of the generated steps. */
+  rc = oath_totp_pregen_validate (pg, 1111111400, key, "07081804",
+				  &otp_pos, &otp_counter);
+  if (rc != 10 || otp_pos != -10 || otp_counter != 37037036)
+    {
+      printf ("oath_totp_pregen_validate[4]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_validate (pg, NOW, other, "07081804", NULL, NULL);
+  if (rc != OATH_INVALID_OTP)
+    {
+      printf ("oath_totp_pregen_validate[5]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_validate (pg, NOW, 2, "07081804", NULL, NULL);
+  if (rc != OATH_UNKNOWN_USER)
+    {
+      printf ("oath_totp_pregen_validate[6]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_totp_pregen_lookup (pg, NOW, "07081804", keys, 4);
+  if (rc != 1 || keys[0] != key)
+    {
+      printf ("oath_totp_pregen_lookup: %d\n", rc);
+      return 1;
+    }
+
+  /* The background thread must start and stop cleanly. */
+  rc = oath_totp_pregen_start (pg, 2, 5);
+  if (rc != OATH_OK && rc != OATH_THREAD_ERROR)
+    {
+      printf ("oath_totp_pregen_start: %d\n", rc);
+      return 1;
+    }
+
+  oath_totp_pregen_done (pg);
+
+  rc = oath_done ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_done: %d\n", rc);
+      return 1;
+    }
+
+  return 0;
+}
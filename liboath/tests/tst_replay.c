@@ -0,0 +1,177 @@
+/*
+ * tst_replay.c - self-tests for liboath replay cache functions
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ENTRIES 16
+
+int
+main (void)
+{
+  oath_replay_cache_t *cache, *cache2;
+  void *mem;
+  int rc;
+  char user[10];
+  int i;
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_init (&cache, ENTRIES, NULL);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache, "jas", 0, 100, 3000, 3100);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_check[1]: %d\n", rc);
+      return 1;
+    }
+
+  /* Same counter is a replay. */
+  rc = oath_replay_cache_check (cache, "jas", 0, 100, 3010, 3100);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_replay_cache_check[2]: %d\n", rc);
+      return 1;
+    }
+
+  /* Older counter is a replay. */
+  rc = oath_replay_cache_check (cache, "jas", 0, 99, 3010, 3070);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_replay_cache_check[3]: %d\n", rc);
+      return 1;
+    }
+
+  /* Other token and other user are independent. */
+  rc = oath_replay_cache_check (cache, "jas", 1, 100, 3010, 3100);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_check[4]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache, "joe", 0, 100, 3010, 3100);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_check[5]: %d\n", rc);
+      return 1;
+    }
+
+  /* Newer counter is accepted and recorded. */
+  rc = oath_replay_cache_check (cache, "jas", 0, 101, 3030, 3130);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_check[6]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache, "jas", 0, 101, 3040, 3130);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_replay_cache_check[7]: %d\n", rc);
+      return 1;
+    }
+
+  /* Expired entries are forgotten. */
+  rc = oath_replay_cache_check (cache, "jas", 0, 101, 3130, 3130);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_check[8]: %d\n", rc);
+      return 1;
+    }
+
+  /* Overflowing the cache must not fail. */
+  for (i = 0; i < 10 * ENTRIES; i++)
+    {
+      sprintf (user, "user%d", i);
+      rc = oath_replay_cache_check (cache, user, 0, 100, 3010, 3100);
+      if (rc != OATH_OK)
+	{
+	  printf ("oath_replay_cache_check[9]: %d\n", rc);
+	  return 1;
+	}
+    }
+
+  oath_replay_cache_done (cache);
+
+  /* Caller provided memory is reused when attached again. */
+  mem = calloc (1, oath_replay_cache_size (ENTRIES));
+  if (mem == NULL)
+    {
+      printf ("calloc\n");
+      return 1;
+    }
+
+  rc = oath_replay_cache_init (&cache, ENTRIES, mem);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_init[2]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache, "jas", 0, 100, 3000, 3100);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_check[10]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_init (&cache2, ENTRIES, mem);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_init[3]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache2, "jas", 0, 100, 3010, 3100);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_replay_cache_check[11]: %d\n", rc);
+      return 1;
+    }
+
+  oath_replay_cache_done (cache2);
+  oath_replay_cache_done (cache);
+  free (mem);
+
+  rc = oath_done ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_done: %d\n", rc);
+      return 1;
+    }
+
+  return 0;
+}
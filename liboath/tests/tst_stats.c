@@ -0,0 +1,115 @@
+/*
+ * tst_stats.c - self-tests for liboath statistics counters
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define SECRET "\x31\x32\x33\x34\x35\x36\x37\x38\x39\x30" \
+  "\x31\x32\x33\x34\x35\x36\x37\x38\x39\x30"
+
+int
+main (void)
+{
+  oath_stats_t stats;
+  int rc;
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_init: %d\n", rc);
+      return 1;
+    }
+
+  oath_stats_reset ();
+
+  /* "969429" is the OTP for counter 3 in RFC 4226. */
+  rc = oath_hotp_validate (SECRET, 20, 0, 10, "969429");
+  if (rc != 3)
+    {
+      printf ("oath_hotp_validate[1]: %d\n", rc);
+      return 1;
+    }
+
+  rc = oath_hotp_validate (SECRET, 20, 0, 2, "969429");
+  if (rc != OATH_INVALID_OTP)
+    {
+      printf ("oath_hotp_validate[2]: %d\n", rc);
+      return 1;
+    }
+
+  oath_stats_get (&stats, sizeof (stats));
+
+  if (stats.hmac_sha1 != 7 || stats.hmac_sha256 != 0
+      || stats.hmac_sha512 != 0)
+    {
+      printf ("oath_stats_get: hmac %lu %lu %lu\n",
+	      (unsigned long) stats.hmac_sha1,
+	      (unsigned long) stats.hmac_sha256,
+	      (unsigned long) stats.hmac_sha512);
+      return 1;
+    }
+
+  if (stats.validations != 2 || stats.validations_ok != 1
+      || stats.validations_failed != 1 || stats.window_hits[3] != 1)
+    {
+      printf ("oath_stats_get: validations %lu %lu %lu %lu\n",
+	      (unsigned long) stats.validations,
+	      (unsigned long) stats.validations_ok,
+	      (unsigned long) stats.validations_failed,
+	      (unsigned long) stats.window_hits[3]);
+      return 1;
+    }
+
+  /* A smaller structure, as from an older oath.h, only gets the
+     counters that fit. */
+  memset (&stats, 0xff, sizeof (stats));
+  oath_stats_get (&stats, 3 * sizeof (uint64_t));
+
+  if (stats.hmac_sha1 != 7 || stats.hmac_sha512 != 0
+      || stats.validations != UINT64_MAX)
+    {
+      printf ("oath_stats_get: size not honoured\n");
+      return 1;
+    }
+
+  oath_stats_reset ();
+  oath_stats_get (&stats, sizeof (stats));
+
+  if (stats.hmac_sha1 != 0 || stats.validations != 0
+      || stats.window_hits[3] != 0)
+    {
+      printf ("oath_stats_reset: counters not cleared\n");
+      return 1;
+    }
+
+  rc = oath_done ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_done: %d\n", rc);
+      return 1;
+    }
+
+  return 0;
+}
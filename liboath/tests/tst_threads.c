@@ -0,0 +1,264 @@
+/*
+ * tst_threads.c - self-tests for concurrent use of liboath
+ * Copyright (C) 2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include "oath.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+#define CREDS "tmp.threads.oath"
+#define CREDS2 "tmp.threads2.oath"
+#define STATE "tmp.threads.state"
+#define STATE2 "tmp.threads2.state"
+#define SECRET "3132333435363738393031323334353637383930"
+#define THREADS 4
+#define LOGINS 8
+
+struct job
+{
+  oath_usersfile_t *uf;
+  char username[16];
+  int rc;
+};
+
+/* Log in LOGINS times in a row with a window of 1, which only works
+   if every previous update of the counter has been recorded. */
+static void *
+login (void *arg)
+{
+  struct job *job = arg;
+  char otp[10];
+  time_t last_otp;
+  int i, rc;
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    {
+      job->rc = rc;
+      return NULL;
+    }
+
+  for (i = 0; i < LOGINS; i++)
+    {
+      rc = oath_hotp_generate ("12345678901234567890", 20, i, 6, false,
+			       OATH_HOTP_DYNAMIC_TRUNCATION, otp);
+      if (rc == OATH_OK)
+	rc = oath_usersfile_authenticate (job->uf, job->username, otp, 1,
+					  NULL, &last_otp);
+      if (rc != OATH_OK)
+	{
+	  printf ("%s login %d: %s (%d)\n", job->username, i,
+		  oath_strerror_name (rc), rc);
+	  break;
+	}
+    }
+
+  job->rc = rc;
+
+  oath_done ();
+
+  return NULL;
+}
+
+/* Fail to log in LOGINS times, all of which must be counted. */
+static void *
+guess (void *arg)
+{
+  struct job *job = arg;
+  time_t last_otp;
+  int i, rc = OATH_OK;
+
+  for (i = 0; i < LOGINS; i++)
+    {
+      rc = oath_usersfile_authenticate (job->uf, job->username, "000000",
+					1, NULL, &last_otp);
+      if (rc != OATH_INVALID_OTP)
+	{
+	  printf ("%s guess %d: %s (%d)\n", job->username, i,
+		  oath_strerror_name (rc), rc);
+	  break;
+	}
+      rc = OATH_OK;
+    }
+
+  job->rc = rc;
+
+  return NULL;
+}
+
+/* The failure count of @username in @statefile, or -1. */
+static long
+read_failures (const char *statefile, const char *username)
+{
+  char user[16], idx[16];
+  long failures;
+  FILE *fh;
+
+  fh = fopen (statefile, "r");
+  if (fh == NULL)
+    return -1;
+  while (fscanf (fh, "%15s %15s %ld %*s", user, idx, &failures) == 3)
+    if (strcmp (user, username) == 0 && strcmp (idx, "-") == 0)
+      {
+	fclose (fh);
+	return failures;
+      }
+  fclose (fh);
+
+  return -1;
+}
+
+static int
+write_usersfile (const char *filename)
+{
+  FILE *fh;
+  int i;
+
+  fh = fopen (filename, "w");
+  if (fh == NULL)
+    return 1;
+  for (i = 0; i < THREADS; i++)
+    fprintf (fh, "HOTP\tuser%d\t-\t%s\n", i, SECRET);
+  return fclose (fh) != 0;
+}
+
+int
+main (void)
+{
+  oath_usersfile_t *uf, *uf2;
+  pthread_t threads[2 * THREADS];
+  struct job jobs[2 * THREADS];
+  int rc;
+  int i;
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_init: %d\n", rc);
+      return 1;
+    }
+
+  /* Glibc reloads an unset TZ on every mktime call, under an internal
+     lock that ThreadSanitizer does not see. */
+  setenv ("TZ", "UTC", 1);
+
+  unlink (STATE);
+  if (write_usersfile (CREDS) || write_usersfile (CREDS2))
+    {
+      printf ("write_usersfile\n");
+      return 1;
+    }
+
+  /* One handle shared by threads updating a statefile, and one shared
+     by threads rewriting the usersfile itself. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc == OATH_OK)
+    rc = oath_usersfile_init (&uf2, CREDS2);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %d\n", rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, STATE);
+
+  for (i = 0; i < 2 * THREADS; i++)
+    {
+      jobs[i].uf = i < THREADS ? uf : uf2;
+      sprintf (jobs[i].username, "user%d", i % THREADS);
+      jobs[i].rc = OATH_OK;
+      if (pthread_create (&threads[i], NULL, login, &jobs[i]) != 0)
+	{
+	  printf ("pthread_create\n");
+	  return 1;
+	}
+    }
+
+  for (i = 0; i < 2 * THREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i < 2 * THREADS; i++)
+    if (jobs[i].rc != OATH_OK)
+      {
+	printf ("thread %d: %s (%d)\n", i, oath_strerror_name (jobs[i].rc),
+		jobs[i].rc);
+	return 1;
+      }
+
+  /* Concurrent failures of one user must not be lost. */
+  unlink (STATE2);
+  oath_usersfile_set_statefile (uf2, STATE2);
+  oath_usersfile_set_throttle (uf2, 0, 2 * THREADS * LOGINS);
+
+  for (i = 0; i < THREADS; i++)
+    {
+      jobs[i].uf = uf2;
+      strcpy (jobs[i].username, "user0");
+      jobs[i].rc = OATH_OK;
+      if (pthread_create (&threads[i], NULL, guess, &jobs[i]) != 0)
+	{
+	  printf ("pthread_create\n");
+	  return 1;
+	}
+    }
+
+  for (i = 0; i < THREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  for (i = 0; i < THREADS; i++)
+    if (jobs[i].rc != OATH_OK)
+      return 1;
+
+  if (read_failures (STATE2, "user0") != THREADS * LOGINS)
+    {
+      printf ("failures: %ld\n", read_failures (STATE2, "user0"));
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+  oath_usersfile_done (uf2);
+  unlink (STATE2);
+  unlink (CREDS);
+  unlink (CREDS2);
+  unlink (STATE);
+
+  rc = oath_done ();
+  if (rc != OATH_OK)
+    {
+      printf ("oath_done: %d\n", rc);
+      return 1;
+    }
+
+  return 0;
+}
+#else
+int
+main (void)
+{
+  return 77;
+}
+#endif
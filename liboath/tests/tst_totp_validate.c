@@ -188,6 +188,47 @@ main (void)
 		  i, otp_counter, tv[i].otp_counter);
 	  return 1;
 	}
+
+      /* Centered on the known drift, the OTP is found at once. */
+      otp_pos = 191;
+      otp_counter = 47;
+
+      rc = oath_totp_validate5 (secret, secretlen, tv[i].now,
+				time_step_size, start_offset, tv[i].window,
+				tv[i].otp_pos, &otp_pos, &otp_counter, 0,
+				tv[i].otp);
+
+      if (rc != 0)
+	{
+	  printf ("validate5 loop %ld failed (rc %d != 0)?!\n", i, rc);
+	  return 1;
+	}
+      if (otp_pos != tv[i].otp_pos)
+	{
+	  printf ("validate5 loop %ld failed (pos %d != %d)?!\n",
+		  i, otp_pos, tv[i].otp_pos);
+	  return 1;
+	}
+      if (otp_counter != tv[i].otp_counter)
+	{
+	  printf ("validate5 loop %ld failed (counter %d != %d)?!\n",
+		  i, otp_counter, tv[i].otp_counter);
+	  return 1;
+	}
+
+      /* Without drift it behaves like validate3. */
+      rc = oath_totp_validate5_callback (secret, secretlen, tv[i].now,
+					 time_step_size, start_offset,
+					 8, tv[i].window, 0, &otp_pos,
+					 &otp_counter, 0, my_strcmp,
+					 (void *) tv[i].otp);
+
+      if (rc != tv[i].expected_rc || otp_pos != tv[i].otp_pos)
+	{
+	  printf ("validate5_callback loop %ld failed (rc %d != %d)?!\n",
+		  i, rc, tv[i].expected_rc);
+	  return 1;
+	}
     }
 
   rc = oath_done ();
@@ -24,18 +24,42 @@
 #include "oath.h"
 
 #include <stdio.h>
+#include <string.h>
 
+#include <fcntl.h>
 #include <sys/stat.h>
 
 #define CREDS "tmp.oath"
+#define STATE "tmp.state"
+#define FILTER "tmp.filter"
+#define COMPACT "tmp.compact"
+#define DRIFT "tmp.drift"
+#define FCREDS "tmp.filter.oath"
+
+static void
+count_phase (void *handle, oath_usersfile_phase phase, uint64_t nsec)
+{
+  unsigned *seen = handle;
+
+  (void) nsec;
+  seen[phase]++;
+}
 
 int
 main (void)
 {
   oath_rc rc;
   time_t last_otp;
+  oath_usersfile_t *uf;
+  oath_replay_cache_t *cache;
   struct stat ufstat1;
   struct stat ufstat2;
+  unsigned seen[OATH_USERSFILE_PHASES] = { 0 };
+  char buf[200];
+  oath_stats_t stats1, stats2;
+  size_t dropped, len;
+  time_t now;
+  FILE *fh;
 
   if (!oath_check_version (OATH_VERSION))
     {
@@ -456,6 +480,659 @@ main (void)
       return 1;
     }
 
+  /* Keep the mutable state of the usersfile in a separate file. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, STATE);
+
+  stat (CREDS, &ufstat1);
+  rc = oath_usersfile_authenticate (uf, "jas", "755224", 0, "1234",
+				    &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[1]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  stat (CREDS, &ufstat2);
+  if (ufstat1.st_ino != ufstat2.st_ino)
+    {
+      printf ("oath_usersfile_authenticate[2]: usersfile %s changed "
+	      "with statefile\n", CREDS);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "jas", "755224", 0, "1234",
+				    &last_otp);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_usersfile_authenticate[3]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  /* The counter must have been recorded in the statefile. */
+  rc = oath_usersfile_authenticate (uf, "jas", "359152", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_INVALID_OTP)
+    {
+      printf ("oath_usersfile_authenticate[4]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "jas", "287082", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[5]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  /* Tokens without a statefile entry use the usersfile fields. */
+  rc = oath_usersfile_authenticate (uf, "fiveuser", "730790", 10, NULL,
+				    &last_otp);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_usersfile_authenticate[6]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  /* Record TOTP replay data in memory only. */
+  rc = oath_replay_cache_init (&cache, 64, NULL);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_replay_cache_init: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_replay_cache (uf, cache);
+
+  stat (CREDS, &ufstat1);
+  rc = oath_usersfile_authenticate (uf, "eve", "619507", 10, NULL,
+				    &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[7]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  stat (CREDS, &ufstat2);
+  if (ufstat1.st_ino != ufstat2.st_ino)
+    {
+      printf ("oath_usersfile_authenticate[8]: usersfile %s changed "
+	      "with replay cache\n", CREDS);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "eve", "619507", 10, NULL,
+				    &last_otp);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_usersfile_authenticate[9]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "eve", "047407", 10, NULL,
+				    &last_otp);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_usersfile_authenticate[10]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+  oath_replay_cache_done (cache);
+
+  /* Count failures in the statefile and lock out after two. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, STATE);
+  oath_usersfile_set_throttle (uf, 0, 2);
+
+  rc = oath_usersfile_authenticate (uf, "jas", "359152", 1, "x",
+				    &last_otp);
+  if (rc != OATH_BAD_PASSWORD)
+    {
+      printf ("oath_usersfile_authenticate[11]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  /* Success resets the failure count. */
+  rc = oath_usersfile_authenticate (uf, "jas", "359152", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[12]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "jas", "969429", 1, "x",
+				    &last_otp);
+  if (rc != OATH_BAD_PASSWORD)
+    {
+      printf ("oath_usersfile_authenticate[13]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "jas", "000000", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_INVALID_OTP)
+    {
+      printf ("oath_usersfile_authenticate[14]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  /* Locked out after max_failures, even with valid credentials. */
+  rc = oath_usersfile_authenticate (uf, "jas", "969429", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_THROTTLED)
+    {
+      printf ("oath_usersfile_authenticate[15]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  /* Refuse a user for a while after a failure. */
+  oath_usersfile_set_throttle (uf, 3600, 0);
+
+  rc = oath_usersfile_authenticate (uf, "foo", "755224", 1, "x",
+				    &last_otp);
+  if (rc != OATH_BAD_PASSWORD)
+    {
+      printf ("oath_usersfile_authenticate[16]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "foo", "287082", 1, "8989",
+				    &last_otp);
+  if (rc != OATH_THROTTLED)
+    {
+      printf ("oath_usersfile_authenticate[17]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  /* Batched updates, the last update of a token wins. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, STATE);
+
+  rc = oath_usersfile_add_update (uf, "jas", 0, 9, NULL, time (NULL));
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_add_update[1]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_add_update (uf, "jas", 0, 5, "254676", time (NULL));
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_add_update[2]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_commit_updates (uf);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_commit_updates[1]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "jas", "520489", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_INVALID_OTP)
+    {
+      printf ("oath_usersfile_authenticate[18]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "jas", "287922", 1, "1234",
+				    &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[19]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  /* Updates of unknown tokens leave the usersfile untouched. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_add_update (uf, "jas", 0, 42, NULL, time (NULL));
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_add_update[3]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_add_update (uf, "jas", 1, 42, NULL, time (NULL));
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_add_update[4]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  stat (CREDS, &ufstat1);
+  rc = oath_usersfile_commit_updates (uf);
+  if (rc != OATH_UNKNOWN_USER)
+    {
+      printf ("oath_usersfile_commit_updates[2]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  stat (CREDS, &ufstat2);
+  if (ufstat1.st_ino != ufstat2.st_ino)
+    {
+      printf ("oath_usersfile_commit_updates[3]: usersfile %s changed\n",
+	      CREDS);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  /* Absent users are rejected by the filter. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_filter (uf, FILTER);
+
+  rc = oath_usersfile_write_filter (uf);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_write_filter: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "nosuchuser", "755224", 1, NULL,
+				    &last_otp);
+  if (rc != OATH_UNKNOWN_USER)
+    {
+      printf ("oath_usersfile_authenticate[20]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_authenticate (uf, "fiveuser", "730790", 10, NULL,
+				    &last_otp);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_usersfile_authenticate[21]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  /* A rewrite of the usersfile by liboath keeps the filter in use. */
+  fh = fopen (FCREDS, "w");
+  if (fh == NULL || fprintf (fh, "HOTP/E\tbob\t-\t00\n") <= 0
+      || fclose (fh) != 0)
+    {
+      printf ("cannot write %s\n", FCREDS);
+      return 1;
+    }
+
+  rc = oath_usersfile_init (&uf, FCREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_filter (uf, FILTER);
+
+  rc = oath_usersfile_write_filter (uf);
+  if (rc == OATH_OK)
+    rc = oath_hotp_generate ("\x00", 1, 0, 6, false,
+			     OATH_HOTP_DYNAMIC_TRUNCATION, buf);
+  if (rc == OATH_OK)
+    rc = oath_usersfile_authenticate (uf, "bob", buf, 0, NULL, &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[filter]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_stats_get (&stats1, sizeof (stats1));
+  rc = oath_usersfile_authenticate (uf, "nosuchuser", "755224", 1, NULL,
+				    &last_otp);
+  oath_stats_get (&stats2, sizeof (stats2));
+  if (rc != OATH_UNKNOWN_USER || stats2.filter_hits != stats1.filter_hits + 1)
+    {
+      printf ("oath_usersfile_authenticate[filter2]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  /* An edit within the same second that keeps the size must not leave
+     the filter in use. */
+  {
+    struct timespec times[2];
+
+    stat (FCREDS, &ufstat1);
+    fh = fopen (FCREDS, "r+");
+    if (fh == NULL || fseek (fh, 7, SEEK_SET) != 0
+	|| fwrite ("bib", 3, 1, fh) != 1 || fclose (fh) != 0)
+      {
+	printf ("cannot edit %s\n", FCREDS);
+	return 1;
+      }
+    times[0] = ufstat1.st_atim;
+    times[1] = ufstat1.st_mtim;
+    times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000;
+    if (utimensat (AT_FDCWD, FCREDS, times, 0) != 0)
+      {
+	printf ("utimensat failed\n");
+	return 1;
+      }
+
+    rc = oath_usersfile_authenticate (uf, "bib", "000000", 0, NULL,
+				      &last_otp);
+    if (rc != OATH_INVALID_OTP)
+      {
+	printf ("oath_usersfile_authenticate[filter3]: %s (%d)\n",
+		oath_strerror_name (rc), rc);
+	return 1;
+      }
+  }
+#endif
+
+  oath_usersfile_done (uf);
+
+  /* Timings are reported only for the phases that ran. */
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_timing_callback (uf, count_phase, seen);
+
+  rc = oath_usersfile_authenticate (uf, "fiveuser", "000000", 1, NULL,
+				    &last_otp);
+  if (rc != OATH_INVALID_OTP)
+    {
+      printf ("oath_usersfile_authenticate[22]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+  if (seen[OATH_USERSFILE_PHASE_PARSE] != 1
+      || seen[OATH_USERSFILE_PHASE_VALIDATE] != 1
+      || seen[OATH_USERSFILE_PHASE_LOCK_WAIT] != 0
+      || seen[OATH_USERSFILE_PHASE_WRITE] != 0)
+    {
+      printf ("oath_usersfile_set_timing_callback: phases %u %u %u %u\n",
+	      seen[OATH_USERSFILE_PHASE_PARSE],
+	      seen[OATH_USERSFILE_PHASE_VALIDATE],
+	      seen[OATH_USERSFILE_PHASE_LOCK_WAIT],
+	      seen[OATH_USERSFILE_PHASE_WRITE]);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  /* Compaction normalizes whitespace and drops unusable lines. */
+  fh = fopen (COMPACT, "w");
+  if (fh == NULL
+      || fputs ("  # comment\n\nHOTP/E  a -    00\nBOGUS\tb\t-\t00\n"
+		"HOTP/E\tc\t-\tzz\nHOTP/E\td\t-\t00\t1x\n"
+		"HOTP/T30 e + 3132 7 123456 2009-12-07T17:25:42L", fh) < 0
+      || fclose (fh) != 0)
+    {
+      printf ("cannot write %s\n", COMPACT);
+      return 1;
+    }
+
+  rc = oath_usersfile_init (&uf, COMPACT);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_usersfile_compact (uf, &dropped);
+  if (rc != OATH_OK || dropped != 3)
+    {
+      printf ("oath_usersfile_compact: %s (%d) dropped %lu\n",
+	      oath_strerror_name (rc), rc, (unsigned long) dropped);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
+  fh = fopen (COMPACT, "r");
+  len = fh ? fread (buf, 1, sizeof (buf) - 1, fh) : 0;
+  buf[len] = '\0';
+  if (fh)
+    fclose (fh);
+  if (strcmp (buf, "# comment\nHOTP/E\ta\t-\t00\n"
+	      "HOTP/T30\te\t+\t3132\t7\t123456\t2009-12-07T17:25:42L\n") != 0)
+    {
+      printf ("oath_usersfile_compact: got %s\n", buf);
+      return 1;
+    }
+
+  /* A token 5 steps slow stays in the window until 5 + 10 steps after
+     its OTP, and must be protected against replay for as long. */
+  fh = fopen (DRIFT, "w");
+  if (fh == NULL
+      || fprintf (fh, "eve\t0\t0\t-\t2006-12-06T00:00:00L\t-5\n") <= 0
+      || fclose (fh) != 0)
+    {
+      printf ("cannot write %s\n", DRIFT);
+      return 1;
+    }
+
+  rc = oath_replay_cache_init (&cache, 64, NULL);
+  if (rc == OATH_OK)
+    rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, DRIFT);
+  oath_usersfile_set_replay_cache (uf, cache);
+
+  now = time (NULL) / 30 - 5;
+  rc = oath_totp_generate ("\x00", 1, now * 30, 30, 0, 6, buf);
+  if (rc == OATH_OK)
+    rc = oath_usersfile_authenticate (uf, "eve", buf, 10, NULL, &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[drift]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache, "eve", 0, now, (now + 15) * 30,
+				(now + 16) * 30);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_replay_cache_check[drift]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+  oath_replay_cache_done (cache);
+
+  /* After an OTP with drift 0 is accepted, a login elsewhere, e.g. on
+     a host not sharing the replay cache, can lower the drift to -10.
+     That keeps the OTP in the window until 20 steps after it, so the
+     cache must reject it for as long. */
+  fh = fopen (DRIFT, "w");
+  if (fh == NULL
+      || fprintf (fh, "eve\t0\t0\t-\t2006-12-06T00:00:00L\t0\n") <= 0
+      || fclose (fh) != 0)
+    {
+      printf ("cannot write %s\n", DRIFT);
+      return 1;
+    }
+
+  rc = oath_replay_cache_init (&cache, 64, NULL);
+  if (rc == OATH_OK)
+    rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, DRIFT);
+  oath_usersfile_set_replay_cache (uf, cache);
+
+  now = time (NULL) / 30;
+  rc = oath_totp_generate ("\x00", 1, now * 30, 30, 0, 6, buf);
+  if (rc == OATH_OK)
+    rc = oath_usersfile_authenticate (uf, "eve", buf, 10, NULL, &last_otp);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_authenticate[lower drift]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  fh = fopen (DRIFT, "w");
+  if (fh == NULL
+      || fprintf (fh, "eve\t0\t0\t-\t2006-12-06T00:00:00L\t-10\n") <= 0
+      || fclose (fh) != 0)
+    {
+      printf ("cannot write %s\n", DRIFT);
+      return 1;
+    }
+
+  rc = oath_replay_cache_check (cache, "eve", 0, now, (now + 20) * 30,
+				(now + 21) * 30);
+  if (rc != OATH_REPLAYED_OTP)
+    {
+      printf ("oath_replay_cache_check[lower drift]: %s (%d)\n",
+	      oath_strerror_name (rc), rc);
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+  oath_replay_cache_done (cache);
+
+  /* One success, the same OTP again, an earlier OTP and a wrong OTP
+     are four validations, one hit, two replays and one failure. */
+  fh = fopen (DRIFT, "w");
+  if (fh == NULL
+      || fprintf (fh, "eve\t0\t0\t-\t2006-12-06T00:00:00L\t0\n") <= 0
+      || fclose (fh) != 0)
+    {
+      printf ("cannot write %s\n", DRIFT);
+      return 1;
+    }
+
+  rc = oath_usersfile_init (&uf, CREDS);
+  if (rc != OATH_OK)
+    {
+      printf ("oath_usersfile_init: %s (%d)\n", oath_strerror_name (rc), rc);
+      return 1;
+    }
+  oath_usersfile_set_statefile (uf, DRIFT);
+
+  oath_stats_get (&stats1, sizeof (stats1));
+  now = time (NULL) / 30;
+  {
+    const struct
+    {
+      time_t step;
+      int rc;
+    } logins[] = {
+      {0, OATH_OK}, {0, OATH_REPLAYED_OTP}, {-1, OATH_REPLAYED_OTP},
+      {1000, OATH_INVALID_OTP}
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof (logins) / sizeof (logins[0]); i++)
+      {
+	rc = oath_totp_generate ("\x00", 1, (now + logins[i].step) * 30,
+				 30, 0, 6, buf);
+	if (rc == OATH_OK)
+	  rc = oath_usersfile_authenticate (uf, "eve", buf, 2, NULL,
+					    &last_otp);
+	if (rc != logins[i].rc)
+	  {
+	    printf ("oath_usersfile_authenticate[stats %ld]: %s (%d)\n",
+		    (long) i, oath_strerror_name (rc), rc);
+	    return 1;
+	  }
+      }
+  }
+  oath_stats_get (&stats2, sizeof (stats2));
+
+  if (stats2.validations - stats1.validations != 4
+      || stats2.validations_ok - stats1.validations_ok != 1
+      || stats2.validations_failed - stats1.validations_failed != 1
+      || stats2.replays - stats1.replays != 2)
+    {
+      printf ("oath_stats_get[usersfile]: %lu %lu %lu %lu\n",
+	      (unsigned long) (stats2.validations - stats1.validations),
+	      (unsigned long) (stats2.validations_ok
+			       - stats1.validations_ok),
+	      (unsigned long) (stats2.validations_failed
+			       - stats1.validations_failed),
+	      (unsigned long) (stats2.replays - stats1.replays));
+      return 1;
+    }
+
+  oath_usersfile_done (uf);
+
   rc = oath_done ();
   if (rc != OATH_OK)
     {
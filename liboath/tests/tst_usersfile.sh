@@ -35,6 +35,6 @@ rc=$?
 sed 's/2006-12-07T00:00:0.L/2006-12-07T00:00:00L/g' < tmp.oath > tmp2.oath
 diff -ur $srcdir/expect.oath tmp2.oath || rc=1
 
-rm -f tmp.oath tmp2.oath
+rm -f tmp.oath tmp2.oath tmp.state tmp.filter tmp.compact tmp.drift tmp.filter.oath
 
 exit $rc
@@ -534,16 +534,117 @@ oath_totp_validate4_callback (const char *secret,
 			      int flags,
 			      oath_validate_strcmp_function strcmp_otp,
 			      void *strcmp_handle)
+{
+  return oath_totp_validate5_callback (secret, secret_length, now,
+				       time_step_size, start_offset,
+				       digits, window, 0, otp_pos,
+				       otp_counter, flags, strcmp_otp,
+				       strcmp_handle);
+}
+
+/**
+ * oath_totp_validate5:
+ * @secret: the shared secret string
+ * @secret_length: length of @secret
+ * @now: Unix time value to validate TOTP for
+ * @time_step_size: time step system parameter (typically 30)
+ * @start_offset: Unix time of when to start counting time steps (typically 0)
+ * @window: how many OTPs after/before the drifted start OTP to test
+ * @drift: expected clock drift of the token, in time steps
+ * @otp_pos: output position relative to @now, in time steps (may be NULL).
+ * @otp_counter: counter value used to calculate OTP value (may be NULL).
+ * @flags: flags indicating mode, one of #oath_totp_flags
+ * @otp: the OTP to validate.
+ *
+ * Validate an OTP according to OATH TOTP algorithm per RFC 6238, for
+ * a token whose clock is known to be @drift time steps ahead (or
+ * behind, if negative).  This is like oath_totp_validate4() except
+ * that the search starts at, and the window is centered on, the
+ * time step @now plus @drift, so tokens with a steady drift are
+ * usually found with a single OTP computation.
+ *
+ * The @otp_pos output is relative to @now rather than to the center
+ * of the window, so it may be used as the @drift for the next
+ * validation of the same token.
+ *
+ * Returns: Returns absolute value of position in OTP window relative
+ *   to its center (zero is first position), or %OATH_INVALID_OTP if
+ *   no OTP was found in OTP window, or an error code.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_validate5 (const char *secret,
+		     size_t secret_length,
+		     time_t now,
+		     unsigned time_step_size,
+		     time_t start_offset,
+		     size_t window,
+		     int drift,
+		     int *otp_pos,
+		     uint64_t * otp_counter, int flags, const char *otp)
+{
+  return oath_totp_validate5_callback (secret, secret_length, now,
+				       time_step_size, start_offset,
+				       strlen (otp), window, drift, otp_pos,
+				       otp_counter, flags,
+				       _oath_strcmp_callback, (void *) otp);
+}
+
+/**
+ * oath_totp_validate5_callback:
+ * @secret: the shared secret string
+ * @secret_length: length of @secret
+ * @now: Unix time value to compute TOTP for
+ * @time_step_size: time step system parameter (typically 30)
+ * @start_offset: Unix time of when to start counting time steps (typically 0)
+ * @digits: number of requested digits in the OTP
+ * @window: how many OTPs after/before the drifted start OTP to test
+ * @drift: expected clock drift of the token, in time steps
+ * @otp_pos: output position relative to @now, in time steps (may be NULL).
+ * @otp_counter: counter value used to calculate OTP value (may be NULL).
+ * @flags: flags indicating mode, one of #oath_totp_flags
+ * @strcmp_otp: function pointer to a strcmp-like function.
+ * @strcmp_handle: caller handle to be passed on to @strcmp_otp.
+ *
+ * Validate an OTP according to OATH TOTP algorithm per RFC 6238,
+ * searching outward from the time step @now plus @drift.  See
+ * oath_totp_validate5() for the meaning of @drift and @otp_pos, and
+ * oath_totp_validate4_callback() for how @strcmp_otp is used.
+ *
+ * Returns: Returns absolute value of position in OTP window relative
+ *   to its center (zero is first position), or %OATH_INVALID_OTP if
+ *   no OTP was found in OTP window, or an error code.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_totp_validate5_callback (const char *secret,
+			      size_t secret_length,
+			      time_t now,
+			      unsigned time_step_size,
+			      time_t start_offset,
+			      unsigned digits,
+			      size_t window,
+			      int drift,
+			      int *otp_pos,
+			      uint64_t * otp_counter,
+			      int flags,
+			      oath_validate_strcmp_function strcmp_otp,
+			      void *strcmp_handle)
 {
   unsigned iter = 0;
   char tmp_otp[10];
-  int rc;
+  int rc, pos = 0;
   uint64_t nts;
 
   if (time_step_size == 0)
     time_step_size = OATH_TOTP_DEFAULT_TIME_STEP_SIZE;
 
-  nts = (now - start_offset) / time_step_size;
+  nts = (now - start_offset) / time_step_size + drift;
+
+  OATH_PROBE2 (totp_validate_entry, nts, window);
+  OATH_STATS_INC (validations);
 
   do
     {
@@ -555,18 +656,23 @@ oath_totp_validate4_callback (const char *secret,
 				 OATH_HOTP_DYNAMIC_TRUNCATION,
 				 flags, tmp_otp);
       if (rc != OATH_OK)
-	return rc;
+	goto done;
 
       if ((rc = strcmp_otp (strcmp_handle, tmp_otp)) == 0)
 	{
 	  if (otp_counter)
 	    *otp_counter = nts + iter;
+	  pos = drift + (int) iter;
 	  if (otp_pos)
-	    *otp_pos = iter;
-	  return iter;
+	    *otp_pos = pos;
+	  rc = iter;
+	  goto done;
 	}
       if (rc < 0)
-	return OATH_STRCMP_ERROR;
+	{
+	  rc = OATH_STRCMP_ERROR;
+	  goto done;
+	}
 
       if (iter > 0)
 	{
@@ -578,21 +684,35 @@ oath_totp_validate4_callback (const char *secret,
 				     OATH_HOTP_DYNAMIC_TRUNCATION,
 				     flags, tmp_otp);
 	  if (rc != OATH_OK)
-	    return rc;
+	    goto done;
 
 	  if ((rc = strcmp_otp (strcmp_handle, tmp_otp)) == 0)
 	    {
 	      if (otp_counter)
 		*otp_counter = nts - iter;
+	      pos = drift - (int) iter;
 	      if (otp_pos)
-		*otp_pos = -iter;
-	      return iter;
+		*otp_pos = pos;
+	      rc = iter;
+	      goto done;
 	    }
 	  if (rc < 0)
-	    return OATH_STRCMP_ERROR;
+	    {
+	      rc = OATH_STRCMP_ERROR;
+	      goto done;
+	    }
 	}
     }
   while (window - iter++ > 0);
 
-  return OATH_INVALID_OTP;
+  rc = OATH_INVALID_OTP;
+
+done:
+  if (rc >= 0)
+    OATH_STATS_HIT (pos - drift);
+  else if (rc == OATH_INVALID_OTP)
+    OATH_STATS_INC (validations_failed);
+  OATH_PROBE3 (totp_validate_return, window, rc, pos);
+
+  return rc;
 }
@@ -23,13 +23,82 @@
 #undef GNULIB_POSIXCHECK	/* too many complaints for now */
 
 #include "oath.h"
+#include "aux.h"		/* OATH_PROBE */
 
 #include <stdio.h>		/* For snprintf, getline. */
 #include <stdlib.h>		/* For free. */
 #include <unistd.h>		/* For ssize_t. */
 #include <fcntl.h>		/* For fcntl. */
 #include <errno.h>		/* For errno. */
+#include <limits.h>		/* For INT_MAX. */
 #include <sys/stat.h>		/* For S_IRUSR, S_IWUSR. */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+/* Time spent in each phase of one authentication, for the timing
+   callback.  Functions take a NULL pointer when nobody is listening,
+   to avoid reading the clock. */
+struct phase_times
+{
+  bool done[OATH_USERSFILE_PHASES];
+  uint64_t nsec[OATH_USERSFILE_PHASES];
+};
+
+static uint64_t
+clock_nsec (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+    return 0;
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+phase_start (const struct phase_times *pt)
+{
+  return pt ? clock_nsec () : 0;
+}
+
+static void
+phase_end (struct phase_times *pt, oath_usersfile_phase phase,
+	   uint64_t start)
+{
+  if (pt)
+    {
+      pt->nsec[phase] += clock_nsec () - start;
+      pt->done[phase] = true;
+    }
+}
+
+/* Files are created readable and writable by the owner only, through
+   explicit modes rather than umask, which is process-global. */
+#define FILE_MODE (S_IRUSR | S_IWUSR)
+
+/* Open file description locks are held per open file, so they also
+   exclude other threads of the same process.  Traditional POSIX locks
+   are per process, and need a mutex to exclude threads. */
+#ifdef F_OFD_SETLKW
+#define LOCK_CMD F_OFD_SETLKW
+#define THREAD_LOCK() do { } while (0)
+#define THREAD_UNLOCK() do { } while (0)
+#else
+#define LOCK_CMD F_SETLKW
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+#define THREAD_LOCK() pthread_mutex_lock (&file_lock)
+#define THREAD_UNLOCK() pthread_mutex_unlock (&file_lock)
+#else
+#define THREAD_LOCK() do { } while (0)
+#define THREAD_UNLOCK() do { } while (0)
+#endif
+#endif
 
 static int
 parse_type (const char *str, unsigned *digits, unsigned *totpstepsize)
@@ -75,30 +144,263 @@ parse_type (const char *str, unsigned *digits, unsigned *totpstepsize)
 static const char *whitespace = " \t\r\n";
 #define TIME_FORMAT_STRING "%Y-%m-%dT%H:%M:%SL"
 
+struct oath_usersfile
+{
+  const char *usersfile;
+  const char *statefile;
+  oath_replay_cache_t *replay_cache;
+  unsigned backoff;
+  unsigned max_failures;
+  const char *filterfile;
+  oath_usersfile_timing_function timing_cb;
+  void *timing_handle;
+  struct state_update *updates;
+  size_t nupdates;
+};
+
+/* Mutable per-token data for a user, as read from the statefile. */
+struct token_state
+{
+  size_t token;
+  uint64_t moving_factor;
+  char *prev_otp;
+  char *timestamp;
+  int drift;
+};
+
+/* Failed authentications for a user, as read from the statefile. */
+struct user_state
+{
+  unsigned failures;
+  time_t last_failure;
+};
+
+/* What to do with the failure count of a user.  The count is changed
+   while the statefile is locked, so that concurrent failures are all
+   counted. */
+enum state_failures
+{
+  FAILURES_KEEP,
+  /* Remove the count, after checking the throttle once more. */
+  FAILURES_RESET,
+  /* Add one failure at the time of the update. */
+  FAILURES_ADD
+};
+
+/* Changes to make to the statefile for one user. */
+struct state_update
+{
+  const char *username;
+  /* Token data to record, unless otp is NULL. */
+  size_t token;
+  const char *otp;
+  uint64_t moving_factor;
+  int drift;
+  enum state_failures failures;
+  char timestamp[30];
+  /* Order in which queued updates were added. */
+  size_t seq;
+};
+
 static int
-parse_usersfile (const char *username,
-		 const char *otp,
-		 size_t window,
-		 const char *passwd,
-		 time_t * last_otp,
+parse_timestamp (const char *p, time_t * last_otp)
+{
+  struct tm tm;
+  char *ts;
+
+  ts = strptime (p, TIME_FORMAT_STRING, &tm);
+  if (ts == NULL || *ts != '\0')
+    return OATH_INVALID_TIMESTAMP;
+  tm.tm_isdst = -1;
+  if (last_otp)
+    {
+      *last_otp = mktime (&tm);
+      if (*last_otp == (time_t) - 1)
+	return OATH_INVALID_TIMESTAMP;
+    }
+
+  return OATH_OK;
+}
+
+static void
+free_states (struct token_state *states, size_t nstates)
+{
+  size_t i;
+
+  for (i = 0; i < nstates; i++)
+    {
+      free (states[i].prev_otp);
+      free (states[i].timestamp);
+    }
+  free (states);
+}
+
+static const struct token_state *
+find_state (const struct token_state *states, size_t nstates, size_t token)
+{
+  size_t i;
+
+  for (i = 0; i < nstates; i++)
+    if (states[i].token == token)
+      return &states[i];
+
+  return NULL;
+}
+
+/* Read the failure count and the timestamp of the last failure from
+   the rest of a statefile line, after the "-" token index. */
+static int
+parse_user_state (char **saveptr, struct user_state *us)
+{
+  char *endptr;
+  char *p;
+
+  /* Read failure count. */
+  p = strtok_r (NULL, whitespace, saveptr);
+  if (p == NULL)
+    return OATH_INVALID_COUNTER;
+  us->failures = strtoul (p, &endptr, 10);
+  if (endptr && *endptr != '\0')
+    return OATH_INVALID_COUNTER;
+
+  /* Read timestamp of last failure. */
+  p = strtok_r (NULL, whitespace, saveptr);
+  if (p == NULL)
+    return OATH_INVALID_TIMESTAMP;
+
+  return parse_timestamp (p, &us->last_failure);
+}
+
+/* Collect all statefile entries for @username.  Each line holds the
+   username, the token index (the position of the token among the
+   lines for that user in the usersfile), the moving factor and
+   optionally the last OTP, its timestamp and the clock drift of a
+   TOTP token in time steps.  A token index of "-"
+   instead marks a line with the number of failed authentications for
+   the user and the timestamp of the last one. */
+static int
+parse_statefile (const char *username,
 		 FILE * infh,
-		 char **lineptr, size_t * n, uint64_t * new_moving_factor,
-		 size_t * skipped_users)
+		 char **lineptr, size_t * n,
+		 struct token_state **states, size_t * nstates,
+		 struct user_state *us)
+{
+  while (getline (lineptr, n, infh) != -1)
+    {
+      char *saveptr;
+      char *p = strtok_r (*lineptr, whitespace, &saveptr);
+      struct token_state *tmp, *s;
+      char *endptr;
+      int rc;
+
+      if (p == NULL || *p == '#' || strcmp (p, username) != 0)
+	continue;
+
+      p = strtok_r (NULL, whitespace, &saveptr);
+      if (p && strcmp (p, "-") == 0)
+	{
+	  rc = parse_user_state (&saveptr, us);
+	  if (rc != OATH_OK)
+	    return rc;
+	  continue;
+	}
+
+      tmp = realloc (*states, (*nstates + 1) * sizeof (**states));
+      if (tmp == NULL)
+	return OATH_MALLOC_ERROR;
+      *states = tmp;
+      s = &tmp[(*nstates)++];
+      memset (s, 0, sizeof (*s));
+
+      /* Read token index. */
+      if (p == NULL)
+	return OATH_INVALID_COUNTER;
+      s->token = strtoul (p, &endptr, 10);
+      if (endptr && *endptr != '\0')
+	return OATH_INVALID_COUNTER;
+
+      /* Read moving factor. */
+      p = strtok_r (NULL, whitespace, &saveptr);
+      if (p == NULL)
+	return OATH_INVALID_COUNTER;
+      s->moving_factor = strtoull (p, &endptr, 10);
+      if (endptr && *endptr != '\0')
+	return OATH_INVALID_COUNTER;
+
+      /* Read (optional) last OTP. */
+      p = strtok_r (NULL, whitespace, &saveptr);
+      if (p && (s->prev_otp = strdup (p)) == NULL)
+	return OATH_MALLOC_ERROR;
+
+      /* Read (optional) timestamp. */
+      p = strtok_r (NULL, whitespace, &saveptr);
+      if (p && (s->timestamp = strdup (p)) == NULL)
+	return OATH_MALLOC_ERROR;
+
+      /* Read (optional) drift. */
+      p = strtok_r (NULL, whitespace, &saveptr);
+      if (p)
+	{
+	  s->drift = strtol (p, &endptr, 10);
+	  if (endptr && *endptr != '\0')
+	    return OATH_INVALID_COUNTER;
+	}
+    }
+
+  return OATH_OK;
+}
+
+/* One of the tokens of the user being authenticated. */
+struct user_token
+{
+  size_t token;
+  unsigned totpstepsize;
+  char secret[32];
+  size_t secret_length;
+  uint64_t start_moving_factor;
+  char *prev_otp;
+  bool has_last_otp;
+  time_t last_otp;
+  /* Observed clock drift of a TOTP token, in time steps. */
+  int drift;
+};
+
+static void
+free_tokens (struct user_token *tokens, size_t ntokens)
+{
+  size_t i;
+
+  for (i = 0; i < ntokens; i++)
+    free (tokens[i].prev_otp);
+  free (tokens);
+}
+
+/* Collect all tokens of @username, whose password matches @passwd,
+   in one pass over the usersfile.  *@bad_password tells whether the
+   last line for the user was rejected due to the password. */
+static int
+collect_tokens (const char *username,
+		const char *passwd,
+		FILE * infh,
+		char **lineptr, size_t * n,
+		const struct token_state *states, size_t nstates,
+		struct user_token **tokens, size_t * ntokens,
+		bool * bad_password)
 {
-  int bad_password = 0;
+  size_t next_token = 0;
 
-  *skipped_users = 0;
+  *bad_password = false;
 
   while (getline (lineptr, n, infh) != -1)
     {
       char *saveptr;
       char *p = strtok_r (*lineptr, whitespace, &saveptr);
       unsigned digits, totpstepsize;
-      char secret[32];
-      size_t secret_length = sizeof (secret);
-      uint64_t start_moving_factor = 0;
-      int rc = 0;
-      char *prev_otp = NULL;
+      struct user_token *tmp, *t;
+      const struct token_state *state;
+      char *prev_otp;
+      size_t token;
+      int rc;
 
       if (p == NULL)
 	continue;
@@ -112,6 +414,8 @@ parse_usersfile (const char *username,
       if (p == NULL || strcmp (p, username) != 0)
 	continue;
 
+      token = next_token++;
+
       /* Read password. */
       p = strtok_r (NULL, whitespace, &saveptr);
       if (passwd)
@@ -119,35 +423,33 @@ parse_usersfile (const char *username,
 	  if (p == NULL)
 	    continue;
 	  if (strcmp (p, "-") == 0)
-	    {
-	      if (*passwd != '\0')
-		{
-		  bad_password = 1;
-		  rc = OATH_BAD_PASSWORD;
-		}
-	    }
+	    *bad_password = *passwd != '\0';
 	  else if (strcmp (p, "+") == 0)
-	    {
-	      /* Externally verified. */
-	    }
-	  else if (strcmp (p, passwd) != 0)
-	    {
-	      bad_password = 1;
-	      rc = OATH_BAD_PASSWORD;
-	    }
-	  if (rc == OATH_BAD_PASSWORD)
-	    {
-	      (*skipped_users)++;
-	      continue;
-	    }
-	  bad_password = 0;
+	    /* Externally verified. */
+	    *bad_password = false;
+	  else
+	    *bad_password = strcmp (p, passwd) != 0;
+	  if (*bad_password)
+	    continue;
 	}
 
       /* Read key. */
       p = strtok_r (NULL, whitespace, &saveptr);
       if (p == NULL)
 	continue;
-      rc = oath_hex2bin (p, secret, &secret_length);
+
+      tmp = realloc (*tokens, (*ntokens + 1) * sizeof (**tokens));
+      if (tmp == NULL)
+	return OATH_MALLOC_ERROR;
+      *tokens = tmp;
+      t = &tmp[*ntokens];
+      memset (t, 0, sizeof (*t));
+      t->token = token;
+      t->totpstepsize = totpstepsize;
+      t->secret_length = sizeof (t->secret);
+      (*ntokens)++;
+
+      rc = oath_hex2bin (p, t->secret, &t->secret_length);
       if (rc != OATH_OK)
 	return rc;
 
@@ -159,7 +461,7 @@ parse_usersfile (const char *username,
 	  unsigned long long int ull = strtoull (p, &endptr, 10);
 	  if (endptr && *endptr != '\0')
 	    return OATH_INVALID_COUNTER;
-	  start_moving_factor = ull;
+	  t->start_moving_factor = ull;
 	}
 
       /* Read (optional) last OTP */
@@ -167,71 +469,283 @@ parse_usersfile (const char *username,
 
       /* Read (optional) last_otp */
       p = strtok_r (NULL, whitespace, &saveptr);
-      if (p)
+
+      /* Mutable fields in the statefile take precedence. */
+      state = find_state (states, nstates, token);
+      if (state)
 	{
-	  struct tm tm;
-	  char *ts;
-
-	  ts = strptime (p, TIME_FORMAT_STRING, &tm);
-	  if (ts == NULL || *ts != '\0')
-	    return OATH_INVALID_TIMESTAMP;
-	  tm.tm_isdst = -1;
-	  if (last_otp)
-	    {
-	      *last_otp = mktime (&tm);
-	      if (*last_otp == (time_t) - 1)
-		return OATH_INVALID_TIMESTAMP;
-	    }
+	  t->start_moving_factor = state->moving_factor;
+	  prev_otp = state->prev_otp;
+	  p = state->timestamp;
+	  t->drift = state->drift;
 	}
 
-      if (prev_otp && strcmp (prev_otp, otp) == 0)
-	return OATH_REPLAYED_OTP;
-
-      if (totpstepsize == 0)
-	rc = oath_hotp_validate (secret, secret_length,
-				 start_moving_factor, window, otp);
-      else if (prev_otp)
+      if (p)
 	{
-	  int prev_otp_pos, this_otp_pos, tmprc;
-	  rc = oath_totp_validate2 (secret, secret_length,
-				    time (NULL), totpstepsize, 0, window,
-				    &this_otp_pos, otp);
-	  if (rc == OATH_INVALID_OTP)
-	    {
-	      (*skipped_users)++;
-	      continue;
-	    }
-	  if (rc < 0)
+	  rc = parse_timestamp (p, &t->last_otp);
+	  if (rc != OATH_OK)
 	    return rc;
-	  tmprc = oath_totp_validate2 (secret, secret_length,
-				       time (NULL), totpstepsize, 0, window,
-				       &prev_otp_pos, prev_otp);
-	  if (tmprc >= 0 && prev_otp_pos >= this_otp_pos)
-	    return OATH_REPLAYED_OTP;
-	}
-      else
-	rc = oath_totp_validate (secret, secret_length,
-				 time (NULL), totpstepsize, 0, window, otp);
-      if (rc == OATH_INVALID_OTP)
-	{
-	  (*skipped_users)++;
-	  continue;
+	  t->has_last_otp = true;
 	}
+
+      /* A "-" is written when there is no last OTP to record. */
+      if (prev_otp && strcmp (prev_otp, "-") != 0
+	  && (t->prev_otp = strdup (prev_otp)) == NULL)
+	return OATH_MALLOC_ERROR;
+    }
+
+  return OATH_OK;
+}
+
+/* Compare @otp with the OTP of token @t at counter @moving_factor. */
+static int
+token_otp_matches (const struct user_token *t, uint64_t moving_factor,
+		   const char *otp)
+{
+  char tmp_otp[10];
+  int rc;
+
+  rc = oath_hotp_generate (t->secret, t->secret_length, moving_factor,
+			   strlen (otp), false,
+			   OATH_HOTP_DYNAMIC_TRUNCATION, tmp_otp);
+  if (rc != OATH_OK)
+    return rc;
+
+  return strcmp (tmp_otp, otp) == 0;
+}
+
+/* Limit a learned clock drift to the search window, so that repeated
+   logins at the edge of the window cannot move the search ever
+   further away from the current time. */
+static int
+clamp_drift (int drift, size_t window)
+{
+  if (window > INT_MAX)
+    return drift;
+  if (drift > (int) window)
+    return window;
+  if (drift < -(int) window)
+    return -(int) window;
+  return drift;
+}
+
+/* Find the previous OTP of TOTP token @t in the window, searched like
+   search_tokens does but without counting it as a validation.
+   Return 1 and its position in *@pos if found, 0 if not, or an error
+   code. */
+static int
+find_prev_otp (const struct user_token *t, time_t now, size_t window,
+	       int *pos)
+{
+  uint64_t nts = now / t->totpstepsize + t->drift;
+  size_t iter;
+  int rc;
+
+  for (iter = 0; iter <= window; iter++)
+    {
+      rc = token_otp_matches (t, nts + iter, t->prev_otp);
+      if (rc > 0)
+	*pos = t->drift + (int) iter;
+      if (rc != 0)
+	return rc;
+
+      if (iter == 0)
+	continue;
+
+      rc = token_otp_matches (t, nts - iter, t->prev_otp);
+      if (rc > 0)
+	*pos = t->drift - (int) iter;
+      if (rc != 0)
+	return rc;
+    }
+
+  return 0;
+}
+
+/* Handle a match of the OTP for token @t at search position @pos, with
+   TOTP time-step counter @otp_counter.  For TOTP tokens @pos is
+   relative to the current time step, and is stored in *@drift, within
+   the limits of clamp_drift. */
+static int
+token_matched (const char *username,
+	       size_t window,
+	       time_t now,
+	       const struct user_token *t,
+	       int pos,
+	       uint64_t otp_counter,
+	       oath_replay_cache_t * replay_cache,
+	       uint64_t * new_moving_factor, size_t * token, bool * record,
+	       int *drift)
+{
+  *token = t->token;
+  *drift = t->totpstepsize ? clamp_drift (pos, window) : 0;
+
+  if (t->totpstepsize && replay_cache)
+    {
+      /* The OTP stays in the window until the current time step is
+         window steps past it, counted from the window center.  Later
+         logins may move the center down to -window, see clamp_drift,
+         so keep it for twice the window. */
+      time_t expires = (otp_counter + 2 * (uint64_t) window + 1)
+	* t->totpstepsize;
+      int rc;
+
+      /* The replay cache replaces the scan for prev_otp and the
+         recording of the OTP in the file. */
+      rc = oath_replay_cache_check (replay_cache, username, t->token,
+				    otp_counter, now, expires);
+      if (rc != OATH_OK)
+	return rc;
+      *record = false;
+    }
+  else if (t->totpstepsize && t->prev_otp)
+    {
+      int prev_otp_pos = 0, rc;
+
+      rc = find_prev_otp (t, now, window, &prev_otp_pos);
       if (rc < 0)
 	return rc;
-      *new_moving_factor = start_moving_factor + rc;
-      return OATH_OK;
+      if (rc && prev_otp_pos >= pos)
+	{
+	  OATH_STATS_INC (replays);
+	  return OATH_REPLAYED_OTP;
+	}
+    }
+
+  OATH_STATS_HIT (pos - t->drift);
+
+  *new_moving_factor = t->start_moving_factor + (pos < 0 ? -pos : pos);
+
+  return OATH_OK;
+}
+
+/* Search all tokens of the user at once, one window position at a
+   time, so that the first token matching at the nearest position is
+   found without a full window scan of the other tokens.  TOTP tokens
+   are searched around their observed drift. */
+static int
+search_tokens (const char *username,
+	       const char *otp,
+	       size_t window,
+	       const struct user_token *tokens, size_t ntokens,
+	       oath_replay_cache_t * replay_cache,
+	       uint64_t * new_moving_factor, size_t * token, bool * record,
+	       int *drift)
+{
+  time_t now = time (NULL);
+  size_t iter, i;
+  int rc;
+
+  OATH_STATS_INC (validations);
+
+  for (iter = 0; iter <= window; iter++)
+    for (i = 0; i < ntokens; i++)
+      {
+	const struct user_token *t = &tokens[i];
+	uint64_t nts;
+
+	if (t->totpstepsize == 0)
+	  {
+	    rc = token_otp_matches (t, t->start_moving_factor + iter, otp);
+	    if (rc < 0)
+	      return rc;
+	    if (rc)
+	      return token_matched (username, window, now, t, iter, 0,
+				    replay_cache, new_moving_factor, token,
+				    record, drift);
+	    continue;
+	  }
+
+	nts = now / t->totpstepsize + t->drift;
+
+	rc = token_otp_matches (t, nts + iter, otp);
+	if (rc < 0)
+	  return rc;
+	if (rc)
+	  return token_matched (username, window, now, t,
+				t->drift + (int) iter, nts + iter,
+				replay_cache, new_moving_factor, token,
+				record, drift);
+
+	if (iter == 0)
+	  continue;
+
+	rc = token_otp_matches (t, nts - iter, otp);
+	if (rc < 0)
+	  return rc;
+	if (rc)
+	  return token_matched (username, window, now, t,
+				t->drift - (int) iter, nts - iter,
+				replay_cache, new_moving_factor, token,
+				record, drift);
+      }
+
+  OATH_STATS_INC (validations_failed);
+
+  return OATH_INVALID_OTP;
+}
+
+static int
+parse_usersfile (const char *username,
+		 const char *otp,
+		 size_t window,
+		 const char *passwd,
+		 time_t * last_otp,
+		 FILE * infh,
+		 char **lineptr, size_t * n,
+		 const struct token_state *states, size_t nstates,
+		 oath_replay_cache_t * replay_cache,
+		 uint64_t * new_moving_factor, size_t * token, bool * record,
+		 int *drift, struct phase_times *pt)
+{
+  struct user_token *tokens = NULL;
+  size_t ntokens = 0, i;
+  bool bad_password;
+  uint64_t start;
+  int rc;
+
+  *record = true;
+
+  start = phase_start (pt);
+  rc = collect_tokens (username, passwd, infh, lineptr, n, states, nstates,
+		       &tokens, &ntokens, &bad_password);
+  phase_end (pt, OATH_USERSFILE_PHASE_PARSE, start);
+  if (rc != OATH_OK)
+    goto done;
+
+  if (ntokens == 0)
+    {
+      rc = bad_password ? OATH_BAD_PASSWORD : OATH_UNKNOWN_USER;
+      goto done;
     }
 
-  if (*skipped_users)
+  for (i = 0; i < ntokens; i++)
+    tokens[i].drift = clamp_drift (tokens[i].drift, window);
+
+  for (i = 0; i < ntokens; i++)
     {
-      if (bad_password)
-	return OATH_BAD_PASSWORD;
-      else
-	return OATH_INVALID_OTP;
+      if (tokens[i].has_last_otp)
+	*last_otp = tokens[i].last_otp;
+      if (tokens[i].prev_otp && strcmp (tokens[i].prev_otp, otp) == 0)
+	{
+	  OATH_STATS_INC (validations);
+	  OATH_STATS_INC (replays);
+	  rc = OATH_REPLAYED_OTP;
+	  goto done;
+	}
     }
 
-  return OATH_UNKNOWN_USER;
+  start = phase_start (pt);
+  rc = search_tokens (username, otp, window, tokens, ntokens,
+		      replay_cache, new_moving_factor, token, record, drift);
+  phase_end (pt, OATH_USERSFILE_PHASE_VALIDATE, start);
+  if (rc == OATH_INVALID_OTP && bad_password)
+    rc = OATH_BAD_PASSWORD;
+
+done:
+  free_tokens (tokens, ntokens);
+
+  return rc;
 }
 
 static int
@@ -241,15 +755,16 @@ update_usersfile2 (const char *username,
 		   FILE * outfh,
 		   char **lineptr,
 		   size_t * n, char *timestamp, uint64_t new_moving_factor,
-		   size_t skipped_users)
+		   size_t token)
 {
-  size_t got_users = 0;
+  size_t next_token = 0;
 
   while (getline (lineptr, n, infh) != -1)
     {
       char *saveptr;
       char *origline;
       const char *user, *type, *passwd, *secret;
+      unsigned digits, totpstepsize;
       int r;
 
       origline = strdup (*lineptr);
@@ -261,7 +776,8 @@ update_usersfile2 (const char *username,
       /* Read username */
       user = strtok_r (NULL, whitespace, &saveptr);
       if (user == NULL || strcmp (user, username) != 0
-	  || got_users++ != skipped_users)
+	  || parse_type (type, &digits, &totpstepsize) != 0
+	  || next_token++ != token)
 	{
 	  r = fprintf (outfh, "%s", origline);
 	  free (origline);
@@ -289,119 +805,1179 @@ update_usersfile2 (const char *username,
   return OATH_OK;
 }
 
+/* Create and lock "@filename.lock", to serialize all writers of
+   @filename. */
 static int
-update_usersfile (const char *usersfile,
-		  const char *username,
-		  const char *otp,
-		  FILE * infh,
-		  char **lineptr,
-		  size_t * n, char *timestamp, uint64_t new_moving_factor,
-		  size_t skipped_users)
+lock_file (const char *filename, FILE ** lockfh, char **lockfile,
+	   struct phase_times *pt)
 {
-  FILE *outfh, *lockfh;
-  int rc;
-  char *newfilename, *lockfile;
+  struct flock l;
+  struct stat st1, st2;
+  uint64_t start;
+  int len, fd, rc;
 
-  /* Rewind input file. */
-  {
-    int pos;
+  len = asprintf (lockfile, "%s.lock", filename);
+  if (*lockfile == NULL || ((size_t) len) != strlen (filename) + 5)
+    return OATH_PRINTF_ERROR;
 
-    pos = fseeko (infh, 0L, SEEK_SET);
-    if (pos == -1)
-      return OATH_FILE_SEEK_ERROR;
-    clearerr (infh);
-  }
+  start = phase_start (pt);
 
-  /* Open lockfile. */
-  {
-    int l;
+  THREAD_LOCK ();
 
-    l = asprintf (&lockfile, "%s.lock", usersfile);
-    if (lockfile == NULL || ((size_t) l) != strlen (usersfile) + 5)
-      return OATH_PRINTF_ERROR;
+  for (;;)
+    {
+      /* Open lockfile. */
+      fd = open (*lockfile, O_WRONLY | O_CREAT | O_CLOEXEC, FILE_MODE);
+      if (fd < 0 || (*lockfh = fdopen (fd, "w")) == NULL)
+	{
+	  if (fd >= 0)
+	    close (fd);
+	  THREAD_UNLOCK ();
+	  free (*lockfile);
+	  return OATH_FILE_CREATE_ERROR;
+	}
 
-    lockfh = fopen (lockfile, "w");
-    if (!lockfh)
-      {
-	free (lockfile);
-	return OATH_FILE_CREATE_ERROR;
-      }
-  }
+      /* Lock the lockfile. */
+      memset (&l, 0, sizeof (l));
+      l.l_whence = SEEK_SET;
+      l.l_start = 0;
+      l.l_len = 0;
+      l.l_type = F_WRLCK;
 
-  /* Lock the lockfile. */
-  {
-    struct flock l;
+      while ((rc = fcntl (fd, LOCK_CMD, &l)) < 0 && errno == EINTR)
+	continue;
+      if (rc == -1)
+	{
+	  fclose (*lockfh);
+	  THREAD_UNLOCK ();
+	  free (*lockfile);
+	  return OATH_FILE_LOCK_ERROR;
+	}
 
-    memset (&l, 0, sizeof (l));
-    l.l_whence = SEEK_SET;
-    l.l_start = 0;
-    l.l_len = 0;
-    l.l_type = F_WRLCK;
+      /* The previous holder removes the lockfile when done, so make
+         sure the lock is on the file that is still in place. */
+      if (fstat (fd, &st1) == 0 && stat (*lockfile, &st2) == 0
+	  && st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+	{
+	  phase_end (pt, OATH_USERSFILE_PHASE_LOCK_WAIT, start);
+	  OATH_PROBE1 (lock_acquire, filename);
+	  return OATH_OK;
+	}
 
-    while ((rc = fcntl (fileno (lockfh), F_SETLKW, &l)) < 0 && errno == EINTR)
-      continue;
-    if (rc == -1)
-      {
-	fclose (lockfh);
-	free (lockfile);
-	return OATH_FILE_LOCK_ERROR;
-      }
-  }
+      fclose (*lockfh);
+    }
+}
 
-  /* Open the "new" file. */
-  {
-    int l;
+static int
+unlock_file (FILE * lockfh, char *lockfile, int rc)
+{
+  if (unlink (lockfile) != 0)
+    rc = OATH_FILE_UNLINK_ERROR;
+  if (fclose (lockfh) != 0)
+    rc = OATH_FILE_CLOSE_ERROR;
+  free (lockfile);
 
-    l = asprintf (&newfilename, "%s.new", usersfile);
-    if (newfilename == NULL || ((size_t) l) != strlen (usersfile) + 4)
-      {
-	fclose (lockfh);
-	free (lockfile);
-	return OATH_PRINTF_ERROR;
-      }
+  THREAD_UNLOCK ();
 
-    outfh = fopen (newfilename, "w");
-    if (!outfh)
-      {
-	free (newfilename);
-	fclose (lockfh);
-	free (lockfile);
-	return OATH_FILE_CREATE_ERROR;
-      }
-  }
+  OATH_PROBE1 (lock_release, rc);
 
-  /* Create the new usersfile content. */
-  rc = update_usersfile2 (username, otp, infh, outfh, lineptr, n,
-			  timestamp, new_moving_factor, skipped_users);
+  return rc;
+}
+
+static int
+create_new_file (const char *filename, FILE ** outfh, char **newfilename)
+{
+  int len, fd;
+
+  len = asprintf (newfilename, "%s.new", filename);
+  if (*newfilename == NULL || ((size_t) len) != strlen (filename) + 4)
+    return OATH_PRINTF_ERROR;
+
+  fd = open (*newfilename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+	     FILE_MODE);
+  if (fd < 0 || (*outfh = fdopen (fd, "w")) == NULL)
+    {
+      if (fd >= 0)
+	close (fd);
+      free (*newfilename);
+      return OATH_FILE_CREATE_ERROR;
+    }
+
+  return OATH_OK;
+}
+
+static int
+commit_new_file (const char *filename, FILE * outfh, char *newfilename,
+		 int rc, struct phase_times *pt)
+{
+  uint64_t start;
 
   /* On success, flush the buffers. */
+  start = phase_start (pt);
   if (rc == OATH_OK && fflush (outfh) != 0)
     rc = OATH_FILE_FLUSH_ERROR;
+  phase_end (pt, OATH_USERSFILE_PHASE_WRITE, start);
 
   /* On success, sync the disks. */
-  if (rc == OATH_OK && fsync (fileno (outfh)) != 0)
-    rc = OATH_FILE_SYNC_ERROR;
+  start = phase_start (pt);
+  OATH_PROBE1 (fsync_entry, filename);
+  if (rc == OATH_OK)
+    {
+      off_t size = ftello (outfh);
 
-  /* Close the file regardless of success. */
+      if (size > 0)
+	OATH_STATS_ADD (bytes_written, size);
+      OATH_STATS_INC (fsyncs);
+      if (fsync (fileno (outfh)) != 0)
+	rc = OATH_FILE_SYNC_ERROR;
+    }
+  OATH_PROBE1 (fsync_return, rc);
+  phase_end (pt, OATH_USERSFILE_PHASE_FSYNC, start);
+
+  /* Close the file regardless of success. */
   if (fclose (outfh) != 0)
     rc = OATH_FILE_CLOSE_ERROR;
 
-  /* On success, overwrite the usersfile with the new copy. */
-  if (rc == OATH_OK && rename (newfilename, usersfile) != 0)
-    rc = OATH_FILE_RENAME_ERROR;
+  /* On success, overwrite the old file with the new copy. */
+  start = phase_start (pt);
+  if (rc == OATH_OK && rename (newfilename, filename) != 0)
+    rc = OATH_FILE_RENAME_ERROR;
+  phase_end (pt, OATH_USERSFILE_PHASE_RENAME, start);
+
+  /* Something has failed, don't leave garbage lying around. */
+  if (rc != OATH_OK)
+    unlink (newfilename);
+
+  free (newfilename);
+
+  return rc;
+}
+
+static int
+update_usersfile (const char *usersfile,
+		  const char *username,
+		  const char *otp,
+		  char **lineptr,
+		  size_t * n, char *timestamp, uint64_t new_moving_factor,
+		  size_t token, struct stat *oldst, struct phase_times *pt)
+{
+  FILE *infh, *outfh, *lockfh;
+  uint64_t start;
+  int rc;
+  char *newfilename, *lockfile;
+
+  rc = lock_file (usersfile, &lockfh, &lockfile, pt);
+  if (rc != OATH_OK)
+    return rc;
+
+  /* Re-read the usersfile now that we hold the lock, since other users
+     may have been updated after we parsed it. */
+  infh = fopen (usersfile, "r");
+  if (infh == NULL || fstat (fileno (infh), oldst) != 0)
+    {
+      if (infh)
+	fclose (infh);
+      return unlock_file (lockfh, lockfile, OATH_NO_SUCH_FILE);
+    }
+
+  rc = create_new_file (usersfile, &outfh, &newfilename);
+  if (rc != OATH_OK)
+    {
+      fclose (infh);
+      return unlock_file (lockfh, lockfile, rc);
+    }
+
+  /* Create the new usersfile content. */
+  start = phase_start (pt);
+  rc = update_usersfile2 (username, otp, infh, outfh, lineptr, n,
+			  timestamp, new_moving_factor, token);
+  phase_end (pt, OATH_USERSFILE_PHASE_WRITE, start);
+
+  fclose (infh);
+
+  rc = commit_new_file (usersfile, outfh, newfilename, rc, pt);
+
+  /* Complete, close the lockfile */
+  return unlock_file (lockfh, lockfile, rc);
+}
+
+static int
+print_token_state (FILE * outfh, const struct state_update *u)
+{
+  int r;
+
+  if (u->drift)
+    r = fprintf (outfh, "%s\t%lu\t%llu\t%s\t%s\t%d\n",
+		 u->username, (unsigned long) u->token,
+		 (unsigned long long) u->moving_factor, u->otp, u->timestamp,
+		 u->drift);
+  else
+    r = fprintf (outfh, "%s\t%lu\t%llu\t%s\t%s\n",
+		 u->username, (unsigned long) u->token,
+		 (unsigned long long) u->moving_factor, u->otp, u->timestamp);
+  if (r <= 0)
+    return OATH_PRINTF_ERROR;
+
+  return OATH_OK;
+}
+
+static int
+print_user_state (FILE * outfh, const struct state_update *u,
+		  unsigned failures)
+{
+  int r;
+
+  if (failures == 0)
+    return OATH_OK;
+
+  r = fprintf (outfh, "%s\t-\t%u\t%s\n",
+	       u->username, failures, u->timestamp);
+  if (r <= 0)
+    return OATH_PRINTF_ERROR;
+
+  return OATH_OK;
+}
+
+static int
+cmp_update (const void *a, const void *b)
+{
+  const struct state_update *ua = a, *ub = b;
+  int c = strcmp (ua->username, ub->username);
+
+  if (c != 0)
+    return c;
+  if (ua->token != ub->token)
+    return ua->token < ub->token ? -1 : 1;
+  if (ua->seq != ub->seq)
+    return ua->seq < ub->seq ? -1 : 1;
+  return 0;
+}
+
+/* Find the first of the updates, sorted by cmp_update, for @username. */
+static size_t
+first_update (const struct state_update *u, size_t nu, const char *username)
+{
+  size_t lo = 0, hi = nu;
+
+  while (lo < hi)
+    {
+      size_t mid = lo + (hi - lo) / 2;
+
+      if (strcmp (u[mid].username, username) < 0)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+
+  if (lo < nu && strcmp (u[lo].username, username) == 0)
+    return lo;
+
+  return nu;
+}
+
+/* Find the update for @token among those for one user starting at
+   @first, or return @nu. */
+static size_t
+find_update (const struct state_update *u, size_t nu, size_t first,
+	     size_t token)
+{
+  size_t i;
+
+  for (i = first; i < nu && strcmp (u[i].username, u[first].username) == 0
+       && u[i].token <= token; i++)
+    if (u[i].token == token)
+      return i;
+
+  return nu;
+}
+
+/* Refuse to even look at the OTP if @us has failed too often or too
+   recently. */
+static int
+check_throttle (const struct oath_usersfile *uf,
+		const struct user_state *us, time_t now)
+{
+  unsigned shift;
+
+  if (us->failures == 0)
+    return OATH_OK;
+
+  if (uf->max_failures && us->failures >= uf->max_failures)
+    return OATH_THROTTLED;
+
+  if (uf->backoff)
+    {
+      /* Wait backoff seconds after the first failure, and twice as
+         long after each following failure. */
+      shift = us->failures - 1;
+      if (shift > 16)
+	shift = 16;
+      if (now < us->last_failure + ((time_t) uf->backoff << shift))
+	return OATH_THROTTLED;
+    }
+
+  return OATH_OK;
+}
+
+/* Write the statefile with the @nu updates in @u, sorted by
+   cmp_update, applied to the content of @infh.  Failure counts are
+   taken from @infh, and before one is reset the throttle of @uf, if
+   not NULL, is checked against it at time @now.  *@changed tells if
+   the content differs from @infh. */
+static int
+update_statefile2 (const struct state_update *u, size_t nu,
+		   const struct oath_usersfile *uf, time_t now,
+		   FILE * infh, FILE * outfh, char **lineptr, size_t * n,
+		   bool * changed)
+{
+  bool *token_done, *failures_done;
+  size_t i;
+  int rc = OATH_OK;
+
+  *changed = false;
+
+  token_done = calloc (nu ? 2 * nu : 1, sizeof (*token_done));
+  if (token_done == NULL)
+    return OATH_MALLOC_ERROR;
+  failures_done = token_done + nu;
+
+  while (infh && getline (lineptr, n, infh) != -1)
+    {
+      char *saveptr;
+      char *origline;
+      const char *user, *idx;
+      size_t first = nu, j = nu;
+
+      origline = strdup (*lineptr);
+      if (origline == NULL)
+	{
+	  rc = OATH_MALLOC_ERROR;
+	  goto done;
+	}
+
+      user = strtok_r (*lineptr, whitespace, &saveptr);
+      idx = strtok_r (NULL, whitespace, &saveptr);
+      if (user && idx && *user != '#')
+	first = first_update (u, nu, user);
+
+      if (first < nu && strcmp (idx, "-") == 0)
+	{
+	  for (j = first; j < nu && strcmp (u[j].username, user) == 0; j++)
+	    if (u[j].failures != FAILURES_KEEP && !failures_done[j])
+	      break;
+	  if (j < nu && strcmp (u[j].username, user) == 0)
+	    {
+	      struct user_state us;
+
+	      /* A malformed count is replaced. */
+	      memset (&us, 0, sizeof (us));
+	      if (parse_user_state (&saveptr, &us) != OATH_OK)
+		us.failures = 0;
+
+	      failures_done[j] = true;
+	      *changed = true;
+	      if (u[j].failures == FAILURES_ADD)
+		rc = print_user_state (outfh, &u[j], us.failures + 1);
+	      else if (uf)
+		rc = check_throttle (uf, &us, now);
+	    }
+	  else
+	    j = nu;
+	}
+      else if (first < nu)
+	{
+	  j = find_update (u, nu, first, strtoul (idx, NULL, 10));
+	  if (j < nu && u[j].otp && !token_done[j])
+	    {
+	      token_done[j] = true;
+	      *changed = true;
+	      rc = print_token_state (outfh, &u[j]);
+	    }
+	  else
+	    j = nu;
+	}
+
+      if (j == nu && fprintf (outfh, "%s", origline) <= 0)
+	rc = OATH_PRINTF_ERROR;
+      free (origline);
+      if (rc != OATH_OK)
+	goto done;
+    }
+
+  for (i = 0; i < nu && rc == OATH_OK; i++)
+    if (u[i].otp && !token_done[i])
+      {
+	*changed = true;
+	rc = print_token_state (outfh, &u[i]);
+      }
+
+  for (i = 0; i < nu && rc == OATH_OK; i++)
+    if (u[i].failures == FAILURES_ADD && !failures_done[i])
+      {
+	*changed = true;
+	rc = print_user_state (outfh, &u[i], 1);
+      }
+
+done:
+  free (token_done);
+
+  return rc;
+}
+
+/* Apply the @nu updates in @u to @statefile, see update_statefile2.
+   The file is only rewritten if its content changes. */
+static int
+update_statefile (const char *statefile,
+		  const struct state_update *u, size_t nu,
+		  const struct oath_usersfile *uf, time_t now,
+		  char **lineptr, size_t * n, struct phase_times *pt)
+{
+  FILE *infh, *outfh, *lockfh;
+  uint64_t start;
+  bool changed;
+  int rc;
+  char *newfilename, *lockfile;
+
+  rc = lock_file (statefile, &lockfh, &lockfile, pt);
+  if (rc != OATH_OK)
+    return rc;
+
+  rc = create_new_file (statefile, &outfh, &newfilename);
+  if (rc != OATH_OK)
+    return unlock_file (lockfh, lockfile, rc);
+
+  /* Re-read the statefile now that we hold the lock, since other
+     users may have been updated after we parsed it.  A missing
+     statefile is created. */
+  infh = fopen (statefile, "r");
+
+  start = phase_start (pt);
+  rc = update_statefile2 (u, nu, uf, now, infh, outfh, lineptr, n,
+			  &changed);
+  phase_end (pt, OATH_USERSFILE_PHASE_WRITE, start);
+
+  if (infh)
+    fclose (infh);
+
+  if (rc == OATH_OK && !changed)
+    {
+      fclose (outfh);
+      unlink (newfilename);
+      free (newfilename);
+    }
+  else
+    rc = commit_new_file (statefile, outfh, newfilename, rc, pt);
+
+  return unlock_file (lockfh, lockfile, rc);
+}
+
+/* Write the usersfile with the @nu updates in @u, sorted by
+   cmp_update, applied to the content of @infh.  Every update must
+   match a token in the usersfile. */
+static int
+update_usersfile_batch2 (const struct state_update *u, size_t nu,
+			 FILE * infh, FILE * outfh,
+			 char **lineptr, size_t * n)
+{
+  size_t *seen;
+  size_t done = 0;
+  int rc = OATH_OK;
+
+  seen = calloc (nu ? nu : 1, sizeof (*seen));
+  if (seen == NULL)
+    return OATH_MALLOC_ERROR;
+
+  while (getline (lineptr, n, infh) != -1)
+    {
+      char *saveptr;
+      char *origline;
+      const char *user, *type, *passwd, *secret;
+      unsigned digits, totpstepsize;
+      size_t first = nu, j = nu;
+
+      origline = strdup (*lineptr);
+      if (origline == NULL)
+	{
+	  rc = OATH_MALLOC_ERROR;
+	  break;
+	}
+
+      type = strtok_r (*lineptr, whitespace, &saveptr);
+      user = type && parse_type (type, &digits, &totpstepsize) == 0
+	? strtok_r (NULL, whitespace, &saveptr) : NULL;
+      if (user)
+	first = first_update (u, nu, user);
+      /* The token index counts all tokens of the user, updated or not. */
+      if (first < nu)
+	j = find_update (u, nu, first, seen[first]++);
+
+      if (j == nu)
+	{
+	  if (fprintf (outfh, "%s", origline) <= 0)
+	    rc = OATH_PRINTF_ERROR;
+	  free (origline);
+	  if (rc != OATH_OK)
+	    break;
+	  continue;
+	}
+
+      passwd = strtok_r (NULL, whitespace, &saveptr);
+      if (passwd == NULL)
+	passwd = "-";
+
+      secret = strtok_r (NULL, whitespace, &saveptr);
+      if (secret == NULL)
+	secret = "-";
+
+      if (fprintf (outfh, "%s\t%s\t%s\t%s\t%llu\t%s\t%s\n",
+		   type, user, passwd, secret,
+		   (unsigned long long) u[j].moving_factor, u[j].otp,
+		   u[j].timestamp) <= 0)
+	rc = OATH_PRINTF_ERROR;
+      free (origline);
+      if (rc != OATH_OK)
+	break;
+      done++;
+    }
+
+  free (seen);
+
+  if (rc == OATH_OK && done != nu)
+    rc = OATH_UNKNOWN_USER;
+
+  return rc;
+}
+
+static int
+update_usersfile_batch (const char *usersfile,
+			const struct state_update *u, size_t nu,
+			char **lineptr, size_t * n, struct stat *oldst)
+{
+  FILE *infh, *outfh, *lockfh;
+  int rc;
+  char *newfilename, *lockfile;
+
+  rc = lock_file (usersfile, &lockfh, &lockfile, NULL);
+  if (rc != OATH_OK)
+    return rc;
+
+  infh = fopen (usersfile, "r");
+  if (infh == NULL || fstat (fileno (infh), oldst) != 0)
+    {
+      if (infh)
+	fclose (infh);
+      return unlock_file (lockfh, lockfile, OATH_NO_SUCH_FILE);
+    }
+
+  rc = create_new_file (usersfile, &outfh, &newfilename);
+  if (rc != OATH_OK)
+    {
+      fclose (infh);
+      return unlock_file (lockfh, lockfile, rc);
+    }
+
+  rc = update_usersfile_batch2 (u, nu, infh, outfh, lineptr, n);
+
+  fclose (infh);
+
+  rc = commit_new_file (usersfile, outfh, newfilename, rc, NULL);
+
+  return unlock_file (lockfh, lockfile, rc);
+}
+
+/* Fields of a usersfile line: type, username, password, key, moving
+   factor, last OTP and timestamp. */
+#define USERSFILE_FIELDS 7
+
+/* Check the @nfields fields of a usersfile line, and store the
+   properties of its type, see oath_usersfile_parse_line(). */
+static int
+check_fields (const char *const *field, unsigned nfields,
+	      unsigned *digits, unsigned *totpstepsize)
+{
+  struct user_token t;
+  size_t len = sizeof (t.secret);
+  char *end;
+  int rc;
+
+  if (nfields < 1 || parse_type (field[0], digits, totpstepsize) != 0)
+    return OATH_INVALID_DIGITS;
+  if (nfields < 2)
+    return OATH_UNKNOWN_USER;
+  if (nfields < 4)
+    return OATH_INVALID_HEX;
+
+  /* Keys that do not fit struct user_token cannot be used. */
+  rc = oath_hex2bin (field[3], t.secret, &len);
+  if (rc != OATH_OK)
+    return rc;
+
+  if (nfields >= 5)
+    {
+      strtoull (field[4], &end, 10);
+      if (*end != '\0')
+	return OATH_INVALID_COUNTER;
+    }
+
+  if (nfields >= 7)
+    return parse_timestamp (field[6], &t.last_otp);
+
+  return OATH_OK;
+}
+
+/* Split @line into at most USERSFILE_FIELDS fields, in place, and
+   return the number of them. */
+static unsigned
+split_fields (char *line, const char **field)
+{
+  char *saveptr;
+  unsigned nfields;
+
+  for (nfields = 0; nfields < USERSFILE_FIELDS; nfields++)
+    if ((field[nfields] = strtok_r (nfields ? NULL : line,
+				    whitespace, &saveptr)) == NULL)
+      break;
+
+  return nfields;
+}
+
+/* Write the lines of @infh to @outfh with their fields separated by
+   single tabs, and without blank lines and lines liboath cannot use.
+   If @keep_tokens, lines with a known type and a username are kept
+   even if malformed, since dropping them would renumber the later
+   tokens of the user in the statefile.  Comment lines are copied.
+   The number of dropped lines is added to *@dropped. */
+static int
+compact_usersfile2 (FILE * infh, FILE * outfh, char **lineptr, size_t * n,
+		    bool keep_tokens, size_t * dropped)
+{
+  while (getline (lineptr, n, infh) != -1)
+    {
+      const char *field[USERSFILE_FIELDS];
+      unsigned digits, totpstepsize, nfields, i;
+      char *p;
+      bool ok;
+
+      p = *lineptr + strspn (*lineptr, whitespace);
+      if (*p == '\0')
+	continue;
+      if (*p == '#')
+	{
+	  if (fprintf (outfh, "%s%s", p,
+		       p[strlen (p) - 1] == '\n' ? "" : "\n") <= 0)
+	    return OATH_PRINTF_ERROR;
+	  continue;
+	}
+
+      nfields = split_fields (*lineptr, field);
+      ok = check_fields (field, nfields, &digits, &totpstepsize) == OATH_OK;
+
+      if (!ok && !(keep_tokens && nfields >= 2
+		   && parse_type (field[0], &digits, &totpstepsize) == 0))
+	{
+	  (*dropped)++;
+	  continue;
+	}
+
+      for (i = 0; i < nfields; i++)
+	if (fprintf (outfh, "%s%c", field[i],
+		     i + 1 < nfields ? '\t' : '\n') <= 0)
+	  return OATH_PRINTF_ERROR;
+    }
+
+  return OATH_OK;
+}
+
+static int
+compact_usersfile (const char *usersfile, bool keep_tokens, size_t * dropped)
+{
+  FILE *infh, *outfh, *lockfh;
+  char *newfilename, *lockfile;
+  char *line = NULL;
+  size_t n = 0;
+  int rc;
+
+  rc = lock_file (usersfile, &lockfh, &lockfile, NULL);
+  if (rc != OATH_OK)
+    return rc;
+
+  infh = fopen (usersfile, "r");
+  if (infh == NULL)
+    return unlock_file (lockfh, lockfile, OATH_NO_SUCH_FILE);
+
+  rc = create_new_file (usersfile, &outfh, &newfilename);
+  if (rc != OATH_OK)
+    {
+      fclose (infh);
+      return unlock_file (lockfh, lockfile, rc);
+    }
+
+  rc = compact_usersfile2 (infh, outfh, &line, &n, keep_tokens, dropped);
+
+  fclose (infh);
+  free (line);
+
+  rc = commit_new_file (usersfile, outfh, newfilename, rc, NULL);
+
+  return unlock_file (lockfh, lockfile, rc);
+}
+
+/* The filter file holds a Bloom filter of the usernames in the
+   usersfile.  It starts with a header of FILTER_MAGIC followed by
+   little-endian 64-bit words: device, inode, size, modification time
+   in seconds and its nanoseconds part of the usersfile it was built
+   from, the number of bits and the number of hash functions.  The
+   bits follow. */
+#define FILTER_MAGIC "OATHBF02"
+#define FILTER_IDENTITY_WORDS 5
+#define FILTER_NBITS_WORD 5
+#define FILTER_HASHES_WORD 6
+#define FILTER_HEADER_WORDS 7
+#define FILTER_HEADER_SIZE (8 + 8 * FILTER_HEADER_WORDS)
+#define FILTER_BITS_PER_USER 10
+#define FILTER_HASHES 7
+
+static uint64_t
+filter_hash (const char *username)
+{
+  /* FNV-1a. */
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (; *username; username++)
+    {
+      h ^= (unsigned char) *username;
+      h *= 0x100000001b3ULL;
+    }
+
+  return h;
+}
+
+/* Bit number @i of the filter for a username with hash @h. */
+static uint64_t
+filter_bit (uint64_t h, unsigned i, uint64_t nbits)
+{
+  uint32_t h1 = h & 0xFFFFFFFF, h2 = (h >> 32) | 1;
+
+  return ((uint64_t) h1 + (uint64_t) i * h2) % nbits;
+}
+
+static void
+filter_identity (const struct stat *st, uint64_t * words)
+{
+  words[0] = st->st_dev;
+  words[1] = st->st_ino;
+  words[2] = st->st_size;
+  words[3] = st->st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  words[4] = st->st_mtim.tv_nsec;
+#else
+  words[4] = 0;
+#endif
+}
+
+static void
+put_uint64 (unsigned char *p, uint64_t v)
+{
+  size_t i;
+
+  for (i = 0; i < 8; i++)
+    p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static uint64_t
+get_uint64 (const unsigned char *p)
+{
+  uint64_t v = 0;
+  size_t i;
+
+  for (i = 0; i < 8; i++)
+    v |= (uint64_t) p[i] << (8 * i);
+
+  return v;
+}
+
+/* Return true if the filter in @filterfile was built from the current
+   @usersfile and tells that @username is not in it.  Any problem with
+   the filter means the usersfile has to be searched. */
+static bool
+filter_excludes (const char *filterfile, const char *usersfile,
+		 const char *username)
+{
+  unsigned char header[FILTER_HEADER_SIZE];
+  uint64_t words[FILTER_HEADER_WORDS], nbits, h;
+  struct stat st;
+  bool excluded = false;
+  unsigned i;
+  int fd;
+
+  if (stat (usersfile, &st) != 0)
+    return false;
+
+  fd = open (filterfile, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  if (pread (fd, header, sizeof (header), 0) != sizeof (header)
+      || memcmp (header, FILTER_MAGIC, 8) != 0)
+    goto done;
+
+  filter_identity (&st, words);
+  for (i = 0; i < FILTER_IDENTITY_WORDS; i++)
+    if (get_uint64 (header + 8 + 8 * i) != words[i])
+      goto done;
+
+  nbits = get_uint64 (header + 8 + 8 * FILTER_NBITS_WORD);
+  if (nbits == 0
+      || get_uint64 (header + 8 + 8 * FILTER_HASHES_WORD) != FILTER_HASHES)
+    goto done;
+
+  h = filter_hash (username);
+  for (i = 0; i < FILTER_HASHES; i++)
+    {
+      uint64_t bit = filter_bit (h, i, nbits);
+      unsigned char byte;
+
+      if (pread (fd, &byte, 1, FILTER_HEADER_SIZE + bit / 8) != 1)
+	goto done;
+      if ((byte & (1 << (bit % 8))) == 0)
+	{
+	  excluded = true;
+	  break;
+	}
+    }
+
+done:
+  close (fd);
+
+  return excluded;
+}
+
+/* Count the usernames in @infh into *@nusers and, unless @bits is
+   NULL, set their bits in the @nbits bits of the filter. */
+static void
+filter_scan (FILE * infh, char **lineptr, size_t * n,
+	     unsigned char *bits, uint64_t nbits, size_t * nusers)
+{
+  *nusers = 0;
+
+  while (getline (lineptr, n, infh) != -1)
+    {
+      char *saveptr;
+      char *p = strtok_r (*lineptr, whitespace, &saveptr);
+      unsigned digits, totpstepsize, j;
+      uint64_t h;
+
+      if (p == NULL || parse_type (p, &digits, &totpstepsize) != 0)
+	continue;
+
+      p = strtok_r (NULL, whitespace, &saveptr);
+      if (p == NULL)
+	continue;
+
+      (*nusers)++;
+      if (bits == NULL)
+	continue;
+
+      h = filter_hash (p);
+      for (j = 0; j < FILTER_HASHES; j++)
+	{
+	  uint64_t bit = filter_bit (h, j, nbits);
+
+	  bits[bit / 8] |= 1 << (bit % 8);
+	}
+    }
+}
+
+static int
+write_filter (const char *filterfile, const char *usersfile)
+{
+  unsigned char header[FILTER_HEADER_SIZE];
+  uint64_t words[FILTER_HEADER_WORDS];
+  uint64_t nbits;
+  unsigned char *bits = NULL;
+  size_t nusers;
+  char *line = NULL;
+  size_t n = 0;
+  FILE *infh, *outfh, *lockfh;
+  char *newfilename, *lockfile;
+  struct stat st;
+  unsigned j;
+  int rc;
+
+  infh = fopen (usersfile, "r");
+  if (infh == NULL)
+    return OATH_NO_SUCH_FILE;
+
+  if (fstat (fileno (infh), &st) != 0)
+    {
+      fclose (infh);
+      return OATH_NO_SUCH_FILE;
+    }
+
+  /* Count the users first and then read the file again to set their
+     bits, so only the filter itself is held in memory.  The open file
+     keeps its content even if the usersfile is replaced meanwhile. */
+  filter_scan (infh, &line, &n, NULL, 0, &nusers);
+
+  nbits = ((nusers * FILTER_BITS_PER_USER + 63) / 64) * 64;
+  if (nbits == 0)
+    nbits = 64;
+
+  bits = calloc (nbits / 8, 1);
+  if (bits == NULL)
+    {
+      fclose (infh);
+      free (line);
+      return OATH_MALLOC_ERROR;
+    }
+
+  rewind (infh);
+  filter_scan (infh, &line, &n, bits, nbits, &nusers);
+  fclose (infh);
+  free (line);
+
+  memcpy (header, FILTER_MAGIC, 8);
+  filter_identity (&st, words);
+  words[FILTER_NBITS_WORD] = nbits;
+  words[FILTER_HASHES_WORD] = FILTER_HASHES;
+  for (j = 0; j < FILTER_HEADER_WORDS; j++)
+    put_uint64 (header + 8 + 8 * j, words[j]);
+
+  rc = lock_file (filterfile, &lockfh, &lockfile, NULL);
+  if (rc != OATH_OK)
+    goto done;
+
+  rc = create_new_file (filterfile, &outfh, &newfilename);
+  if (rc != OATH_OK)
+    {
+      rc = unlock_file (lockfh, lockfile, rc);
+      goto done;
+    }
+
+  if (fwrite (header, sizeof (header), 1, outfh) != 1
+      || fwrite (bits, nbits / 8, 1, outfh) != 1)
+    rc = OATH_PRINTF_ERROR;
+
+  rc = commit_new_file (filterfile, outfh, newfilename, rc, NULL);
+
+  rc = unlock_file (lockfh, lockfile, rc);
+
+done:
+  free (bits);
 
-  /* Something has failed, don't leave garbage lying around. */
-  if (rc != OATH_OK)
-    unlink (newfilename);
+  return rc;
+}
 
-  free (newfilename);
+/* After liboath has rewritten @usersfile, which had the identity
+   @oldst, move the filter in @filterfile over to the new usersfile.
+   Rewrites only change the data of existing tokens, so the usernames
+   and with them the filter bits stay the same.  A filter that did not
+   belong to the old usersfile is left alone. */
+static int
+refresh_filter (const char *filterfile, const struct stat *oldst,
+		const char *usersfile)
+{
+  unsigned char header[8 * FILTER_IDENTITY_WORDS];
+  uint64_t words[FILTER_HEADER_WORDS];
+  struct stat st;
+  unsigned i;
+  int fd, rc = OATH_OK;
 
-  /* Complete, close the lockfile */
-  if (fclose (lockfh) != 0)
+  if (stat (usersfile, &st) != 0)
+    return OATH_NO_SUCH_FILE;
+
+  fd = open (filterfile, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return errno == ENOENT ? OATH_OK : OATH_FILE_CREATE_ERROR;
+
+  if (pread (fd, header, 8, 0) != 8 || memcmp (header, FILTER_MAGIC, 8) != 0
+      || pread (fd, header, sizeof (header), 8) != sizeof (header))
+    goto done;
+
+  filter_identity (oldst, words);
+  for (i = 0; i < FILTER_IDENTITY_WORDS; i++)
+    if (get_uint64 (header + 8 * i) != words[i])
+      goto done;
+
+  filter_identity (&st, words);
+  for (i = 0; i < FILTER_IDENTITY_WORDS; i++)
+    put_uint64 (header + 8 * i, words[i]);
+
+  if (pwrite (fd, header, sizeof (header), 8) != sizeof (header))
+    rc = OATH_PRINTF_ERROR;
+
+done:
+  if (close (fd) != 0 && rc == OATH_OK)
     rc = OATH_FILE_CLOSE_ERROR;
-  if (unlink (lockfile) != 0)
-    rc = OATH_FILE_UNLINK_ERROR;
-  free (lockfile);
+
+  return rc;
+}
+
+static int
+format_timestamp (time_t t, char *timestamp, size_t max)
+{
+  struct tm now;
+
+  if (localtime_r (&t, &now) == NULL)
+    return OATH_TIME_ERROR;
+
+  if (strftime (timestamp, max, TIME_FORMAT_STRING, &now) != 20)
+    return OATH_TIME_ERROR;
+
+  return OATH_OK;
+}
+
+static int
+authenticate (const struct oath_usersfile *uf,
+	      const char *username,
+	      const char *otp,
+	      size_t window, const char *passwd, time_t * last_otp)
+{
+  FILE *infh;
+  char *line = NULL;
+  size_t n = 0;
+  uint64_t new_moving_factor;
+  int rc;
+  size_t token;
+  bool record, throttle;
+  int drift = 0;
+  struct token_state *states = NULL;
+  size_t nstates = 0;
+  struct user_state us;
+  struct state_update u;
+  struct phase_times times, *pt = NULL;
+  uint64_t start;
+  time_t now;
+  int i;
+
+  memset (&us, 0, sizeof (us));
+  memset (&u, 0, sizeof (u));
+  u.username = username;
+
+  if (uf->timing_cb)
+    {
+      memset (&times, 0, sizeof (times));
+      pt = &times;
+    }
+
+  /* Reject users known to be absent without reading the usersfile. */
+  if (uf->filterfile
+      && filter_excludes (uf->filterfile, uf->usersfile, username))
+    {
+      OATH_STATS_INC (filter_hits);
+      return OATH_UNKNOWN_USER;
+    }
+
+  throttle = uf->statefile && (uf->backoff || uf->max_failures);
+
+  now = time (NULL);
+  if (now == (time_t) - 1)
+    return OATH_TIME_ERROR;
+
+  if (uf->statefile)
+    {
+      FILE *statefh;
+
+      start = phase_start (pt);
+      statefh = fopen (uf->statefile, "r");
+
+      /* A missing statefile simply has no entries yet. */
+      if (statefh)
+	{
+	  rc = parse_statefile (username, statefh, &line, &n,
+				&states, &nstates, &us);
+	  fclose (statefh);
+	}
+      phase_end (pt, OATH_USERSFILE_PHASE_PARSE, start);
+      if (statefh && rc != OATH_OK)
+	goto done;
+    }
+
+  if (throttle && (rc = check_throttle (uf, &us, now)) != OATH_OK)
+    goto done;
+
+  infh = fopen (uf->usersfile, "r");
+  if (!infh)
+    {
+      rc = OATH_NO_SUCH_FILE;
+      goto done;
+    }
+
+  OATH_STATS_INC (usersfile_scans);
+  rc = parse_usersfile (username, otp, window, passwd, last_otp,
+			infh, &line, &n, states, nstates, uf->replay_cache,
+			&new_moving_factor, &token, &record, &drift, pt);
+
+  if (rc == OATH_OK && record && !uf->statefile)
+    {
+      rc = format_timestamp (now, u.timestamp, sizeof (u.timestamp));
+      if (rc == OATH_OK)
+	{
+	  struct stat oldst;
+
+	  rc = update_usersfile (uf->usersfile, username, otp, &line, &n,
+				 u.timestamp, new_moving_factor, token,
+				 &oldst, pt);
+
+	  /* The rewritten usersfile has a new identity, refresh the
+	     filter so that it stays in use. */
+	  if (rc == OATH_OK && uf->filterfile)
+	    rc = refresh_filter (uf->filterfile, &oldst, uf->usersfile);
+	}
+    }
+  else if (uf->statefile)
+    {
+      const struct token_state *state = NULL;
+
+      /* Learn the clock drift of TOTP tokens, even when the replay
+	 cache otherwise makes recording the OTP unnecessary. */
+      if (rc == OATH_OK)
+	state = find_state (states, nstates, token);
+      if (rc == OATH_OK && drift != (state ? state->drift : 0))
+	record = true;
+
+      if (rc == OATH_OK && record)
+	{
+	  u.token = token;
+	  u.otp = otp;
+	  u.moving_factor = new_moving_factor;
+	  u.drift = drift;
+	}
+      /* Even without failures to remove, a success has to check
+	 under the lock that concurrent failures have not throttled
+	 the user meanwhile.  That costs a read of the statefile, but
+	 no rewrite. */
+      if (throttle && rc == OATH_OK)
+	u.failures = FAILURES_RESET;
+      else if (throttle && (rc == OATH_INVALID_OTP
+			    || rc == OATH_BAD_PASSWORD))
+	u.failures = FAILURES_ADD;
+
+      if (u.otp || u.failures != FAILURES_KEEP)
+	{
+	  int tmprc;
+
+	  tmprc = format_timestamp (now, u.timestamp, sizeof (u.timestamp));
+	  if (tmprc == OATH_OK)
+	    tmprc = update_statefile (uf->statefile, &u, 1,
+				      throttle ? uf : NULL, now,
+				      &line, &n, pt);
+	  /* Don't let a failure to record a failure hide the reason. */
+	  if (rc == OATH_OK)
+	    rc = tmprc;
+	}
+    }
+
+  fclose (infh);
+
+done:
+  free_states (states, nstates);
+  free (line);
+
+  if (pt)
+    for (i = 0; i < OATH_USERSFILE_PHASES; i++)
+      if (pt->done[i])
+	uf->timing_cb (uf->timing_handle, i, pt->nsec[i]);
 
   return rc;
 }
@@ -439,50 +2015,483 @@ oath_authenticate_usersfile (const char *usersfile,
 			     size_t window,
 			     const char *passwd, time_t * last_otp)
 {
-  FILE *infh;
-  char *line = NULL;
-  size_t n = 0;
-  uint64_t new_moving_factor;
-  int rc;
-  size_t skipped_users;
+  struct oath_usersfile uf;
 
-  infh = fopen (usersfile, "r");
-  if (!infh)
+  memset (&uf, 0, sizeof (uf));
+  uf.usersfile = usersfile;
+
+  return authenticate (&uf, username, otp, window, passwd, last_otp);
+}
+
+static void
+free_updates (oath_usersfile_t * uf)
+{
+  size_t i;
+
+  for (i = 0; i < uf->nupdates; i++)
+    {
+      free ((char *) uf->updates[i].username);
+      free ((char *) uf->updates[i].otp);
+    }
+  free (uf->updates);
+  uf->updates = NULL;
+  uf->nupdates = 0;
+}
+
+/**
+ * oath_usersfile_init:
+ * @uf: output pointer to a newly allocated #oath_usersfile_t handle.
+ * @usersfile: string with user credential filename, in UsersFile format
+ *
+ * Create a handle for authenticating users against the credentials
+ * in @usersfile.  The handle is used with oath_usersfile_authenticate()
+ * and may be configured further, see oath_usersfile_set_statefile().
+ * Release it with oath_usersfile_done().
+ *
+ * The pointer @usersfile is stored in @uf, not a copy of the data, so
+ * you must not deallocate the data before the last call to any
+ * function using @uf.
+ *
+ * Several threads may call oath_usersfile_authenticate() at the same
+ * time, with the same or with different handles.  Files are locked
+ * against other threads as well as other processes, and liboath does
+ * not change process-global state such as the umask; new files are
+ * created readable and writable by their owner only.  A handle must
+ * not be configured, or have updates queued with
+ * oath_usersfile_add_update(), while it is used by another thread.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_init (oath_usersfile_t ** uf, const char *usersfile)
+{
+  *uf = calloc (1, sizeof (**uf));
+  if (*uf == NULL)
+    return OATH_MALLOC_ERROR;
+
+  (*uf)->usersfile = usersfile;
+
+  return OATH_OK;
+}
+
+/**
+ * oath_usersfile_done:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ *
+ * Release all resources associated with @uf.  It is safe to pass
+ * NULL.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_usersfile_done (oath_usersfile_t * uf)
+{
+  if (uf)
+    free_updates (uf);
+  free (uf);
+}
+
+/**
+ * oath_usersfile_set_statefile:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @statefile: string with state filename, or NULL.
+ *
+ * Keep the mutable per-token data (moving factor, last OTP and its
+ * timestamp) in the file @statefile instead of in the usersfile.
+ * The usersfile is then only ever read, and may be kept on read-only
+ * storage, while successful authentications only rewrite the much
+ * smaller statefile.
+ *
+ * Each line in the statefile holds the username, the index of the
+ * token among the lines for that user in the usersfile (starting
+ * from 0), the moving factor, the last OTP and the timestamp of the
+ * last authentication, separated by whitespace.  Tokens without a
+ * statefile entry fall back on the fields in the usersfile, so an
+ * existing usersfile may be moved over to a statefile at any time.
+ * The statefile is created on first successful authentication.
+ *
+ * The pointer @statefile is stored in @uf, not a copy of the data, so
+ * you must not deallocate the data before another call to this
+ * function or the last call to any function using @uf.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_usersfile_set_statefile (oath_usersfile_t * uf, const char *statefile)
+{
+  uf->statefile = statefile;
+}
+
+/**
+ * oath_usersfile_set_replay_cache:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @cache: a #oath_replay_cache_t handle, or NULL.
+ *
+ * Use the replay cache @cache, see oath_replay_cache_init(), for
+ * replay protection of TOTP tokens.  Successful TOTP authentications
+ * are then recorded in @cache only, instead of in the usersfile or
+ * statefile, and the OTP only needs to be searched for once.  HOTP
+ * tokens are not affected.
+ *
+ * Note that replay protection for OTPs that are still inside the
+ * search window is lost if the content of @cache is lost, for example
+ * when a process holding it is restarted.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_usersfile_set_replay_cache (oath_usersfile_t * uf,
+				 oath_replay_cache_t * cache)
+{
+  uf->replay_cache = cache;
+}
+
+/**
+ * oath_usersfile_set_throttle:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @backoff: seconds to refuse a user after a failure, or 0
+ * @max_failures: number of failures after which a user is locked
+ *   out, or 0
+ *
+ * Throttle users that fail to authenticate.  Failed authentications,
+ * due to an invalid OTP or password, are counted per user in the
+ * statefile, see oath_usersfile_set_statefile(), and the count is
+ * reset by a successful authentication.  After a failure the user is
+ * refused for @backoff seconds, doubling with each further failure.
+ * After @max_failures failures the user is refused until the count
+ * is removed from the statefile.  A refused user gets
+ * %OATH_THROTTLED before the OTP is looked at, so guessing attempts
+ * cost neither HMAC computations nor usersfile reads.
+ *
+ * The count is updated while the statefile is locked, so concurrent
+ * failures are all counted, and a successful authentication checks
+ * the throttle again under the lock before it is accepted.  Note that
+ * the count lives in the statefile: a refused attempt still reads the
+ * statefile, and every counted failure rewrites and syncs it, so the
+ * cost of an attempt grows with the size of the statefile.
+ *
+ * Throttling has no effect unless a statefile is used.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_usersfile_set_throttle (oath_usersfile_t * uf,
+			     unsigned backoff, unsigned max_failures)
+{
+  uf->backoff = backoff;
+  uf->max_failures = max_failures;
+}
+
+/**
+ * oath_usersfile_set_filter:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @filterfile: string with filter filename, or NULL.
+ *
+ * Consult the filter in @filterfile, written by
+ * oath_usersfile_write_filter(), before reading the usersfile.  The
+ * filter is a small Bloom filter of the usernames in the usersfile,
+ * so most users that have no token are rejected with
+ * %OATH_UNKNOWN_USER by reading a few bytes, instead of searching the
+ * whole usersfile.  A user in the usersfile is never rejected.
+ *
+ * The filter records the device, inode, size and modification time,
+ * down to the nanosecond where the system provides it, of the
+ * usersfile it was built from, and is ignored when the usersfile no
+ * longer matches.  When the usersfile is rewritten by liboath, which
+ * does not change the set of usernames, the filter is moved over to
+ * the new file without being rebuilt; after editing the usersfile by
+ * other means call oath_usersfile_write_filter() again.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_usersfile_set_filter (oath_usersfile_t * uf, const char *filterfile)
+{
+  uf->filterfile = filterfile;
+}
+
+/**
+ * oath_usersfile_write_filter:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ *
+ * Build the filter of usernames in the usersfile, and write it to
+ * the file configured with oath_usersfile_set_filter().
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_write_filter (oath_usersfile_t * uf)
+{
+  if (uf->filterfile == NULL)
     return OATH_NO_SUCH_FILE;
 
-  rc = parse_usersfile (username, otp, window, passwd, last_otp,
-			infh, &line, &n, &new_moving_factor, &skipped_users);
+  return write_filter (uf->filterfile, uf->usersfile);
+}
 
-  if (rc == OATH_OK)
+/**
+ * oath_usersfile_parse_line:
+ * @line: a line of a usersfile, which is split into fields in place.
+ * @user: output variable pointing to the username in @line, or NULL.
+ * @digits: output variable holding the number of digits of the OTPs.
+ * @totpstepsize: output variable holding the TOTP time step size, or
+ *   0 for HOTP tokens.
+ *
+ * Check whether @line describes a token that can be used, by the same
+ * rules as oath_usersfile_compact(), for tools that inspect a
+ * usersfile without authenticating against it.  The whitespace
+ * between the fields of @line is overwritten.  *@user is set if
+ * @line has a username, and *@digits and *@totpstepsize if it has a
+ * known type, even if the line cannot be used for another reason.
+ *
+ * Returns: %OATH_OK if the line can be used, otherwise
+ *   %OATH_INVALID_DIGITS for a blank line or an unknown type,
+ *   %OATH_UNKNOWN_USER if the username is missing, %OATH_INVALID_HEX
+ *   if the key is missing or not hex, %OATH_TOO_SMALL_BUFFER if the
+ *   key is too long, %OATH_INVALID_COUNTER for an invalid moving
+ *   factor or %OATH_INVALID_TIMESTAMP for an invalid timestamp.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_parse_line (char *line, const char **user,
+			   unsigned *digits, unsigned *totpstepsize)
+{
+  const char *field[USERSFILE_FIELDS];
+  unsigned nfields = split_fields (line, field);
+
+  *user = nfields >= 2 ? field[1] : NULL;
+
+  return check_fields (field, nfields, digits, totpstepsize);
+}
+
+/**
+ * oath_usersfile_compact:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @dropped: output variable holding the number of dropped lines, or NULL.
+ *
+ * Rewrite the usersfile with the fields of each line separated by a
+ * single tab, dropping blank lines and lines that cannot be used: an
+ * unknown type, a missing username or key, a key that is not hex or
+ * too long, or an invalid moving factor or timestamp.  Comment lines
+ * starting with '#' are kept.  If a statefile is set with
+ * oath_usersfile_set_statefile(), malformed lines with a known type
+ * and a username are kept, since the statefile refers to the tokens
+ * of a user by their position.
+ *
+ * The usersfile is read once and rewritten under the same lock and
+ * atomic rename as oath_usersfile_commit_updates(), so only one line
+ * is held in memory at a time.  If a filter is set with
+ * oath_usersfile_set_filter(), it is rebuilt.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_compact (oath_usersfile_t * uf, size_t * dropped)
+{
+  size_t ndropped = 0;
+  int rc;
+
+  rc = compact_usersfile (uf->usersfile, uf->statefile != NULL, &ndropped);
+  if (dropped)
+    *dropped = ndropped;
+  if (rc == OATH_OK && uf->filterfile)
+    rc = write_filter (uf->filterfile, uf->usersfile);
+
+  return rc;
+}
+
+/**
+ * oath_usersfile_set_timing_callback:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @cb: function to receive timings, or NULL.
+ * @handle: opaque pointer passed to @cb.
+ *
+ * Measure how long each phase of oath_usersfile_authenticate() takes,
+ * see #oath_usersfile_phase.  Before returning, each authentication
+ * calls @cb once for every phase it went through, with the time
+ * spent in it in nanoseconds.  Phases that were not needed, for
+ * example writing when the OTP was invalid, are not reported.  No
+ * clock is read unless a callback is set.
+ *
+ * Since: 2.6.0
+ **/
+void
+oath_usersfile_set_timing_callback (oath_usersfile_t * uf,
+				    oath_usersfile_timing_function cb,
+				    void *handle)
+{
+  uf->timing_cb = cb;
+  uf->timing_handle = handle;
+}
+
+/**
+ * oath_usersfile_authenticate:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @username: string with name of user
+ * @otp: string with one-time password to authenticate
+ * @window: how many past/future OTPs to search
+ * @passwd: string with password, or NULL to disable password checking
+ * @last_otp: output variable holding last successful authentication
+ *
+ * Authenticate user named @username with the one-time password @otp
+ * and (optional) password @passwd, using the credentials configured
+ * in @uf.  This works like oath_authenticate_usersfile(), but only
+ * the statefile is updated if one is configured with
+ * oath_usersfile_set_statefile().
+ *
+ * Returns: On successful validation, %OATH_OK is returned.  If the
+ *   supplied @otp is the same as the last successfully authenticated
+ *   one-time password, %OATH_REPLAYED_OTP is returned and the
+ *   timestamp of the last authentication is returned in @last_otp.
+ *   If the one-time password is not found in the indicated search
+ *   window, %OATH_INVALID_OTP is returned.  If the user is
+ *   throttled, see oath_usersfile_set_throttle(), %OATH_THROTTLED is
+ *   returned.  Otherwise, an error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_authenticate (oath_usersfile_t * uf,
+			     const char *username,
+			     const char *otp,
+			     size_t window,
+			     const char *passwd, time_t * last_otp)
+{
+  return authenticate (uf, username, otp, window, passwd, last_otp);
+}
+
+/**
+ * oath_usersfile_add_update:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ * @username: string with name of user
+ * @token: index of the token among the lines for @username in the
+ *   usersfile, starting from 0
+ * @moving_factor: new moving factor (counter) of the token
+ * @otp: string with last OTP of the token, or NULL
+ * @timestamp: time of the last authentication
+ *
+ * Queue an update of the moving factor, last OTP and timestamp of a
+ * token, to be applied by oath_usersfile_commit_updates().  This is
+ * meant for administrative changes to many tokens, for example after
+ * resynchronizing a batch of tokens, which would otherwise require
+ * rewriting the file once per token.  A later update of the same
+ * token replaces an earlier one.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned, otherwise an
+ *   error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_add_update (oath_usersfile_t * uf,
+			   const char *username,
+			   size_t token,
+			   uint64_t moving_factor,
+			   const char *otp, time_t timestamp)
+{
+  struct state_update *tmp, *u;
+  int rc;
+
+  tmp = realloc (uf->updates, (uf->nupdates + 1) * sizeof (*tmp));
+  if (tmp == NULL)
+    return OATH_MALLOC_ERROR;
+  uf->updates = tmp;
+
+  u = &uf->updates[uf->nupdates];
+  memset (u, 0, sizeof (*u));
+
+  rc = format_timestamp (timestamp, u->timestamp, sizeof (u->timestamp));
+  if (rc != OATH_OK)
+    return rc;
+
+  u->username = strdup (username);
+  u->otp = strdup (otp ? otp : "-");
+  if (u->username == NULL || u->otp == NULL)
     {
-      char timestamp[30];
-      size_t max = sizeof (timestamp);
-      struct tm now;
-      time_t t;
-      size_t l;
-      mode_t old_umask;
+      free ((char *) u->username);
+      free ((char *) u->otp);
+      return OATH_MALLOC_ERROR;
+    }
+  u->token = token;
+  u->moving_factor = moving_factor;
+  u->seq = uf->nupdates++;
+
+  return OATH_OK;
+}
+
+/**
+ * oath_usersfile_commit_updates:
+ * @uf: a #oath_usersfile_t handle, from oath_usersfile_init().
+ *
+ * Apply all updates queued by oath_usersfile_add_update() in a single
+ * rewrite of the statefile, if one is configured with
+ * oath_usersfile_set_statefile(), or otherwise of the usersfile.  The
+ * file is locked, rewritten, synced and renamed into place once,
+ * regardless of the number of updates.  When the usersfile is
+ * rewritten, every update must refer to an existing token, or the
+ * usersfile is left untouched.  The queue is emptied whether or not
+ * the updates could be applied.
+ *
+ * Returns: On success, %OATH_OK (zero) is returned.  If an update
+ *   refers to a token not in the usersfile, %OATH_UNKNOWN_USER is
+ *   returned.  Otherwise, an error code is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+oath_usersfile_commit_updates (oath_usersfile_t * uf)
+{
+  char *line = NULL;
+  size_t n = 0;
+  size_t i, nu = 0;
+  int rc;
 
-      if (time (&t) == (time_t) - 1)
-	return OATH_TIME_ERROR;
+  if (uf->nupdates == 0)
+    return OATH_OK;
 
-      if (localtime_r (&t, &now) == NULL)
-	return OATH_TIME_ERROR;
+  qsort (uf->updates, uf->nupdates, sizeof (*uf->updates), cmp_update);
 
-      l = strftime (timestamp, max, TIME_FORMAT_STRING, &now);
-      if (l != 20)
-	return OATH_TIME_ERROR;
+  /* Keep only the last update of each token. */
+  for (i = 0; i < uf->nupdates; i++)
+    {
+      struct state_update *u = &uf->updates[i];
 
-      old_umask = umask (~(S_IRUSR | S_IWUSR));
+      if (i + 1 < uf->nupdates
+	  && strcmp (u->username, u[1].username) == 0
+	  && u->token == u[1].token)
+	{
+	  free ((char *) u->username);
+	  free ((char *) u->otp);
+	  continue;
+	}
+      uf->updates[nu++] = *u;
+    }
+  uf->nupdates = nu;
 
-      rc = update_usersfile (usersfile, username, otp, infh,
-			     &line, &n, timestamp, new_moving_factor,
-			     skipped_users);
+  if (uf->statefile)
+    rc = update_statefile (uf->statefile, uf->updates, uf->nupdates,
+			   NULL, 0, &line, &n, NULL);
+  else
+    {
+      struct stat oldst;
 
-      umask (old_umask);
+      rc = update_usersfile_batch (uf->usersfile, uf->updates, uf->nupdates,
+				   &line, &n, &oldst);
+      if (rc == OATH_OK && uf->filterfile)
+	rc = refresh_filter (uf->filterfile, &oldst, uf->usersfile);
     }
 
   free (line);
-  fclose (infh);
+  free_updates (uf);
 
   return rc;
 }
@@ -0,0 +1,168 @@
+/*
+ * arena.c - Bump allocator for per-container PSKC data.
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <pskc/pskc.h>
+
+#include "internal.h"
+
+#include <stdint.h>		/* SIZE_MAX */
+#include <stdlib.h>		/* malloc */
+#include <string.h>		/* memcpy */
+
+/* Allocations are rounded up to this, enough for any data we keep. */
+#define ARENA_ALIGN 16
+
+/* Size of the blocks small allocations are carved out of. */
+#define ARENA_BLOCK_SIZE 16384
+
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct pskc_arena_block
+{
+  struct pskc_arena_block *next;
+  size_t size;
+  size_t used;
+};
+
+#define ARENA_HEADER ARENA_ROUND (sizeof (struct pskc_arena_block))
+
+static struct pskc_arena_block *
+arena_block (size_t size)
+{
+  struct pskc_arena_block *b = malloc (ARENA_HEADER + size);
+
+  if (b == NULL)
+    return NULL;
+
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+
+  return b;
+}
+
+/* Allocate @n bytes from @arena, or return NULL on memory allocation
+   errors.  The memory is released by _pskc_arena_free. */
+void *
+_pskc_arena_alloc (struct pskc_arena *arena, size_t n)
+{
+  struct pskc_arena_block *b = arena->blocks;
+  char *p;
+
+  if (n > SIZE_MAX - ARENA_HEADER - ARENA_ALIGN)
+    return NULL;
+  n = ARENA_ROUND (n);
+
+  if (b == NULL || b->size - b->used < n)
+    {
+      if (n > ARENA_BLOCK_SIZE / 4)
+	{
+	  /* Give large objects a block of their own, behind the
+	     current one so that its free space is not wasted. */
+	  struct pskc_arena_block *big = arena_block (n);
+
+	  if (big == NULL)
+	    return NULL;
+	  big->used = n;
+	  if (b == NULL)
+	    arena->blocks = big;
+	  else
+	    {
+	      big->next = b->next;
+	      b->next = big;
+	    }
+	  return (char *) big + ARENA_HEADER;
+	}
+
+      b = arena_block (ARENA_BLOCK_SIZE);
+      if (b == NULL)
+	return NULL;
+      b->next = arena->blocks;
+      arena->blocks = b;
+    }
+
+  p = (char *) b + ARENA_HEADER + b->used;
+  b->used += n;
+
+  return p;
+}
+
+/* Copy @len bytes of @data into @arena, zero terminated. */
+char *
+_pskc_arena_memdup (struct pskc_arena *arena, const char *data, size_t len)
+{
+  char *p;
+
+  if (len == SIZE_MAX)
+    return NULL;
+
+  p = _pskc_arena_alloc (arena, len + 1);
+  if (p == NULL)
+    return NULL;
+
+  memcpy (p, data, len);
+  p[len] = '\0';
+
+  return p;
+}
+
+/* Move all memory allocated from @from into @arena, leaving @from
+   empty.  The current block of @arena stays first, so that its free
+   space is still used. */
+void
+_pskc_arena_merge (struct pskc_arena *arena, struct pskc_arena *from)
+{
+  struct pskc_arena_block *last = from->blocks;
+
+  if (last == NULL)
+    return;
+
+  if (arena->blocks == NULL)
+    arena->blocks = from->blocks;
+  else
+    {
+      while (last->next)
+	last = last->next;
+      last->next = arena->blocks->next;
+      arena->blocks->next = from->blocks;
+    }
+
+  from->blocks = NULL;
+}
+
+/* Release all memory allocated from @arena, leaving it empty and
+   ready for reuse. */
+void
+_pskc_arena_free (struct pskc_arena *arena)
+{
+  struct pskc_arena_block *b = arena->blocks;
+
+  while (b)
+    {
+      struct pskc_arena_block *next = b->next;
+      free (b);
+      b = next;
+    }
+
+  arena->blocks = NULL;
+}
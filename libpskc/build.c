@@ -24,6 +24,7 @@
 #include <pskc/pskc.h>
 
 #define INTERNAL_NEED_PSKC_STRUCT
+#define INTERNAL_NEED_PSKC_KEY_STRUCT
 #include "internal.h"
 #include <stdlib.h>		/* malloc */
 #include <string.h>		/* memcpy */
@@ -452,6 +453,10 @@ build_keycont (pskc_t * container, xmlNodePtr keycont)
       xmlNodePtr keypackage;
       int rc;
 
+      /* A setter could not store its value. */
+      if (kp->cached & PSKC_CACHED_MALLOC_ERROR)
+	return PSKC_MALLOC_ERROR;
+
       keypackage = xmlNewChild (keycont, NULL, BAD_CAST "KeyPackage", NULL);
       if (keypackage == NULL)
 	return PSKC_XML_ERROR;
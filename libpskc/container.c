@@ -23,6 +23,7 @@
 
 #include <pskc/pskc.h>
 
+#include <stdlib.h>		/* calloc */
 #include <string.h>		/* memset */
 
 #define INTERNAL_NEED_PSKC_STRUCT
@@ -119,6 +120,58 @@ pskc_get_signed_p (pskc_t * container)
   return container->signed_p;
 }
 
+/* Find the block holding key package @i, see struct pskc. */
+static size_t
+keyblock_index (size_t i, size_t * offset)
+{
+  size_t n = i / PSKC_KEYBLOCK_FIRST + 1;
+  size_t k = 0;
+
+  while (n >>= 1)
+    k++;
+
+  *offset = i - PSKC_KEYBLOCK_FIRST * (((size_t) 1 << k) - 1);
+
+  return k;
+}
+
+struct pskc_key *
+_pskc_keypackage (pskc_t * container, size_t i)
+{
+  size_t offset;
+  size_t k = keyblock_index (i, &offset);
+
+  return &container->keyblocks[k][offset];
+}
+
+/* Append a zeroed key package to @container, or return NULL on
+   memory allocation errors. */
+struct pskc_key *
+_pskc_new_keypackage (pskc_t * container)
+{
+  size_t offset;
+  size_t k = keyblock_index (container->nkeypackages, &offset);
+  struct pskc_key *kp;
+
+  if (container->keyblocks[k] == NULL)
+    {
+      container->keyblocks[k] = calloc ((size_t) PSKC_KEYBLOCK_FIRST << k,
+					sizeof (struct pskc_key));
+      if (container->keyblocks[k] == NULL)
+	return NULL;
+    }
+
+  kp = &container->keyblocks[k][offset];
+  memset (kp, 0, sizeof (*kp));
+  kp->arena = &container->arena;
+  kp->container = container;
+  container->nkeypackages++;
+
+  _pskc_index_invalidate (container, -1);
+
+  return kp;
+}
+
 /**
  * pskc_get_keypackage:
  * @container: a #pskc_t handle, from pskc_init().
@@ -128,6 +181,13 @@ pskc_get_signed_p (pskc_t * container)
  * in @container.  @i is zero-based, i.e., 0 refer to the first key
  * package, 1 refer to the second key package, and so on.
  *
+ * The get functions for the returned key package, such as
+ * pskc_get_key_data_counter(), convert values from the XML on first
+ * use and may allocate memory from @container, so they modify it even
+ * though they only read the key package.  Threads sharing a container
+ * must therefore not call any function on it concurrently, including
+ * the get functions, without locking.
+ *
  * Returns: NULL if there is no @i'th key package, or a valid
  *   #pskc_key_t pointer.
  */
@@ -136,7 +196,7 @@ pskc_get_keypackage (pskc_t * container, size_t i)
 {
   if (i >= container->nkeypackages)
     return NULL;
-  return &container->keypackages[i];
+  return _pskc_keypackage (container, i);
 }
 
 /**
@@ -157,22 +217,186 @@ pskc_add_keypackage (pskc_t * container, pskc_key_t ** key)
 {
   struct pskc_key *tmp;
 
-  tmp = realloc (container->keypackages,
-		 sizeof (*container->keypackages) *
-		 (container->nkeypackages + 1));
+  tmp = _pskc_new_keypackage (container);
   if (tmp == NULL)
     return PSKC_MALLOC_ERROR;
 
-  memset (tmp, 0, sizeof (*tmp));
-
-  container->keypackages = tmp;
-  container->nkeypackages++;
+  /* Allocate the rarely used fields up front, so that the setters
+     cannot fail on keys built by the application. */
+  if (_pskc_key_ext (tmp) == NULL)
+    {
+      container->nkeypackages--;
+      return PSKC_MALLOC_ERROR;
+    }
 
   *key = tmp;
 
   return PSKC_OK;
 }
 
+/* Return the rarely used fields of @key, allocating them on first
+   use, or NULL on memory allocation errors. */
+struct pskc_key_ext *
+_pskc_key_ext (struct pskc_key *key)
+{
+  if (key->ext == NULL)
+    {
+      struct pskc_key_ext *ext;
+
+      ext = _pskc_arena_alloc (key->arena, sizeof (*ext));
+      if (ext == NULL)
+	{
+	  _pskc_debug ("key package malloc failed");
+	  key->cached |= PSKC_CACHED_MALLOC_ERROR;
+	  return NULL;
+	}
+      memset (ext, 0, sizeof (*ext));
+      key->ext = ext;
+    }
+
+  return key->ext;
+}
+
+/* Return non-zero if the value for @flag on @key has already been
+   converted from its XML string.  Callers set the bit only once the
+   converted value has been stored. */
+static int
+cached (pskc_key_t * key, unsigned flag)
+{
+  return key->cached & flag;
+}
+
+static int
+str2checkdigits (const char *str)
+{
+  return strcmp ("1", str) == 0 || strcmp ("true", str) == 0;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date, month 1-12. */
+static int64_t
+days_from_civil (int64_t y, int m, int d)
+{
+  int64_t era, yoe, doy, doe;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+/* Seconds since the epoch of the UTC date in @tm.  Unlike timegm,
+   this works for any year that fits in struct tm, also where time_t
+   is 32 bits. */
+int64_t
+_pskc_tm2time (const struct tm *tm)
+{
+  int64_t y = (int64_t) tm->tm_year + 1900 + tm->tm_mon / 12;
+  int m = tm->tm_mon % 12;
+
+  if (m < 0)
+    {
+      m += 12;
+      y--;
+    }
+
+  return (days_from_civil (y, m + 1, 1) + tm->tm_mday - 1) * 86400
+    + tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
+}
+
+static void
+time2tm (int64_t t, struct tm *tm)
+{
+  int64_t days = t / 86400;
+  int64_t secs = t % 86400;
+  int64_t z, era, doe, yoe, y, doy, mp;
+  int m;
+
+  if (secs < 0)
+    {
+      secs += 86400;
+      days--;
+    }
+
+  z = days + 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  m = mp < 10 ? mp + 3 : mp - 9;
+  y = yoe + era * 400 + (m <= 2);
+
+  memset (tm, 0, sizeof (*tm));
+  tm->tm_sec = secs % 60;
+  tm->tm_min = secs / 60 % 60;
+  tm->tm_hour = secs / 3600;
+  tm->tm_mday = doy - (153 * mp + 2) / 5 + 1;
+  tm->tm_mon = m - 1;
+  tm->tm_year = y - 1900;
+  tm->tm_wday = ((days + 4) % 7 + 7) % 7;
+  tm->tm_yday = days - days_from_civil (y, 1, 1);
+}
+
+/* Return the broken-down form of date @t, cached in *@tm. */
+static const struct tm *
+key_date (pskc_key_t * key, int64_t t, struct tm **tm, unsigned flag)
+{
+  if (*tm == NULL || !cached (key, flag))
+    {
+      struct tm *out = *tm;
+
+      if (out == NULL)
+	{
+	  out = _pskc_arena_alloc (key->arena, sizeof (*out));
+	  if (out == NULL)
+	    return NULL;
+	}
+      time2tm (t, out);
+      *tm = out;
+      key->cached |= flag;
+    }
+
+  return *tm;
+}
+
+static char *
+remove_whitespace (struct pskc_arena *arena, const char *str)
+{
+  size_t len = strlen (str);
+  char *out = _pskc_arena_alloc (arena, len + 1);
+  size_t i, j;
+
+  if (out == NULL)
+    return NULL;
+
+  for (i = 0, j = 0; i < len; i++)
+    if (isbase64 (str[i]) || str[i] == '=')
+      out[j++] = str[i];
+
+  out[j] = '\0';
+
+  return out;
+}
+
+/* Return the base64 secret of @key, from the parsed data on first
+   use. */
+static const char *
+key_b64secret (pskc_key_t * key)
+{
+  if (key->key_b64secret == NULL && key->key_secret_str)
+    {
+      key->key_b64secret = remove_whitespace (key->arena,
+					      key->key_secret_str);
+      if (key->key_b64secret == NULL)
+	_pskc_debug ("base64 whitespace malloc failed");
+    }
+
+  return key->key_b64secret;
+}
+
 /**
  * pskc_get_device_manufacturer:
  * @key: a #pskc_key_t handle, from pskc_get_keypackage().
@@ -243,6 +467,8 @@ void
 pskc_set_device_serialno (pskc_key_t * key, const char *serialno)
 {
   key->device_serialno = serialno;
+  if (key->container)
+    _pskc_index_invalidate (key->container, PSKC_INDEX_SERIALNO);
 }
 
 /**
@@ -298,7 +524,7 @@ pskc_set_device_model (pskc_key_t * key, const char *model)
 const char *
 pskc_get_device_issueno (pskc_key_t * key)
 {
-  return key->device_issueno;
+  return key->ext ? key->ext->device_issueno : NULL;
 }
 
 /**
@@ -320,7 +546,10 @@ pskc_get_device_issueno (pskc_key_t * key)
 void
 pskc_set_device_issueno (pskc_key_t * key, const char *issueno)
 {
-  key->device_issueno = issueno;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->device_issueno = issueno;
 }
 
 /**
@@ -342,7 +571,7 @@ pskc_set_device_issueno (pskc_key_t * key, const char *issueno)
 const char *
 pskc_get_device_devicebinding (pskc_key_t * key)
 {
-  return key->device_devicebinding;
+  return key->ext ? key->ext->device_devicebinding : NULL;
 }
 
 /**
@@ -368,7 +597,10 @@ pskc_get_device_devicebinding (pskc_key_t * key)
 void
 pskc_set_device_devicebinding (pskc_key_t * key, const char *devbind)
 {
-  key->device_devicebinding = devbind;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->device_devicebinding = devbind;
 }
 
 /**
@@ -385,9 +617,12 @@ pskc_set_device_devicebinding (pskc_key_t * key, const char *devbind)
 const struct tm *
 pskc_get_device_startdate (pskc_key_t * key)
 {
-  if (!key->device_startdate_str)
+  struct pskc_key_ext *ext = key->ext;
+
+  if (!ext || !ext->device_startdate_str)
     return NULL;
-  return &key->device_startdate;
+  return key_date (key, ext->device_startdate, &ext->device_startdate_tm,
+		   PSKC_CACHED_DEVICE_STARTDATE);
 }
 
 /**
@@ -404,8 +639,14 @@ pskc_get_device_startdate (pskc_key_t * key)
 void
 pskc_set_device_startdate (pskc_key_t * key, const struct tm *startdate)
 {
-  key->device_startdate_str = "set";
-  memcpy (&key->device_startdate, startdate, sizeof (key->device_startdate));
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->device_startdate_str = "set";
+  ext->device_startdate = _pskc_tm2time (startdate);
+  key->cached &= ~PSKC_CACHED_DEVICE_STARTDATE;
 }
 
 /**
@@ -422,9 +663,12 @@ pskc_set_device_startdate (pskc_key_t * key, const struct tm *startdate)
 const struct tm *
 pskc_get_device_expirydate (pskc_key_t * key)
 {
-  if (!key->device_expirydate_str)
+  struct pskc_key_ext *ext = key->ext;
+
+  if (!ext || !ext->device_expirydate_str)
     return NULL;
-  return &key->device_expirydate;
+  return key_date (key, ext->device_expirydate, &ext->device_expirydate_tm,
+		   PSKC_CACHED_DEVICE_EXPIRYDATE);
 }
 
 /**
@@ -441,9 +685,14 @@ pskc_get_device_expirydate (pskc_key_t * key)
 void
 pskc_set_device_expirydate (pskc_key_t * key, const struct tm *expirydate)
 {
-  key->device_expirydate_str = "set";
-  memcpy (&key->device_expirydate, expirydate,
-	  sizeof (key->device_expirydate));
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->device_expirydate_str = "set";
+  ext->device_expirydate = _pskc_tm2time (expirydate);
+  key->cached &= ~PSKC_CACHED_DEVICE_EXPIRYDATE;
 }
 
 /**
@@ -480,6 +729,8 @@ void
 pskc_set_device_userid (pskc_key_t * key, const char *userid)
 {
   key->device_userid = userid;
+  if (key->container)
+    _pskc_index_invalidate (key->container, PSKC_INDEX_USERID);
 }
 
 /**
@@ -497,7 +748,7 @@ pskc_set_device_userid (pskc_key_t * key, const char *userid)
 const char *
 pskc_get_cryptomodule_id (pskc_key_t * key)
 {
-  return key->cryptomodule_id;
+  return key->ext ? key->ext->cryptomodule_id : NULL;
 }
 
 /**
@@ -519,7 +770,10 @@ pskc_get_cryptomodule_id (pskc_key_t * key)
 void
 pskc_set_cryptomodule_id (pskc_key_t * key, const char *cid)
 {
-  key->cryptomodule_id = cid;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->cryptomodule_id = cid;
 }
 
 /**
@@ -556,6 +810,8 @@ void
 pskc_set_key_id (pskc_key_t * key, const char *keyid)
 {
   key->key_id = keyid;
+  if (key->container)
+    _pskc_index_invalidate (key->container, PSKC_INDEX_KEY_ID);
 }
 
 /**
@@ -640,7 +896,7 @@ pskc_set_key_issuer (pskc_key_t * key, const char *keyissuer)
 const char *
 pskc_get_key_algparm_suite (pskc_key_t * key)
 {
-  return key->key_algparm_suite;
+  return key->ext ? key->ext->key_algparm_suite : NULL;
 }
 
 /**
@@ -659,7 +915,10 @@ pskc_get_key_algparm_suite (pskc_key_t * key)
 void
 pskc_set_key_algparm_suite (pskc_key_t * key, const char *keyalgparmsuite)
 {
-  key->key_algparm_suite = keyalgparmsuite;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->key_algparm_suite = keyalgparmsuite;
 }
 
 /**
@@ -679,15 +938,28 @@ pskc_set_key_algparm_suite (pskc_key_t * key, const char *keyalgparmsuite)
 pskc_valueformat
 pskc_get_key_algparm_chall_encoding (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_chall_encoding_str)
+      if (ext && ext->key_algparm_chall_encoding_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_chall_encoding;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_chall_encoding_str
+      && !cached (key, PSKC_CACHED_CHALL_ENCODING))
+    {
+      ext->key_algparm_chall_encoding =
+	pskc_str2valueformat (ext->key_algparm_chall_encoding_str);
+      key->cached |= PSKC_CACHED_CHALL_ENCODING;
+    }
+
+  return ext->key_algparm_chall_encoding;
 }
 
 /**
@@ -704,8 +976,14 @@ pskc_get_key_algparm_chall_encoding (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_chall_encoding (pskc_key_t * key, pskc_valueformat vf)
 {
-  key->key_algparm_chall_encoding_str = "set";
-  key->key_algparm_chall_encoding = vf;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_chall_encoding_str = "set";
+  ext->key_algparm_chall_encoding = vf;
+  key->cached |= PSKC_CACHED_CHALL_ENCODING;
 }
 
 /**
@@ -730,15 +1008,27 @@ pskc_set_key_algparm_chall_encoding (pskc_key_t * key, pskc_valueformat vf)
 uint32_t
 pskc_get_key_algparm_chall_min (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_chall_min_str)
+      if (ext && ext->key_algparm_chall_min_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_chall_min;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_chall_min_str && !cached (key, PSKC_CACHED_CHALL_MIN))
+    {
+      ext->key_algparm_chall_min =
+	strtoul (ext->key_algparm_chall_min_str, NULL, 10);
+      key->cached |= PSKC_CACHED_CHALL_MIN;
+    }
+
+  return ext->key_algparm_chall_min;
 }
 
 /**
@@ -760,8 +1050,14 @@ pskc_get_key_algparm_chall_min (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_chall_min (pskc_key_t * key, uint32_t challmin)
 {
-  key->key_algparm_chall_min_str = "set";
-  key->key_algparm_chall_min = challmin;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_chall_min_str = "set";
+  ext->key_algparm_chall_min = challmin;
+  key->cached |= PSKC_CACHED_CHALL_MIN;
 }
 
 /**
@@ -786,15 +1082,27 @@ pskc_set_key_algparm_chall_min (pskc_key_t * key, uint32_t challmin)
 uint32_t
 pskc_get_key_algparm_chall_max (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_chall_max_str)
+      if (ext && ext->key_algparm_chall_max_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_chall_max;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_chall_max_str && !cached (key, PSKC_CACHED_CHALL_MAX))
+    {
+      ext->key_algparm_chall_max =
+	strtoul (ext->key_algparm_chall_max_str, NULL, 10);
+      key->cached |= PSKC_CACHED_CHALL_MAX;
+    }
+
+  return ext->key_algparm_chall_max;
 }
 
 /**
@@ -816,8 +1124,14 @@ pskc_get_key_algparm_chall_max (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_chall_max (pskc_key_t * key, uint32_t challmax)
 {
-  key->key_algparm_chall_max_str = "set";
-  key->key_algparm_chall_max = challmax;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_chall_max_str = "set";
+  ext->key_algparm_chall_max = challmax;
+  key->cached |= PSKC_CACHED_CHALL_MAX;
 }
 
 /**
@@ -843,15 +1157,28 @@ pskc_set_key_algparm_chall_max (pskc_key_t * key, uint32_t challmax)
 int
 pskc_get_key_algparm_chall_checkdigits (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_chall_checkdigits_str)
+      if (ext && ext->key_algparm_chall_checkdigits_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_chall_checkdigits;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_chall_checkdigits_str
+      && !cached (key, PSKC_CACHED_CHALL_CHECKDIGITS))
+    {
+      ext->key_algparm_chall_checkdigits =
+	str2checkdigits (ext->key_algparm_chall_checkdigits_str);
+      key->cached |= PSKC_CACHED_CHALL_CHECKDIGITS;
+    }
+
+  return ext->key_algparm_chall_checkdigits;
 }
 
 /**
@@ -873,8 +1200,14 @@ pskc_get_key_algparm_chall_checkdigits (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_chall_checkdigits (pskc_key_t * key, int checkdigit)
 {
-  key->key_algparm_chall_checkdigits_str = "set";
-  key->key_algparm_chall_checkdigits = checkdigit ? 1 : 0;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_chall_checkdigits_str = "set";
+  ext->key_algparm_chall_checkdigits = checkdigit ? 1 : 0;
+  key->cached |= PSKC_CACHED_CHALL_CHECKDIGITS;
 }
 
 /**
@@ -894,15 +1227,28 @@ pskc_set_key_algparm_chall_checkdigits (pskc_key_t * key, int checkdigit)
 pskc_valueformat
 pskc_get_key_algparm_resp_encoding (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_resp_encoding_str)
+      if (ext && ext->key_algparm_resp_encoding_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_resp_encoding;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_resp_encoding_str
+      && !cached (key, PSKC_CACHED_RESP_ENCODING))
+    {
+      ext->key_algparm_resp_encoding =
+	pskc_str2valueformat (ext->key_algparm_resp_encoding_str);
+      key->cached |= PSKC_CACHED_RESP_ENCODING;
+    }
+
+  return ext->key_algparm_resp_encoding;
 }
 
 /**
@@ -919,8 +1265,14 @@ pskc_get_key_algparm_resp_encoding (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_resp_encoding (pskc_key_t * key, pskc_valueformat vf)
 {
-  key->key_algparm_resp_encoding_str = "set";
-  key->key_algparm_resp_encoding = vf;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_resp_encoding_str = "set";
+  ext->key_algparm_resp_encoding = vf;
+  key->cached |= PSKC_CACHED_RESP_ENCODING;
 }
 
 /**
@@ -944,15 +1296,28 @@ pskc_set_key_algparm_resp_encoding (pskc_key_t * key, pskc_valueformat vf)
 uint32_t
 pskc_get_key_algparm_resp_length (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_resp_length_str)
+      if (ext && ext->key_algparm_resp_length_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_resp_length;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_resp_length_str
+      && !cached (key, PSKC_CACHED_RESP_LENGTH))
+    {
+      ext->key_algparm_resp_length =
+	strtoul (ext->key_algparm_resp_length_str, NULL, 10);
+      key->cached |= PSKC_CACHED_RESP_LENGTH;
+    }
+
+  return ext->key_algparm_resp_length;
 }
 
 /**
@@ -973,8 +1338,14 @@ pskc_get_key_algparm_resp_length (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_resp_length (pskc_key_t * key, uint32_t length)
 {
-  key->key_algparm_resp_length_str = "set";
-  key->key_algparm_resp_length = length;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_resp_length_str = "set";
+  ext->key_algparm_resp_length = length;
+  key->cached |= PSKC_CACHED_RESP_LENGTH;
 }
 
 /**
@@ -999,15 +1370,28 @@ pskc_set_key_algparm_resp_length (pskc_key_t * key, uint32_t length)
 int
 pskc_get_key_algparm_resp_checkdigits (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_algparm_resp_checkdigits_str)
+      if (ext && ext->key_algparm_resp_checkdigits_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_algparm_resp_checkdigits;
+  if (!ext)
+    return 0;
+
+  if (ext->key_algparm_resp_checkdigits_str
+      && !cached (key, PSKC_CACHED_RESP_CHECKDIGITS))
+    {
+      ext->key_algparm_resp_checkdigits =
+	str2checkdigits (ext->key_algparm_resp_checkdigits_str);
+      key->cached |= PSKC_CACHED_RESP_CHECKDIGITS;
+    }
+
+  return ext->key_algparm_resp_checkdigits;
 }
 
 /**
@@ -1028,8 +1412,14 @@ pskc_get_key_algparm_resp_checkdigits (pskc_key_t * key, int *present)
 void
 pskc_set_key_algparm_resp_checkdigits (pskc_key_t * key, int checkdigit)
 {
-  key->key_algparm_resp_checkdigits_str = "set";
-  key->key_algparm_resp_checkdigits = checkdigit ? 1 : 0;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_algparm_resp_checkdigits_str = "set";
+  ext->key_algparm_resp_checkdigits = checkdigit ? 1 : 0;
+  key->cached |= PSKC_CACHED_RESP_CHECKDIGITS;
 }
 
 /**
@@ -1044,7 +1434,7 @@ pskc_set_key_algparm_resp_checkdigits (pskc_key_t * key, int checkdigit)
 const char *
 pskc_get_key_profileid (pskc_key_t * key)
 {
-  return key->key_profileid;
+  return key->ext ? key->ext->key_profileid : NULL;
 }
 
 /**
@@ -1063,7 +1453,10 @@ pskc_get_key_profileid (pskc_key_t * key)
 void
 pskc_set_key_profileid (pskc_key_t * key, const char *profileid)
 {
-  key->key_profileid = profileid;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->key_profileid = profileid;
 }
 
 /**
@@ -1078,7 +1471,7 @@ pskc_set_key_profileid (pskc_key_t * key, const char *profileid)
 const char *
 pskc_get_key_reference (pskc_key_t * key)
 {
-  return key->key_reference;
+  return key->ext ? key->ext->key_reference : NULL;
 }
 
 /**
@@ -1097,7 +1490,10 @@ pskc_get_key_reference (pskc_key_t * key)
 void
 pskc_set_key_reference (pskc_key_t * key, const char *keyref)
 {
-  key->key_reference = keyref;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->key_reference = keyref;
 }
 
 /**
@@ -1112,7 +1508,7 @@ pskc_set_key_reference (pskc_key_t * key, const char *keyref)
 const char *
 pskc_get_key_friendlyname (pskc_key_t * key)
 {
-  return key->key_friendlyname;
+  return key->ext ? key->ext->key_friendlyname : NULL;
 }
 
 /**
@@ -1131,7 +1527,10 @@ pskc_get_key_friendlyname (pskc_key_t * key)
 void
 pskc_set_key_friendlyname (pskc_key_t * key, const char *fname)
 {
-  key->key_friendlyname = fname;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->key_friendlyname = fname;
 }
 
 /**
@@ -1166,6 +1565,8 @@ void
 pskc_set_key_userid (pskc_key_t * key, const char *keyuserid)
 {
   key->key_userid = keyuserid;
+  if (key->container)
+    _pskc_index_invalidate (key->container, PSKC_INDEX_USERID);
 }
 
 /**
@@ -1183,6 +1584,31 @@ pskc_set_key_userid (pskc_key_t * key, const char *keyuserid)
 const char *
 pskc_get_key_data_secret (pskc_key_t * key, size_t * len)
 {
+  const char *b64;
+
+  /* Arena memory is only released by pskc_done, so do not allocate
+     again for a secret that already failed to decode. */
+  if (key->key_secret == NULL && !cached (key, PSKC_CACHED_SECRET_INVALID)
+      && (b64 = key_b64secret (key)))
+    {
+      size_t l = strlen (b64);
+      size_t outlen = 3 * (l / 4) + 3;
+      char *out = _pskc_arena_alloc (key->arena, outlen);
+
+      if (out == NULL)
+	_pskc_debug ("base64 malloc failed");
+      else if (!base64_decode (b64, l, out, &outlen))
+	{
+	  _pskc_debug ("base64 decoding failed");
+	  key->cached |= PSKC_CACHED_SECRET_INVALID;
+	}
+      else
+	{
+	  key->key_secret = out;
+	  key->key_secret_len = outlen;
+	}
+    }
+
   if (len)
     *len = key->key_secret_len;
   return key->key_secret;
@@ -1198,7 +1624,8 @@ pskc_get_key_data_secret (pskc_key_t * key, size_t * len)
  * copied into the @key handle, so you may modify or deallocate the
  * @data pointer after calling this function.  The data is base64
  * encoded by this function.  On errors, the old secret is not
- * modified.
+ * modified.  The memory of a replaced secret is released together
+ * with the key package, e.g., by pskc_done().
  *
  * Returns: %PSKC_BASE64_ERROR on base64 encoding errors,
  *   %PSKC_MALLOC_ERROR on memory allocation errors, or %PSKC_OK on
@@ -1210,26 +1637,25 @@ int
 pskc_set_key_data_secret (pskc_key_t * key, const char *data, size_t len)
 {
   char *out, *datacopy;
+  size_t outlen = BASE64_LENGTH (len);
 
-  datacopy = malloc (len);
-  if (datacopy == NULL)
-    return PSKC_MALLOC_ERROR;
-  memcpy (datacopy, data, len);
-
-  base64_encode_alloc (data, len, &out);
-  if (out == NULL)
+  if (outlen < len)
     {
       _pskc_debug ("base64 encoding failed");
-      free (datacopy);
       return PSKC_BASE64_ERROR;
     }
 
-  free (key->key_b64secret);
-  free (key->key_secret);
+  datacopy = _pskc_arena_memdup (key->arena, data, len);
+  out = _pskc_arena_alloc (key->arena, outlen + 1);
+  if (datacopy == NULL || out == NULL)
+    return PSKC_MALLOC_ERROR;
+
+  base64_encode (data, len, out, outlen + 1);
 
   key->key_b64secret = out;
   key->key_secret = datacopy;
   key->key_secret_len = len;
+  key->cached &= ~PSKC_CACHED_SECRET_INVALID;
 
   return PSKC_OK;
 }
@@ -1247,7 +1673,7 @@ pskc_set_key_data_secret (pskc_key_t * key, const char *data, size_t len)
 const char *
 pskc_get_key_data_b64secret (pskc_key_t * key)
 {
-  return key->key_b64secret;
+  return key_b64secret (key);
 }
 
 /**
@@ -1260,7 +1686,8 @@ pskc_get_key_data_b64secret (pskc_key_t * key)
  * @key handle, so you may modify or deallocate the @b64secret pointer
  * after calling this function.  The data is base64 decoded by this
  * function to verify data validity.  On errors, the old secret is not
- * modified.
+ * modified.  The memory of a replaced secret is released together
+ * with the key package, e.g., by pskc_done().
  *
  * Returns: %PSKC_BASE64_ERROR on base64 decoding errors,
  *   %PSKC_MALLOC_ERROR on memory allocation errors, or %PSKC_OK on
@@ -1273,34 +1700,29 @@ pskc_set_key_data_b64secret (pskc_key_t * key, const char *b64secret)
 {
   size_t l = strlen (b64secret);
   char *out, *b64copy;
-  size_t outlen;
-  bool ok;
-
-  b64copy = malloc (l + 1);
-  if (b64copy == NULL)
-    return PSKC_MALLOC_ERROR;
-  memcpy (b64copy, b64secret, l + 1);
+  size_t outlen = 3 * (l / 4) + 3;
 
-  ok = base64_decode_alloc (b64secret, l, &out, &outlen);
-  if (!ok)
-    {
-      _pskc_debug ("base64 decoding failed");
-      free (b64copy);
-      return PSKC_BASE64_ERROR;
-    }
+  out = _pskc_arena_alloc (key->arena, outlen);
   if (out == NULL)
     {
       _pskc_debug ("base64 malloc failed");
-      free (b64copy);
       return PSKC_MALLOC_ERROR;
     }
 
-  free (key->key_b64secret);
-  free (key->key_secret);
+  if (!base64_decode (b64secret, l, out, &outlen))
+    {
+      _pskc_debug ("base64 decoding failed");
+      return PSKC_BASE64_ERROR;
+    }
+
+  b64copy = _pskc_arena_memdup (key->arena, b64secret, l);
+  if (b64copy == NULL)
+    return PSKC_MALLOC_ERROR;
 
   key->key_b64secret = b64copy;
   key->key_secret = out;
   key->key_secret_len = outlen;
+  key->cached &= ~PSKC_CACHED_SECRET_INVALID;
 
   return PSKC_OK;
 }
@@ -1329,6 +1751,12 @@ pskc_get_key_data_counter (pskc_key_t * key, int *present)
 	*present = 0;
     }
 
+  if (key->key_counter_str && !cached (key, PSKC_CACHED_COUNTER))
+    {
+      key->key_counter = strtoull (key->key_counter_str, NULL, 10);
+      key->cached |= PSKC_CACHED_COUNTER;
+    }
+
   return key->key_counter;
 }
 
@@ -1347,6 +1775,7 @@ pskc_set_key_data_counter (pskc_key_t * key, uint64_t counter)
 {
   key->key_counter_str = "set";
   key->key_counter = counter;
+  key->cached |= PSKC_CACHED_COUNTER;
 }
 
 /**
@@ -1375,6 +1804,12 @@ pskc_get_key_data_time (pskc_key_t * key, int *present)
 	*present = 0;
     }
 
+  if (key->key_time_str && !cached (key, PSKC_CACHED_TIME))
+    {
+      key->key_time = strtoul (key->key_time_str, NULL, 10);
+      key->cached |= PSKC_CACHED_TIME;
+    }
+
   return key->key_time;
 }
 
@@ -1395,6 +1830,7 @@ pskc_set_key_data_time (pskc_key_t * key, uint32_t datatime)
 {
   key->key_time_str = "set";
   key->key_time = datatime;
+  key->cached |= PSKC_CACHED_TIME;
 }
 
 /**
@@ -1423,6 +1859,12 @@ pskc_get_key_data_timeinterval (pskc_key_t * key, int *present)
 	*present = 0;
     }
 
+  if (key->key_timeinterval_str && !cached (key, PSKC_CACHED_TIMEINTERVAL))
+    {
+      key->key_timeinterval = strtoul (key->key_timeinterval_str, NULL, 10);
+      key->cached |= PSKC_CACHED_TIMEINTERVAL;
+    }
+
   return key->key_timeinterval;
 }
 
@@ -1443,6 +1885,7 @@ pskc_set_key_data_timeinterval (pskc_key_t * key, uint32_t timeinterval)
 {
   key->key_timeinterval_str = "set";
   key->key_timeinterval = timeinterval;
+  key->cached |= PSKC_CACHED_TIMEINTERVAL;
 }
 
 /**
@@ -1476,6 +1919,12 @@ pskc_get_key_data_timedrift (pskc_key_t * key, int *present)
 	*present = 0;
     }
 
+  if (key->key_timedrift_str && !cached (key, PSKC_CACHED_TIMEDRIFT))
+    {
+      key->key_timedrift = strtoul (key->key_timedrift_str, NULL, 10);
+      key->cached |= PSKC_CACHED_TIMEDRIFT;
+    }
+
   return key->key_timedrift;
 }
 
@@ -1501,6 +1950,7 @@ pskc_set_key_data_timedrift (pskc_key_t * key, uint32_t timedrift)
 {
   key->key_timedrift_str = "set";
   key->key_timedrift = timedrift;
+  key->cached |= PSKC_CACHED_TIMEDRIFT;
 }
 
 /**
@@ -1516,9 +1966,13 @@ pskc_set_key_data_timedrift (pskc_key_t * key, uint32_t timedrift)
 const struct tm *
 pskc_get_key_policy_startdate (pskc_key_t * key)
 {
-  if (!key->key_policy_startdate_str)
+  struct pskc_key_ext *ext = key->ext;
+
+  if (!ext || !ext->key_policy_startdate_str)
     return NULL;
-  return &key->key_policy_startdate;
+  return key_date (key, ext->key_policy_startdate,
+		   &ext->key_policy_startdate_tm,
+		   PSKC_CACHED_POLICY_STARTDATE);
 }
 
 /**
@@ -1534,9 +1988,14 @@ pskc_get_key_policy_startdate (pskc_key_t * key)
 void
 pskc_set_key_policy_startdate (pskc_key_t * key, const struct tm *startdate)
 {
-  key->key_policy_startdate_str = "set";
-  memcpy (&key->key_policy_startdate, startdate,
-	  sizeof (key->key_policy_startdate));
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_startdate_str = "set";
+  ext->key_policy_startdate = _pskc_tm2time (startdate);
+  key->cached &= ~PSKC_CACHED_POLICY_STARTDATE;
 }
 
 /**
@@ -1552,9 +2011,13 @@ pskc_set_key_policy_startdate (pskc_key_t * key, const struct tm *startdate)
 const struct tm *
 pskc_get_key_policy_expirydate (pskc_key_t * key)
 {
-  if (!key->key_policy_expirydate_str)
+  struct pskc_key_ext *ext = key->ext;
+
+  if (!ext || !ext->key_policy_expirydate_str)
     return NULL;
-  return &key->key_policy_expirydate;
+  return key_date (key, ext->key_policy_expirydate,
+		   &ext->key_policy_expirydate_tm,
+		   PSKC_CACHED_POLICY_EXPIRYDATE);
 }
 
 /**
@@ -1570,9 +2033,14 @@ pskc_get_key_policy_expirydate (pskc_key_t * key)
 void
 pskc_set_key_policy_expirydate (pskc_key_t * key, const struct tm *expirydate)
 {
-  key->key_policy_expirydate_str = "set";
-  memcpy (&key->key_policy_expirydate, expirydate,
-	  sizeof (key->key_policy_expirydate));
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_expirydate_str = "set";
+  ext->key_policy_expirydate = _pskc_tm2time (expirydate);
+  key->cached &= ~PSKC_CACHED_POLICY_EXPIRYDATE;
 }
 
 /**
@@ -1590,7 +2058,7 @@ pskc_set_key_policy_expirydate (pskc_key_t * key, const struct tm *expirydate)
 const char *
 pskc_get_key_policy_pinkeyid (pskc_key_t * key)
 {
-  return key->key_policy_pinkeyid;
+  return key->ext ? key->ext->key_policy_pinkeyid : NULL;
 }
 
 /**
@@ -1612,7 +2080,10 @@ pskc_get_key_policy_pinkeyid (pskc_key_t * key)
 void
 pskc_set_key_policy_pinkeyid (pskc_key_t * key, const char *pinkeyid)
 {
-  key->key_policy_pinkeyid = pinkeyid;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext)
+    ext->key_policy_pinkeyid = pinkeyid;
 }
 
 /**
@@ -1632,15 +2103,28 @@ pskc_set_key_policy_pinkeyid (pskc_key_t * key, const char *pinkeyid)
 pskc_pinusagemode
 pskc_get_key_policy_pinusagemode (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_pinusagemode_str)
+      if (ext && ext->key_policy_pinusagemode_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_pinusagemode;
+  if (!ext)
+    return 0;
+
+  if (ext->key_policy_pinusagemode_str
+      && !cached (key, PSKC_CACHED_PINUSAGEMODE))
+    {
+      ext->key_policy_pinusagemode =
+	pskc_str2pinusagemode (ext->key_policy_pinusagemode_str);
+      key->cached |= PSKC_CACHED_PINUSAGEMODE;
+    }
+
+  return ext->key_policy_pinusagemode;
 }
 
 /**
@@ -1658,8 +2142,14 @@ void
 pskc_set_key_policy_pinusagemode (pskc_key_t * key,
 				  pskc_pinusagemode pinusagemode)
 {
-  key->key_policy_pinusagemode_str = "set";
-  key->key_policy_pinusagemode = pinusagemode;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_pinusagemode_str = "set";
+  ext->key_policy_pinusagemode = pinusagemode;
+  key->cached |= PSKC_CACHED_PINUSAGEMODE;
 }
 
 /**
@@ -1681,15 +2171,28 @@ pskc_set_key_policy_pinusagemode (pskc_key_t * key,
 uint32_t
 pskc_get_key_policy_pinmaxfailedattempts (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_pinmaxfailedattempts_str)
+      if (ext && ext->key_policy_pinmaxfailedattempts_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_pinmaxfailedattempts;
+  if (!ext)
+    return 0;
+
+  if (ext->key_policy_pinmaxfailedattempts_str
+      && !cached (key, PSKC_CACHED_PINMAXFAILEDATTEMPTS))
+    {
+      ext->key_policy_pinmaxfailedattempts =
+	strtoul (ext->key_policy_pinmaxfailedattempts_str, NULL, 10);
+      key->cached |= PSKC_CACHED_PINMAXFAILEDATTEMPTS;
+    }
+
+  return ext->key_policy_pinmaxfailedattempts;
 }
 
 /**
@@ -1708,8 +2211,14 @@ pskc_get_key_policy_pinmaxfailedattempts (pskc_key_t * key, int *present)
 void
 pskc_set_key_policy_pinmaxfailedattempts (pskc_key_t * key, uint32_t attempts)
 {
-  key->key_policy_pinmaxfailedattempts_str = "set";
-  key->key_policy_pinmaxfailedattempts = attempts;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_pinmaxfailedattempts_str = "set";
+  ext->key_policy_pinmaxfailedattempts = attempts;
+  key->cached |= PSKC_CACHED_PINMAXFAILEDATTEMPTS;
 }
 
 /**
@@ -1734,15 +2243,28 @@ pskc_set_key_policy_pinmaxfailedattempts (pskc_key_t * key, uint32_t attempts)
 uint32_t
 pskc_get_key_policy_pinminlength (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_pinminlength_str)
+      if (ext && ext->key_policy_pinminlength_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_pinminlength;
+  if (!ext)
+    return 0;
+
+  if (ext->key_policy_pinminlength_str
+      && !cached (key, PSKC_CACHED_PINMINLENGTH))
+    {
+      ext->key_policy_pinminlength =
+	strtoul (ext->key_policy_pinminlength_str, NULL, 10);
+      key->cached |= PSKC_CACHED_PINMINLENGTH;
+    }
+
+  return ext->key_policy_pinminlength;
 }
 
 /**
@@ -1764,8 +2286,14 @@ pskc_get_key_policy_pinminlength (pskc_key_t * key, int *present)
 void
 pskc_set_key_policy_pinminlength (pskc_key_t * key, uint32_t minlength)
 {
-  key->key_policy_pinminlength_str = "set";
-  key->key_policy_pinminlength = minlength;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_pinminlength_str = "set";
+  ext->key_policy_pinminlength = minlength;
+  key->cached |= PSKC_CACHED_PINMINLENGTH;
 }
 
 /**
@@ -1790,15 +2318,28 @@ pskc_set_key_policy_pinminlength (pskc_key_t * key, uint32_t minlength)
 uint32_t
 pskc_get_key_policy_pinmaxlength (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_pinmaxlength_str)
+      if (ext && ext->key_policy_pinmaxlength_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_pinmaxlength;
+  if (!ext)
+    return 0;
+
+  if (ext->key_policy_pinmaxlength_str
+      && !cached (key, PSKC_CACHED_PINMAXLENGTH))
+    {
+      ext->key_policy_pinmaxlength =
+	strtoul (ext->key_policy_pinmaxlength_str, NULL, 10);
+      key->cached |= PSKC_CACHED_PINMAXLENGTH;
+    }
+
+  return ext->key_policy_pinmaxlength;
 }
 
 /**
@@ -1820,8 +2361,14 @@ pskc_get_key_policy_pinmaxlength (pskc_key_t * key, int *present)
 void
 pskc_set_key_policy_pinmaxlength (pskc_key_t * key, uint32_t maxlength)
 {
-  key->key_policy_pinmaxlength_str = "set";
-  key->key_policy_pinmaxlength = maxlength;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_pinmaxlength_str = "set";
+  ext->key_policy_pinmaxlength = maxlength;
+  key->cached |= PSKC_CACHED_PINMAXLENGTH;
 }
 
 /**
@@ -1841,15 +2388,28 @@ pskc_set_key_policy_pinmaxlength (pskc_key_t * key, uint32_t maxlength)
 pskc_valueformat
 pskc_get_key_policy_pinencoding (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_pinencoding_str)
+      if (ext && ext->key_policy_pinencoding_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_pinencoding;
+  if (!ext)
+    return 0;
+
+  if (ext->key_policy_pinencoding_str
+      && !cached (key, PSKC_CACHED_PINENCODING))
+    {
+      ext->key_policy_pinencoding =
+	pskc_str2valueformat (ext->key_policy_pinencoding_str);
+      key->cached |= PSKC_CACHED_PINENCODING;
+    }
+
+  return ext->key_policy_pinencoding;
 }
 
 /**
@@ -1867,8 +2427,14 @@ void
 pskc_set_key_policy_pinencoding (pskc_key_t * key,
 				 pskc_valueformat pinencoding)
 {
-  key->key_policy_pinencoding_str = "set";
-  key->key_policy_pinencoding = pinencoding;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_pinencoding_str = "set";
+  ext->key_policy_pinencoding = pinencoding;
+  key->cached |= PSKC_CACHED_PINENCODING;
 }
 
 /**
@@ -1889,15 +2455,17 @@ pskc_set_key_policy_pinencoding (pskc_key_t * key,
 int
 pskc_get_key_policy_keyusages (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_keyusage_str)
+      if (ext && ext->key_policy_keyusage_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_keyusages;
+  return ext ? ext->key_policy_keyusages : 0;
 }
 
 /**
@@ -1914,8 +2482,13 @@ pskc_get_key_policy_keyusages (pskc_key_t * key, int *present)
 void
 pskc_set_key_policy_keyusages (pskc_key_t * key, int keyusages)
 {
-  key->key_policy_keyusage_str = "set";
-  key->key_policy_keyusages = keyusages;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_keyusage_str = "set";
+  ext->key_policy_keyusages = keyusages;
 }
 
 /**
@@ -1941,15 +2514,28 @@ pskc_set_key_policy_keyusages (pskc_key_t * key, int keyusages)
 uint64_t
 pskc_get_key_policy_numberoftransactions (pskc_key_t * key, int *present)
 {
+  struct pskc_key_ext *ext = key->ext;
+
   if (present)
     {
-      if (key->key_policy_numberoftransactions_str)
+      if (ext && ext->key_policy_numberoftransactions_str)
 	*present = 1;
       else
 	*present = 0;
     }
 
-  return key->key_policy_numberoftransactions;
+  if (!ext)
+    return 0;
+
+  if (ext->key_policy_numberoftransactions_str
+      && !cached (key, PSKC_CACHED_NUMBEROFTRANSACTIONS))
+    {
+      ext->key_policy_numberoftransactions =
+	strtoull (ext->key_policy_numberoftransactions_str, NULL, 10);
+      key->cached |= PSKC_CACHED_NUMBEROFTRANSACTIONS;
+    }
+
+  return ext->key_policy_numberoftransactions;
 }
 
 /**
@@ -1972,6 +2558,12 @@ pskc_get_key_policy_numberoftransactions (pskc_key_t * key, int *present)
 void
 pskc_set_key_policy_numberoftransactions (pskc_key_t * key, uint64_t uses)
 {
-  key->key_policy_numberoftransactions_str = "set";
-  key->key_policy_numberoftransactions = uses;
+  struct pskc_key_ext *ext = _pskc_key_ext (key);
+
+  if (ext == NULL)
+    return;
+
+  ext->key_policy_numberoftransactions_str = "set";
+  ext->key_policy_numberoftransactions = uses;
+  key->cached |= PSKC_CACHED_NUMBEROFTRANSACTIONS;
 }
@@ -1,8 +1,5 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
 #include <pskc/pskc.h>
 
 /*
@@ -15,9 +12,7 @@
 int
 main (int argc, const char *argv[])
 {
-  struct stat st;
-  FILE *fh = NULL;
-  char *buffer = NULL, *out;
+  char *out;
   size_t i;
   pskc_t *container = NULL;
   pskc_key_t *keypackage;
@@ -36,36 +31,7 @@ main (int argc, const char *argv[])
       goto done;
     }
 
-  /* Part 1: Read file. */
-
-  fh = fopen (argv[1], "r");
-  if (fh == NULL)
-    {
-      perror ("fopen");
-      goto done;
-    }
-
-  if (fstat (fileno (fh), &st) != 0)
-    {
-      perror ("fstat");
-      goto done;
-    }
-
-  buffer = malloc (st.st_size);
-  if (buffer == NULL)
-    {
-      perror ("malloc");
-      goto done;
-    }
-
-  i = fread (buffer, 1, st.st_size, fh);
-  if (i != st.st_size)
-    {
-      fprintf (stderr, "short read\n");
-      goto done;
-    }
-
-  /* Part 2: Parse PSKC data. */
+  /* Part 1: Parse PSKC data. */
 
   rc = pskc_init (&container);
   if (rc != PSKC_OK)
@@ -74,14 +40,14 @@ main (int argc, const char *argv[])
       goto done;
     }
 
-  rc = pskc_parse_from_memory (container, i, buffer);
+  rc = pskc_parse_from_file (container, argv[1]);
   if (rc != PSKC_OK)
     {
-      fprintf (stderr, "pskc_parse_from_memory: %s\n", pskc_strerror (rc));
+      fprintf (stderr, "pskc_parse_from_file: %s\n", pskc_strerror (rc));
       goto done;
     }
 
-  /* Part 3: Output human readable variant of PSKC data to stderr. */
+  /* Part 2: Output human readable variant of PSKC data to stderr. */
 
   rc = pskc_output (container, PSKC_OUTPUT_HUMAN_COMPLETE, &out, &i);
   if (rc != PSKC_OK)
@@ -94,7 +60,7 @@ main (int argc, const char *argv[])
 
   pskc_free (out);
 
-  /* Part 4: Validate PSKC data. */
+  /* Part 3: Validate PSKC data. */
 
   rc = pskc_validate (container, &isvalid);
   if (rc != PSKC_OK)
@@ -105,7 +71,7 @@ main (int argc, const char *argv[])
 
   fprintf (stderr, "PSKC data is Schema valid: %s\n", isvalid ? "YES" : "NO");
 
-  /* Part 5: Iterate through keypackages and print key id, device
+  /* Part 4: Iterate through keypackages and print key id, device
      serial number and base64 encoded secret. */
 
   for (i = 0; (keypackage = pskc_get_keypackage (container, i)); i++)
@@ -123,9 +89,6 @@ main (int argc, const char *argv[])
 
 done:
   pskc_done (container);
-  if (fh && fclose (fh) != 0)
-    perror ("fclose");
-  free (buffer);
   pskc_global_done ();
   exit (exit_code);
 }
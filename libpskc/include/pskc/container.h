@@ -29,7 +29,8 @@
  * PSKC data is represented through the #pskc_t type which is created
  * by calling pskc_init() and destroyed by calling pskc_done().  You
  * may parse PSKC data in XML form from a buffer by calling
- * pskc_parse_from_memory().  To convert PSKC data to human readable
+ * pskc_parse_from_memory(), or from a file with pskc_parse_from_file()
+ * or pskc_parse_from_fd().  To convert PSKC data to human readable
  * form you may use pskc_output().  To validate PSKC data against the
  * XML Schema, you may use pskc_validate().  To generate PSKC based on
  * the internal parsed representation you may use pskc_build_xml()
@@ -39,7 +40,9 @@
  * The PSKC data structure is a high-level structure that only carries
  * a version indicator (see pskc_get_version()), an optional identity
  * field (see pskc_get_id()) and any number of #pskc_key_t types, each
- * containing one key (see pskc_get_keypackage()).
+ * containing one key (see pskc_get_keypackage()).  Key packages can
+ * also be looked up with pskc_find_by_key_id(),
+ * pskc_find_by_serialno() and pskc_find_by_userid().
  */
 
 extern PSKCAPI int pskc_init (pskc_t ** container);
@@ -47,6 +50,11 @@ extern PSKCAPI void pskc_done (pskc_t * container);
 
 extern PSKCAPI int pskc_parse_from_memory (pskc_t * container,
 					   size_t len, const char *buffer);
+extern PSKCAPI int pskc_parse_from_file (pskc_t * container,
+					 const char *filename);
+extern PSKCAPI int pskc_parse_from_fd (pskc_t * container, int fd);
+extern PSKCAPI void pskc_set_parse_threads (pskc_t * container,
+					    unsigned threads);
 
 extern PSKCAPI int pskc_get_signed_p (pskc_t * container);
 
@@ -73,6 +81,13 @@ extern PSKCAPI pskc_key_t *pskc_get_keypackage (pskc_t * container, size_t i);
 extern PSKCAPI int pskc_add_keypackage (pskc_t * container,
 					pskc_key_t ** key);
 
+extern PSKCAPI pskc_key_t *pskc_find_by_key_id (pskc_t * container,
+						const char *keyid);
+extern PSKCAPI pskc_key_t *pskc_find_by_serialno (pskc_t * container,
+						  const char *serialno);
+extern PSKCAPI pskc_key_t *pskc_find_by_userid (pskc_t * container,
+						const char *userid);
+
 /**
  * pskc_output_formats_t:
  * @PSKC_OUTPUT_HUMAN_COMPLETE: All information in human-readable format.
@@ -70,6 +70,7 @@ extern "C"
 #include <pskc/container.h>
 #include <pskc/enums.h>
 #include <pskc/keypackage.h>
+#include <pskc/reader.h>
 
 #ifdef __cplusplus
 }
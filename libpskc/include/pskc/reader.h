@@ -0,0 +1,57 @@
+/*
+ * pskc/reader.h - PSKC header file with streaming reader prototypes.
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef PSKC_READER_H
+#define PSKC_READER_H
+
+/**
+ * SECTION:reader
+ * @short_description: Streaming PSKC key package reader.
+ *
+ * A #pskc_reader_t reads the key packages of PSKC data one at a
+ * time, without building the whole container in memory.  It is
+ * created by pskc_reader_open() or pskc_reader_open_memory() and
+ * destroyed by pskc_reader_done().  Each call to
+ * pskc_reader_next_keypackage() gives back the next key package as a
+ * #pskc_key_t, which may be inspected with the usual keypackage
+ * functions until the next call.  Memory use is bounded by the size
+ * of the largest key package, however large the PSKC data is.
+ */
+
+/**
+ * pskc_reader_t:
+ *
+ * Streaming reader of the key packages in PSKC data, see
+ * pskc_reader_open().
+ *
+ * Since: 2.6.0
+ */
+typedef struct pskc_reader pskc_reader_t;
+
+extern PSKCAPI int pskc_reader_open (pskc_reader_t ** reader,
+				     const char *filename);
+extern PSKCAPI int pskc_reader_open_memory (pskc_reader_t ** reader,
+					    size_t len, const char *buffer);
+extern PSKCAPI int pskc_reader_next_keypackage (pskc_reader_t * reader,
+						pskc_key_t ** key);
+extern PSKCAPI void pskc_reader_done (pskc_reader_t * reader);
+
+#endif /* PSKC_READER_H */
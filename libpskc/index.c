@@ -0,0 +1,225 @@
+/*
+ * index.c - Hash indexes for finding PSKC key packages.
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <pskc/pskc.h>
+
+#define INTERNAL_NEED_PSKC_STRUCT
+#define INTERNAL_NEED_PSKC_KEY_STRUCT
+#include "internal.h"
+
+#include <stdint.h>		/* SIZE_MAX */
+#include <stdlib.h>		/* calloc */
+#include <string.h>		/* strcmp */
+
+/* The string @key is indexed by in index @which, or NULL. */
+static const char *
+index_string (struct pskc_key *key, int which)
+{
+  switch (which)
+    {
+    case PSKC_INDEX_KEY_ID:
+      return key->key_id;
+
+    case PSKC_INDEX_SERIALNO:
+      return key->device_serialno;
+
+    default:
+      return key->key_userid ? key->key_userid : key->device_userid;
+    }
+}
+
+/* FNV-1a. */
+static size_t
+index_hash (const char *str)
+{
+  uint32_t h = 2166136261U;
+
+  for (; *str; str++)
+    h = (h ^ (unsigned char) *str) * 16777619U;
+
+  return h;
+}
+
+/* Discard index @which of @container, or all of them if @which is
+   negative, so that it is rebuilt on next use.  Called when key
+   packages are added or the indexed fields change. */
+void
+_pskc_index_invalidate (pskc_t * container, int which)
+{
+  int i;
+
+  for (i = 0; i < PSKC_INDEX_COUNT; i++)
+    if (which < 0 || which == i)
+      {
+	free (container->index[i].slots);
+	container->index[i].slots = NULL;
+	container->index[i].size = 0;
+      }
+}
+
+/* Build index @which, with open addressing and linear probing.  Each
+   slot holds one plus the number of the first key package with that
+   string, or zero. */
+static int
+index_build (pskc_t * container, int which)
+{
+  struct pskc_index *idx = &container->index[which];
+  size_t size = 16;
+  size_t i;
+
+  while (size / 2 < container->nkeypackages)
+    {
+      if (size > SIZE_MAX / 2 / sizeof (*idx->slots))
+	return PSKC_MALLOC_ERROR;
+      size *= 2;
+    }
+
+  idx->slots = calloc (size, sizeof (*idx->slots));
+  if (idx->slots == NULL)
+    return PSKC_MALLOC_ERROR;
+  idx->size = size;
+
+  for (i = 0; i < container->nkeypackages; i++)
+    {
+      const char *str = index_string (_pskc_keypackage (container, i), which);
+      size_t h;
+
+      if (str == NULL)
+	continue;
+
+      for (h = index_hash (str) & (size - 1); idx->slots[h];
+	   h = (h + 1) & (size - 1))
+	{
+	  struct pskc_key *kp = _pskc_keypackage (container,
+						  idx->slots[h] - 1);
+	  if (strcmp (index_string (kp, which), str) == 0)
+	    break;
+	}
+
+      if (idx->slots[h] == 0)
+	idx->slots[h] = i + 1;
+    }
+
+  return PSKC_OK;
+}
+
+static pskc_key_t *
+index_find (pskc_t * container, int which, const char *str)
+{
+  struct pskc_index *idx = &container->index[which];
+  size_t h;
+
+  if (str == NULL)
+    return NULL;
+
+  if (idx->slots == NULL && index_build (container, which) != PSKC_OK)
+    {
+      size_t i;
+
+      /* Out of memory, fall back to searching. */
+      for (i = 0; i < container->nkeypackages; i++)
+	{
+	  struct pskc_key *kp = _pskc_keypackage (container, i);
+	  const char *s = index_string (kp, which);
+
+	  if (s && strcmp (s, str) == 0)
+	    return kp;
+	}
+      return NULL;
+    }
+
+  for (h = index_hash (str) & (idx->size - 1); idx->slots[h];
+       h = (h + 1) & (idx->size - 1))
+    {
+      struct pskc_key *kp = _pskc_keypackage (container, idx->slots[h] - 1);
+
+      if (strcmp (index_string (kp, which), str) == 0)
+	return kp;
+    }
+
+  return NULL;
+}
+
+/**
+ * pskc_find_by_key_id:
+ * @container: a #pskc_t handle, from pskc_init().
+ * @keyid: the key identity to look for.
+ *
+ * Find the first key package in @container whose Key Id attribute is
+ * @keyid, see pskc_get_key_id().  An index is built on the first
+ * call, so that looking up many keys takes constant time each.  The
+ * index is rebuilt after key packages are added or pskc_set_key_id()
+ * is called.
+ *
+ * Returns: the #pskc_key_t handle, or NULL if there is no such key
+ *   package.
+ *
+ * Since: 2.6.0
+ **/
+pskc_key_t *
+pskc_find_by_key_id (pskc_t * container, const char *keyid)
+{
+  return index_find (container, PSKC_INDEX_KEY_ID, keyid);
+}
+
+/**
+ * pskc_find_by_serialno:
+ * @container: a #pskc_t handle, from pskc_init().
+ * @serialno: the device serial number to look for.
+ *
+ * Find the first key package in @container whose DeviceInfo SerialNo
+ * is @serialno, see pskc_get_device_serialno().  Like
+ * pskc_find_by_key_id(), the lookup uses an index built on first use.
+ *
+ * Returns: the #pskc_key_t handle, or NULL if there is no such key
+ *   package.
+ *
+ * Since: 2.6.0
+ **/
+pskc_key_t *
+pskc_find_by_serialno (pskc_t * container, const char *serialno)
+{
+  return index_find (container, PSKC_INDEX_SERIALNO, serialno);
+}
+
+/**
+ * pskc_find_by_userid:
+ * @container: a #pskc_t handle, from pskc_init().
+ * @userid: the user identity to look for.
+ *
+ * Find the first key package in @container whose Key UserId is
+ * @userid, see pskc_get_key_userid().  Key packages without a Key
+ * UserId are matched on their DeviceInfo UserId instead, see
+ * pskc_get_device_userid().  Like pskc_find_by_key_id(), the lookup
+ * uses an index built on first use.
+ *
+ * Returns: the #pskc_key_t handle, or NULL if there is no such key
+ *   package.
+ *
+ * Since: 2.6.0
+ **/
+pskc_key_t *
+pskc_find_by_userid (pskc_t * container, const char *userid)
+{
+  return index_find (container, PSKC_INDEX_USERID, userid);
+}
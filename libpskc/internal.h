@@ -19,45 +19,36 @@
  *
  */
 
-#ifdef INTERNAL_NEED_PSKC_KEY_STRUCT
-struct pskc_key
+/* Bump allocator for data owned by a container, see arena.c. */
+struct pskc_arena
 {
-  /* Allocated by us */
-  char *key_b64secret;
-  char *key_secret;
-  size_t key_secret_len;
+  struct pskc_arena_block *blocks;
+};
 
-  /* The rest are pointers into libxml structures. */
+extern void *_pskc_arena_alloc (struct pskc_arena *arena, size_t n);
+extern char *_pskc_arena_memdup (struct pskc_arena *arena,
+				 const char *data, size_t len);
+extern void _pskc_arena_merge (struct pskc_arena *arena,
+			       struct pskc_arena *from);
+extern void _pskc_arena_free (struct pskc_arena *arena);
 
+#ifdef INTERNAL_NEED_PSKC_KEY_STRUCT
+/* Rarely used fields of a key package, allocated from the arena when
+   the first of them is set. */
+struct pskc_key_ext
+{
   /* DeviceInfo */
-  const char *device_manufacturer;
-  const char *device_serialno;
-  const char *device_model;
   const char *device_issueno;
   const char *device_devicebinding;
   const char *device_startdate_str;
-  struct tm device_startdate;
+  int64_t device_startdate;
   const char *device_expirydate_str;
-  struct tm device_expirydate;
-  const char *device_userid;
+  int64_t device_expirydate;
 
   /* CryptoModuleInfo */
   const char *cryptomodule_id;
 
   /* Key */
-  const char *key_id;
-  const char *key_algorithm;
-  const char *key_userid;
-  const char *key_issuer;
-  const char *key_secret_str;
-  const char *key_counter_str;
-  uint64_t key_counter;
-  const char *key_time_str;
-  uint32_t key_time;
-  const char *key_timeinterval_str;
-  uint32_t key_timeinterval;
-  const char *key_timedrift_str;
-  uint32_t key_timedrift;
   const char *key_friendlyname;
   const char *key_profileid;
   const char *key_reference;
@@ -81,9 +72,9 @@ struct pskc_key
   const char *key_algparm_resp_checkdigits_str;
   int key_algparm_resp_checkdigits;
   const char *key_policy_startdate_str;
-  struct tm key_policy_startdate;
+  int64_t key_policy_startdate;
   const char *key_policy_expirydate_str;
-  struct tm key_policy_expirydate;
+  int64_t key_policy_expirydate;
   const char *key_policy_pinmaxfailedattempts_str;
   uint32_t key_policy_pinmaxfailedattempts;
   const char *key_policy_pinminlength_str;
@@ -95,11 +86,103 @@ struct pskc_key
   pskc_pinusagemode key_policy_pinusagemode;
   const char *key_policy_pinencoding_str;
   pskc_valueformat key_policy_pinencoding;
+
+  /* Broken-down dates handed out by the accessors. */
+  struct tm *device_startdate_tm;
+  struct tm *device_expirydate_tm;
+  struct tm *key_policy_startdate_tm;
+  struct tm *key_policy_expirydate_tm;
 };
+
+/* Bits in the cached field of struct pskc_key, set once the value of
+   a field has been converted from its string. */
+enum
+{
+  PSKC_CACHED_COUNTER = 1 << 0,
+  PSKC_CACHED_TIME = 1 << 1,
+  PSKC_CACHED_TIMEINTERVAL = 1 << 2,
+  PSKC_CACHED_TIMEDRIFT = 1 << 3,
+  PSKC_CACHED_CHALL_ENCODING = 1 << 4,
+  PSKC_CACHED_CHALL_MIN = 1 << 5,
+  PSKC_CACHED_CHALL_MAX = 1 << 6,
+  PSKC_CACHED_CHALL_CHECKDIGITS = 1 << 7,
+  PSKC_CACHED_RESP_ENCODING = 1 << 8,
+  PSKC_CACHED_RESP_LENGTH = 1 << 9,
+  PSKC_CACHED_RESP_CHECKDIGITS = 1 << 10,
+  PSKC_CACHED_PINUSAGEMODE = 1 << 11,
+  PSKC_CACHED_PINMAXFAILEDATTEMPTS = 1 << 12,
+  PSKC_CACHED_PINMINLENGTH = 1 << 13,
+  PSKC_CACHED_PINMAXLENGTH = 1 << 14,
+  PSKC_CACHED_PINENCODING = 1 << 15,
+  PSKC_CACHED_NUMBEROFTRANSACTIONS = 1 << 16,
+  PSKC_CACHED_DEVICE_STARTDATE = 1 << 17,
+  PSKC_CACHED_DEVICE_EXPIRYDATE = 1 << 18,
+  PSKC_CACHED_POLICY_STARTDATE = 1 << 19,
+  PSKC_CACHED_POLICY_EXPIRYDATE = 1 << 20,
+  /* Allocating ext failed in a setter, see pskc_build_xml. */
+  PSKC_CACHED_MALLOC_ERROR = 1 << 21,
+  /* The secret is not valid base64, see pskc_get_key_data_secret. */
+  PSKC_CACHED_SECRET_INVALID = 1 << 22
+};
+
+struct pskc_key
+{
+  /* Owner of the memory below, set when the key is created. */
+  struct pskc_arena *arena;
+  /* Container whose indexes to invalidate, NULL for reader keys. */
+  pskc_t *container;
+  struct pskc_key_ext *ext;
+  unsigned cached;
+
+  /* Allocated from arena on first use, from key_secret_str. */
+  char *key_b64secret;
+  char *key_secret;
+  size_t key_secret_len;
+
+  /* The rest are pointers into libxml structures. */
+
+  /* DeviceInfo */
+  const char *device_manufacturer;
+  const char *device_serialno;
+  const char *device_model;
+  const char *device_userid;
+
+  /* Key */
+  const char *key_id;
+  const char *key_algorithm;
+  const char *key_userid;
+  const char *key_issuer;
+  const char *key_secret_str;
+  const char *key_counter_str;
+  uint64_t key_counter;
+  const char *key_time_str;
+  uint32_t key_time;
+  const char *key_timeinterval_str;
+  uint32_t key_timeinterval;
+  const char *key_timedrift_str;
+  uint32_t key_timedrift;
+};
+
+extern struct pskc_key_ext *_pskc_key_ext (struct pskc_key *key);
+extern int64_t _pskc_tm2time (const struct tm *tm);
+
+#include <libxml/tree.h>
+extern void _pskc_parse_keypackage (xmlNode * x, struct pskc_key *kp,
+				    int *rc);
 #endif
 
 #ifdef INTERNAL_NEED_PSKC_STRUCT
+#include <limits.h>		/* CHAR_BIT */
 #include <libxml/parser.h>
+
+enum
+{
+  PSKC_INDEX_KEY_ID,
+  PSKC_INDEX_SERIALNO,
+  PSKC_INDEX_USERID,
+  PSKC_INDEX_COUNT
+};
+
 struct pskc
 {
   /* raw XML */
@@ -111,8 +194,29 @@ struct pskc
   const char *version;
   const char *id;
   size_t nkeypackages;
-  struct pskc_key *keypackages;
+  /* Block k holds PSKC_KEYBLOCK_FIRST << k key packages, so key
+     packages never move and growing is amortized constant time. */
+  struct pskc_key *keyblocks[sizeof (size_t) * CHAR_BIT];
+
+  /* Secrets and other data allocated for the key packages. */
+  struct pskc_arena arena;
+
+  /* Threads to parse key packages with, see pskc_set_parse_threads. */
+  unsigned parse_threads;
+
+  /* Hash indexes of the pskc_find_by_* functions, see index.c. */
+  struct pskc_index
+  {
+    size_t *slots;
+    size_t size;
+  } index[PSKC_INDEX_COUNT];
 };
+
+#define PSKC_KEYBLOCK_FIRST 8
+
+extern struct pskc_key *_pskc_keypackage (pskc_t * container, size_t i);
+extern struct pskc_key *_pskc_new_keypackage (pskc_t * container);
+extern void _pskc_index_invalidate (pskc_t * container, int which);
 #endif
 
 #if __GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 7)
@@ -124,3 +228,18 @@ struct pskc
 extern void
 _pskc_debug (const char *format, ...)
 _GL_ATTRIBUTE_FORMAT ((printf, 1, 2));
+
+/* USDT probes for tracing with e.g. bpftrace or perf, enabled with
+   --enable-sdt.  Otherwise they expand to nothing. */
+#ifdef ENABLE_SDT
+#include <sys/sdt.h>
+#define PSKC_PROBE(name) DTRACE_PROBE (libpskc, name)
+#define PSKC_PROBE1(name, a) DTRACE_PROBE1 (libpskc, name, a)
+#define PSKC_PROBE2(name, a, b) DTRACE_PROBE2 (libpskc, name, a, b)
+#define PSKC_PROBE3(name, a, b, c) DTRACE_PROBE3 (libpskc, name, a, b, c)
+#else
+#define PSKC_PROBE(name) do { } while (0)
+#define PSKC_PROBE1(name, a) do { } while (0)
+#define PSKC_PROBE2(name, a, b) do { } while (0)
+#define PSKC_PROBE3(name, a, b, c) do { } while (0)
+#endif
@@ -27,9 +27,50 @@
 #define INTERNAL_NEED_PSKC_KEY_STRUCT
 #include "internal.h"
 
+#include <errno.h>
+#include <fcntl.h>		/* open */
+#include <limits.h>		/* INT_MAX */
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>		/* fstat */
+#include <unistd.h>		/* read */
+#if defined HAVE_SYS_MMAN_H && defined HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "base64.h"
 
+/* Parse the xs:dateTime @str into *@t, as seconds since the epoch. */
+static void
+parse_date (const char *str, int64_t * t, int *rc)
+{
+  struct tm tm;
+  const char *p;
+
+  memset (&tm, 0, sizeof (tm));
+  p = strptime (str, "%Y-%m-%dT%H:%M:%SZ", &tm);
+  if (p == NULL || *p != '\0')
+    {
+      _pskc_debug ("cannot convert time string '%s'", str);
+      *rc = PSKC_PARSE_ERROR;
+    }
+  *t = _pskc_tm2time (&tm);
+}
+
+/* Get the rarely used fields of @kp for the parser. */
+static struct pskc_key_ext *
+parse_ext (struct pskc_key *kp, int *rc)
+{
+  struct pskc_key_ext *ext = _pskc_key_ext (kp);
+
+  if (ext == NULL)
+    *rc = PSKC_MALLOC_ERROR;
+
+  return ext;
+}
+
 static void
 parse_deviceinfo (xmlNode * x, struct pskc_key *kp, int *rc)
 {
@@ -40,6 +81,7 @@ parse_deviceinfo (xmlNode * x, struct pskc_key *kp, int *rc)
       const char *name = (const char *) cur_node->name;
       const char *content = (const char *)
 	(cur_node->children ? cur_node->children->content : NULL);
+      struct pskc_key_ext *ext;
 
       if (cur_node->type != XML_ELEMENT_NODE)
 	continue;
@@ -56,35 +98,29 @@ parse_deviceinfo (xmlNode * x, struct pskc_key *kp, int *rc)
       else if (strcmp ("Model", name) == 0)
 	kp->device_model = content;
       else if (strcmp ("IssueNo", name) == 0)
-	kp->device_issueno = content;
+	{
+	  if ((ext = parse_ext (kp, rc)))
+	    ext->device_issueno = content;
+	}
       else if (strcmp ("DeviceBinding", name) == 0)
-	kp->device_devicebinding = content;
+	{
+	  if ((ext = parse_ext (kp, rc)))
+	    ext->device_devicebinding = content;
+	}
       else if (strcmp ("StartDate", name) == 0)
 	{
-	  const char *p;
-	  kp->device_startdate_str = content;
-	  memset (&kp->device_startdate, 0, sizeof (struct tm));
-	  p = strptime (kp->device_startdate_str,
-			"%Y-%m-%dT%H:%M:%SZ", &kp->device_startdate);
-	  if (p == NULL || *p != '\0')
+	  if ((ext = parse_ext (kp, rc)))
 	    {
-	      _pskc_debug ("cannot convert time string '%s'",
-			   kp->device_startdate_str);
-	      *rc = PSKC_PARSE_ERROR;
+	      ext->device_startdate_str = content;
+	      parse_date (content, &ext->device_startdate, rc);
 	    }
 	}
       else if (strcmp ("ExpiryDate", name) == 0)
 	{
-	  const char *p;
-	  kp->device_expirydate_str = content;
-	  memset (&kp->device_expirydate, 0, sizeof (struct tm));
-	  p = strptime (kp->device_expirydate_str,
-			"%Y-%m-%dT%H:%M:%SZ", &kp->device_expirydate);
-	  if (p == NULL || *p != '\0')
+	  if ((ext = parse_ext (kp, rc)))
 	    {
-	      _pskc_debug ("cannot convert time string '%s'",
-			   kp->device_expirydate_str);
-	      *rc = PSKC_PARSE_ERROR;
+	      ext->device_expirydate_str = content;
+	      parse_date (content, &ext->device_expirydate, rc);
 	    }
 	}
       else if (strcmp ("UserId", name) == 0)
@@ -112,7 +148,12 @@ parse_cryptomoduleinfo (xmlNode * x, struct pskc_key *kp, int *rc)
 	continue;
 
       if (strcmp ("Id", name) == 0)
-	kp->cryptomodule_id = content;
+	{
+	  struct pskc_key_ext *ext = parse_ext (kp, rc);
+
+	  if (ext)
+	    ext->cryptomodule_id = content;
+	}
       else
 	{
 	  _pskc_debug ("unknown <%s> element <%s>", x->parent->name, name);
@@ -147,25 +188,39 @@ parse_intlongstrdatatype (xmlNode * x, const char **var, int *rc)
     }
 }
 
-static char *
-remove_whitespace (const char *str, size_t * outlen)
+/* Check that @str, with whitespace removed, is valid base64.  The
+   secret is only decoded when it is asked for, see
+   pskc_get_key_data_secret. */
+static int
+valid_base64 (const char *str)
 {
-  size_t len = strlen (str);
-  char *out = malloc (len + 1);
-  size_t i, j;
-
-  if (out == NULL)
-    return NULL;
+  size_t pos = 0;
+  int pad = 0;
 
-  for (i = 0, j = 0; i < len; i++)
-    if (isbase64 (str[i]) || str[i] == '=')
-      out[j++] = str[i];
-
-  out[j] = '\0';
+  for (; *str; str++)
+    {
+      if (*str == '=')
+	{
+	  if (pos < 2)
+	    return 0;
+	  pad = 1;
+	}
+      else if (isbase64 (*str))
+	{
+	  if (pad)
+	    return 0;
+	}
+      else
+	continue;
 
-  *outlen = j;
+      if (++pos == 4)
+	{
+	  pos = 0;
+	  pad = 0;
+	}
+    }
 
-  return out;
+  return pos == 0;
 }
 
 static void
@@ -184,64 +239,24 @@ parse_data (xmlNode * x, struct pskc_key *kp, int *rc)
 	{
 	  parse_intlongstrdatatype (cur_node->children,
 				    &kp->key_secret_str, rc);
-	  if (kp->key_secret_str)
+	  if (kp->key_secret_str && !valid_base64 (kp->key_secret_str))
 	    {
-	      bool ok;
-	      size_t l;
-
-	      kp->key_b64secret = remove_whitespace (kp->key_secret_str, &l);
-	      if (kp->key_b64secret == NULL)
-		{
-		  _pskc_debug ("base64 whitespace malloc failed");
-		  *rc = PSKC_MALLOC_ERROR;
-		}
-	      else
-		{
-		  ok = base64_decode_alloc (kp->key_b64secret, l,
-					    &kp->key_secret,
-					    &kp->key_secret_len);
-		  if (!ok)
-		    {
-		      _pskc_debug ("base64 decoding failed");
-		      *rc = PSKC_BASE64_ERROR;
-		    }
-		  if (kp->key_secret == NULL)
-		    {
-		      _pskc_debug ("base64 malloc failed");
-		      *rc = PSKC_MALLOC_ERROR;
-		    }
-		}
+	      _pskc_debug ("base64 decoding failed");
+	      *rc = PSKC_BASE64_ERROR;
 	    }
 	}
       else if (strcmp ("Counter", name) == 0)
-	{
-	  parse_intlongstrdatatype (cur_node->children,
-				    &kp->key_counter_str, rc);
-	  if (kp->key_counter_str)
-	    kp->key_counter = strtoull (kp->key_counter_str, NULL, 10);
-	}
+	parse_intlongstrdatatype (cur_node->children,
+				  &kp->key_counter_str, rc);
       else if (strcmp ("Time", name) == 0)
-	{
-	  parse_intlongstrdatatype (cur_node->children,
-				    &kp->key_time_str, rc);
-	  if (kp->key_time_str)
-	    kp->key_time = strtoul (kp->key_time_str, NULL, 10);
-	}
+	parse_intlongstrdatatype (cur_node->children,
+				  &kp->key_time_str, rc);
       else if (strcmp ("TimeInterval", name) == 0)
-	{
-	  parse_intlongstrdatatype (cur_node->children,
-				    &kp->key_timeinterval_str, rc);
-	  if (kp->key_timeinterval_str)
-	    kp->key_timeinterval = strtoul (kp->key_timeinterval_str,
-					    NULL, 10);
-	}
+	parse_intlongstrdatatype (cur_node->children,
+				  &kp->key_timeinterval_str, rc);
       else if (strcmp ("TimeDrift", name) == 0)
-	{
-	  parse_intlongstrdatatype (cur_node->children,
-				    &kp->key_timedrift_str, rc);
-	  if (kp->key_timedrift_str)
-	    kp->key_timedrift = strtoul (kp->key_timedrift_str, NULL, 10);
-	}
+	parse_intlongstrdatatype (cur_node->children,
+				  &kp->key_timedrift_str, rc);
       else
 	{
 	  _pskc_debug ("unknown <%s> element <%s>", x->parent->name, name);
@@ -253,8 +268,12 @@ parse_data (xmlNode * x, struct pskc_key *kp, int *rc)
 static void
 parse_algorithmparameters (xmlNode * x, struct pskc_key *kp, int *rc)
 {
+  struct pskc_key_ext *ext = parse_ext (kp, rc);
   xmlNode *cur_node = NULL;
 
+  if (ext == NULL)
+    return;
+
   for (cur_node = x; cur_node; cur_node = cur_node->next)
     {
       const char *name = (const char *) cur_node->name;
@@ -265,7 +284,7 @@ parse_algorithmparameters (xmlNode * x, struct pskc_key *kp, int *rc)
 	continue;
 
       if (strcmp ("Suite", name) == 0)
-	kp->key_algparm_suite = content;
+	ext->key_algparm_suite = content;
       else if (strcmp ("ChallengeFormat", name) == 0)
 	{
 	  xmlAttr *cur_attr = NULL;
@@ -278,36 +297,13 @@ parse_algorithmparameters (xmlNode * x, struct pskc_key *kp, int *rc)
 		(const char *) cur_attr->children->content;
 
 	      if (strcmp ("Encoding", attr_name) == 0)
-		{
-		  kp->key_algparm_chall_encoding_str = attr_content;
-		  kp->key_algparm_chall_encoding =
-		    pskc_str2valueformat (kp->key_algparm_chall_encoding_str);
-		}
+		ext->key_algparm_chall_encoding_str = attr_content;
 	      else if (strcmp ("Min", attr_name) == 0)
-		{
-		  kp->key_algparm_chall_min_str = attr_content;
-		  kp->key_algparm_chall_min =
-		    strtoul (kp->key_algparm_chall_min_str, NULL, 10);
-		}
+		ext->key_algparm_chall_min_str = attr_content;
 	      else if (strcmp ("Max", attr_name) == 0)
-		{
-		  kp->key_algparm_chall_max_str = attr_content;
-		  kp->key_algparm_chall_max =
-		    strtoul (kp->key_algparm_chall_max_str, NULL, 10);
-		}
+		ext->key_algparm_chall_max_str = attr_content;
 	      else if (strcmp ("CheckDigits", attr_name) == 0)
-		{
-		  kp->key_algparm_chall_checkdigits_str = attr_content;
-		  if (strcmp ("1", kp->key_algparm_chall_checkdigits_str) ==
-		      0)
-		    kp->key_algparm_chall_checkdigits = 1;
-		  else if (strcmp ("true",
-				   kp->key_algparm_chall_checkdigits_str) ==
-			   0)
-		    kp->key_algparm_chall_checkdigits = 1;
-		  else
-		    kp->key_algparm_chall_checkdigits = 0;
-		}
+		ext->key_algparm_chall_checkdigits_str = attr_content;
 	      else
 		{
 		  _pskc_debug ("unknown <%s> attribute <%s>",
@@ -328,28 +324,11 @@ parse_algorithmparameters (xmlNode * x, struct pskc_key *kp, int *rc)
 		(const char *) cur_attr->children->content;
 
 	      if (strcmp ("Encoding", attr_name) == 0)
-		{
-		  kp->key_algparm_resp_encoding_str = attr_content;
-		  kp->key_algparm_resp_encoding =
-		    pskc_str2valueformat (kp->key_algparm_resp_encoding_str);
-		}
+		ext->key_algparm_resp_encoding_str = attr_content;
 	      else if (strcmp ("Length", attr_name) == 0)
-		{
-		  kp->key_algparm_resp_length_str = attr_content;
-		  kp->key_algparm_resp_length =
-		    strtoul (kp->key_algparm_resp_length_str, NULL, 10);
-		}
+		ext->key_algparm_resp_length_str = attr_content;
 	      else if (strcmp ("CheckDigits", attr_name) == 0)
-		{
-		  kp->key_algparm_resp_checkdigits_str = attr_content;
-		  if (strcmp ("1", kp->key_algparm_resp_checkdigits_str) == 0)
-		    kp->key_algparm_resp_checkdigits = 1;
-		  else if (strcmp ("true",
-				   kp->key_algparm_resp_checkdigits_str) == 0)
-		    kp->key_algparm_resp_checkdigits = 1;
-		  else
-		    kp->key_algparm_resp_checkdigits = 0;
-		}
+		ext->key_algparm_resp_checkdigits_str = attr_content;
 	      else
 		{
 		  _pskc_debug ("unknown <%s> attribute <%s>",
@@ -369,8 +348,12 @@ parse_algorithmparameters (xmlNode * x, struct pskc_key *kp, int *rc)
 static void
 parse_policy (xmlNode * x, struct pskc_key *kp, int *rc)
 {
+  struct pskc_key_ext *ext = parse_ext (kp, rc);
   xmlNode *cur_node = NULL;
 
+  if (ext == NULL)
+    return;
+
   for (cur_node = x; cur_node; cur_node = cur_node->next)
     {
       const char *name = (const char *) cur_node->name;
@@ -382,31 +365,13 @@ parse_policy (xmlNode * x, struct pskc_key *kp, int *rc)
 
       if (strcmp ("StartDate", name) == 0)
 	{
-	  const char *p;
-	  kp->key_policy_startdate_str = content;
-	  memset (&kp->key_policy_startdate, 0, sizeof (struct tm));
-	  p = strptime (kp->key_policy_startdate_str,
-			"%Y-%m-%dT%H:%M:%SZ", &kp->key_policy_startdate);
-	  if (p == NULL || *p != '\0')
-	    {
-	      _pskc_debug ("cannot convert time string '%s'",
-			   kp->key_policy_startdate_str);
-	      *rc = PSKC_PARSE_ERROR;
-	    }
+	  ext->key_policy_startdate_str = content;
+	  parse_date (content, &ext->key_policy_startdate, rc);
 	}
       else if (strcmp ("ExpiryDate", name) == 0)
 	{
-	  const char *p;
-	  kp->key_policy_expirydate_str = content;
-	  memset (&kp->key_policy_expirydate, 0, sizeof (struct tm));
-	  p = strptime (kp->key_policy_expirydate_str,
-			"%Y-%m-%dT%H:%M:%SZ", &kp->key_policy_expirydate);
-	  if (p == NULL || *p != '\0')
-	    {
-	      _pskc_debug ("cannot convert time string '%s'",
-			   kp->key_policy_startdate_str);
-	      *rc = PSKC_PARSE_ERROR;
-	    }
+	  ext->key_policy_expirydate_str = content;
+	  parse_date (content, &ext->key_policy_expirydate, rc);
 	}
       else if (strcmp ("PINPolicy", name) == 0)
 	{
@@ -420,38 +385,17 @@ parse_policy (xmlNode * x, struct pskc_key *kp, int *rc)
 		(const char *) cur_attr->children->content;
 
 	      if (strcmp ("PINKeyId", attr_name) == 0)
-		kp->key_policy_pinkeyid = attr_content;
+		ext->key_policy_pinkeyid = attr_content;
 	      else if (strcmp ("PINUsageMode", attr_name) == 0)
-		{
-		  kp->key_policy_pinusagemode_str = attr_content;
-		  kp->key_policy_pinusagemode =
-		    pskc_str2pinusagemode (kp->key_policy_pinusagemode_str);
-		}
+		ext->key_policy_pinusagemode_str = attr_content;
 	      else if (strcmp ("MaxFailedAttempts", attr_name) == 0)
-		{
-		  kp->key_policy_pinmaxfailedattempts_str = attr_content;
-		  kp->key_policy_pinmaxfailedattempts =
-		    strtoull (kp->key_policy_pinmaxfailedattempts_str,
-			      NULL, 10);
-		}
+		ext->key_policy_pinmaxfailedattempts_str = attr_content;
 	      else if (strcmp ("MinLength", attr_name) == 0)
-		{
-		  kp->key_policy_pinminlength_str = attr_content;
-		  kp->key_policy_pinminlength =
-		    strtoull (kp->key_policy_pinminlength_str, NULL, 10);
-		}
+		ext->key_policy_pinminlength_str = attr_content;
 	      else if (strcmp ("MaxLength", attr_name) == 0)
-		{
-		  kp->key_policy_pinmaxlength_str = attr_content;
-		  kp->key_policy_pinmaxlength =
-		    strtoull (kp->key_policy_pinmaxlength_str, NULL, 10);
-		}
+		ext->key_policy_pinmaxlength_str = attr_content;
 	      else if (strcmp ("PINEncoding", attr_name) == 0)
-		{
-		  kp->key_policy_pinencoding_str = attr_content;
-		  kp->key_policy_pinencoding =
-		    pskc_str2valueformat (kp->key_policy_pinencoding_str);
-		}
+		ext->key_policy_pinencoding_str = attr_content;
 	      else
 		{
 		  _pskc_debug ("unknown <%s> attribute <%s>", name,
@@ -462,17 +406,12 @@ parse_policy (xmlNode * x, struct pskc_key *kp, int *rc)
 	}
       else if (strcmp ("KeyUsage", name) == 0)
 	{
-	  kp->key_policy_keyusage_str = content;
-	  kp->key_policy_keyusages |=
-	    pskc_str2keyusage (kp->key_policy_keyusage_str);
+	  ext->key_policy_keyusage_str = content;
+	  ext->key_policy_keyusages |=
+	    pskc_str2keyusage (ext->key_policy_keyusage_str);
 	}
       else if (strcmp ("NumberOfTransactions", name) == 0)
-	{
-	  kp->key_policy_numberoftransactions_str = content;
-	  if (kp->key_policy_numberoftransactions_str)
-	    kp->key_policy_numberoftransactions =
-	      strtoull (kp->key_policy_numberoftransactions_str, NULL, 10);
-	}
+	ext->key_policy_numberoftransactions_str = content;
       else
 	{
 	  _pskc_debug ("unknown <%s> element <%s>", x->parent->name, name);
@@ -491,6 +430,7 @@ parse_key (xmlNode * x, struct pskc_key *kp, int *rc)
       const char *name = (const char *) cur_node->name;
       const char *content = (const char *)
 	(cur_node->children ? cur_node->children->content : NULL);
+      struct pskc_key_ext *ext;
 
       if (cur_node->type != XML_ELEMENT_NODE)
 	continue;
@@ -500,11 +440,20 @@ parse_key (xmlNode * x, struct pskc_key *kp, int *rc)
       else if (strcmp ("AlgorithmParameters", name) == 0)
 	parse_algorithmparameters (cur_node->children, kp, rc);
       else if (strcmp ("KeyProfileId", name) == 0)
-	kp->key_profileid = content;
+	{
+	  if ((ext = parse_ext (kp, rc)))
+	    ext->key_profileid = content;
+	}
       else if (strcmp ("KeyReference", name) == 0)
-	kp->key_reference = content;
+	{
+	  if ((ext = parse_ext (kp, rc)))
+	    ext->key_reference = content;
+	}
       else if (strcmp ("FriendlyName", name) == 0)
-	kp->key_friendlyname = content;
+	{
+	  if ((ext = parse_ext (kp, rc)))
+	    ext->key_friendlyname = content;
+	}
       else if (strcmp ("Data", name) == 0)
 	parse_data (cur_node->children, kp, rc);
       else if (strcmp ("UserId", name) == 0)
@@ -519,8 +468,10 @@ parse_key (xmlNode * x, struct pskc_key *kp, int *rc)
     }
 }
 
-static void
-parse_keypackage (xmlNode * x, struct pskc_key *kp, int *rc)
+/* Parse the children @x of a KeyPackage element into @kp, also used by
+   the streaming reader. */
+void
+_pskc_parse_keypackage (xmlNode * x, struct pskc_key *kp, int *rc)
 {
   xmlNode *cur_node = NULL;
 
@@ -568,10 +519,161 @@ parse_keypackage (xmlNode * x, struct pskc_key *kp, int *rc)
     }
 }
 
+/* Key packages a parse worker takes at a time. */
+#define PARSE_BLOCK 64
+
+/* A KeyPackage element and the result of parsing it. */
+struct parse_job
+{
+  xmlNode *node;
+  int rc;
+};
+
+/* State shared by the threads parsing the key packages of one
+   container, which start at key package number @first. */
+struct parse_jobs
+{
+  pskc_t *pd;
+  struct parse_job *jobs;
+  size_t njobs;
+  size_t first;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+#endif
+  /* Next job to hand out. */
+  size_t next;
+};
+
+static void
+parse_lock (struct parse_jobs *p)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock (&p->lock);
+#else
+  (void) p;
+#endif
+}
+
+static void
+parse_unlock (struct parse_jobs *p)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&p->lock);
+#else
+  (void) p;
+#endif
+}
+
+/* Take blocks of jobs until all are done.  The container arena is
+   not shared between threads, so each worker allocates from its own
+   and hands it over to the container at the end. */
+static void *
+parse_worker (void *arg)
+{
+  struct parse_jobs *p = arg;
+  struct pskc_arena arena = { NULL };
+
+  for (;;)
+    {
+      size_t first, last, i;
+
+      parse_lock (p);
+      first = p->next;
+      last = first + PARSE_BLOCK;
+      if (last > p->njobs)
+	last = p->njobs;
+      p->next = last;
+      parse_unlock (p);
+
+      if (first == last)
+	break;
+
+      for (i = first; i < last; i++)
+	{
+	  struct pskc_key *kp = _pskc_keypackage (p->pd, p->first + i);
+
+	  p->jobs[i].rc = PSKC_OK;
+	  kp->arena = &arena;
+	  _pskc_parse_keypackage (p->jobs[i].node->children, kp,
+				  &p->jobs[i].rc);
+	  kp->arena = &p->pd->arena;
+	}
+    }
+
+  parse_lock (p);
+  _pskc_arena_merge (&p->pd->arena, &arena);
+  parse_unlock (p);
+
+  return NULL;
+}
+
+/* Parse the key packages in @jobs, which have been added to @pd
+   starting at number @first, with up to @threads threads. */
+static void
+parse_jobs (pskc_t * pd, struct parse_job *jobs, size_t njobs,
+	    size_t first, unsigned threads)
+{
+  struct parse_jobs p;
+
+  p.pd = pd;
+  p.jobs = jobs;
+  p.njobs = njobs;
+  p.first = first;
+  p.next = 0;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init (&p.lock, NULL);
+  {
+    pthread_t *tid = NULL;
+    size_t started = 0;
+    size_t i;
+
+    if (threads > njobs / PARSE_BLOCK)
+      threads = njobs / PARSE_BLOCK;
+    if (threads > 1)
+      tid = malloc ((threads - 1) * sizeof (*tid));
+    if (tid)
+      for (; started < threads - 1; started++)
+	if (pthread_create (&tid[started], NULL, parse_worker, &p) != 0)
+	  break;
+    parse_worker (&p);
+    for (i = 0; i < started; i++)
+      pthread_join (tid[i], NULL);
+    free (tid);
+  }
+  pthread_mutex_destroy (&p.lock);
+#else
+  (void) threads;
+  parse_worker (&p);
+#endif
+}
+
+/* Add the KeyPackage elements among @x to @pd and parse them.  With
+   more than one thread, the elements are collected and the key
+   packages added first, and then parsed in parallel.  *@rc is set as
+   if they had been parsed one after the other: to the error of the
+   last failing element. */
 static void
 parse_keypackages (pskc_t * pd, xmlNode * x, int *rc)
 {
   xmlNode *cur_node = NULL;
+  struct parse_job *jobs = NULL;
+  size_t njobs = 0;
+  size_t first = pd->nkeypackages;
+  /* Number of jobs when *rc was last set here. */
+  size_t rc_pos = 0;
+  size_t i;
+
+  if (pd->parse_threads > 1)
+    {
+      for (cur_node = x; cur_node; cur_node = cur_node->next)
+	if (cur_node->type == XML_ELEMENT_NODE
+	    && strcmp ("KeyPackage", (const char *) cur_node->name) == 0)
+	  njobs++;
+      if (njobs >= 2 * PARSE_BLOCK)
+	jobs = malloc (njobs * sizeof (*jobs));
+      njobs = 0;
+    }
 
   for (cur_node = x; cur_node; cur_node = cur_node->next)
     {
@@ -582,24 +684,19 @@ parse_keypackages (pskc_t * pd, xmlNode * x, int *rc)
 
       if (strcmp ("KeyPackage", name) == 0)
 	{
-	  struct pskc_key *tmp;
+	  struct pskc_key *kp = _pskc_new_keypackage (pd);
 
-	  tmp = realloc (pd->keypackages,
-			 sizeof (*pd->keypackages) * (pd->nkeypackages + 1));
-	  if (tmp == NULL)
+	  if (kp == NULL)
 	    {
 	      *rc = PSKC_MALLOC_ERROR;
-	      return;
+	      rc_pos = njobs;
+	      break;
 	    }
 
-	  pd->keypackages = tmp;
-	  pd->nkeypackages++;
-
-	  memset (&pd->keypackages[pd->nkeypackages - 1], 0,
-		  sizeof (*pd->keypackages));
-
-	  parse_keypackage (cur_node->children,
-			    &pd->keypackages[pd->nkeypackages - 1], rc);
+	  if (jobs)
+	    jobs[njobs++].node = cur_node;
+	  else
+	    _pskc_parse_keypackage (cur_node->children, kp, rc);
 	}
       else if (strcmp ("Signature", name) == 0)
 	pd->signed_p = 1;
@@ -607,8 +704,20 @@ parse_keypackages (pskc_t * pd, xmlNode * x, int *rc)
 	{
 	  _pskc_debug ("unknown <%s> element <%s>", x->parent->name, name);
 	  *rc = PSKC_PARSE_ERROR;
+	  rc_pos = njobs;
 	}
     }
+
+  if (jobs == NULL)
+    return;
+
+  parse_jobs (pd, jobs, njobs, first, pd->parse_threads);
+
+  for (i = *rc == PSKC_OK ? 0 : rc_pos; i < njobs; i++)
+    if (jobs[i].rc != PSKC_OK)
+      *rc = jobs[i].rc;
+
+  free (jobs);
 }
 
 static void
@@ -671,22 +780,66 @@ pskc_init (pskc_t ** container)
 void
 pskc_done (pskc_t * container)
 {
-  size_t i;
+  size_t k;
 
   if (container == NULL)
     return;
 
   xmlFreeDoc (container->xmldoc);
 
-  for (i = 0; i < container->nkeypackages; i++)
+  for (k = 0; container->keyblocks[k]; k++)
+    free (container->keyblocks[k]);
+  _pskc_arena_free (&container->arena);
+  _pskc_index_invalidate (container, -1);
+
+  free (container);
+}
+
+/**
+ * pskc_set_parse_threads:
+ * @container: a #pskc_t handle, from pskc_init().
+ * @threads: number of threads to parse key packages with, or 0 for one
+ *
+ * Make pskc_parse_from_memory(), pskc_parse_from_fd() and
+ * pskc_parse_from_file() split the conversion of the key packages of
+ * large containers over @threads threads, including the calling one.
+ * The XML data itself is still parsed by one thread.  The key
+ * packages and return value are the same as when parsing with one
+ * thread, but the log function set with pskc_global_log() may be
+ * called from the other threads and the order of its messages is not
+ * defined.
+ *
+ * Since: 2.6.0
+ **/
+void
+pskc_set_parse_threads (pskc_t * container, unsigned threads)
+{
+  container->parse_threads = threads;
+}
+
+/* Take over the XML document @xmldoc, or NULL on XML errors, and
+   parse it into @container. */
+static int
+parse_xmldoc (pskc_t * container, xmlDocPtr xmldoc)
+{
+  xmlNode *root;
+  int rc = PSKC_OK;
+
+  if (xmldoc == NULL)
     {
-      pskc_key_t *kp = &container->keypackages[i];
-      free (kp->key_secret);
-      free (kp->key_b64secret);
+      PSKC_PROBE1 (parse_return, PSKC_XML_ERROR);
+      return PSKC_XML_ERROR;
     }
 
-  free (container->keypackages);
-  free (container);
+  container->xmldoc = xmldoc;
+  PSKC_PROBE (parse_xml_done);
+
+  root = xmlDocGetRootElement (xmldoc);
+  parse_keycontainer (container, root, &rc);
+
+  PSKC_PROBE1 (parse_return, rc);
+
+  return rc;
 }
 
 /**
@@ -709,18 +862,109 @@ pskc_done (pskc_t * container)
 int
 pskc_parse_from_memory (pskc_t * container, size_t len, const char *buffer)
 {
-  xmlDocPtr xmldoc;
-  xmlNode *root;
-  int rc = PSKC_OK;
+  PSKC_PROBE1 (parse_entry, len);
 
-  xmldoc = xmlReadMemory (buffer, len, NULL, NULL, XML_PARSE_NONET);
-  if (xmldoc == NULL)
-    return PSKC_XML_ERROR;
+  return parse_xmldoc (container, xmlReadMemory (buffer, len, NULL, NULL,
+						 XML_PARSE_NONET));
+}
 
-  container->xmldoc = xmldoc;
+static int
+read_fd (void *context, char *buffer, int len)
+{
+  int fd = *(int *) context;
+  ssize_t n;
 
-  root = xmlDocGetRootElement (xmldoc);
-  parse_keycontainer (container, root, &rc);
+  do
+    n = read (fd, buffer, len);
+  while (n < 0 && errno == EINTR);
+
+  return n;
+}
+
+/**
+ * pskc_parse_from_fd:
+ * @container: a #pskc_t handle, from pskc_init().
+ * @fd: file descriptor to read XML data from.
+ *
+ * This function will parse the XML data read from @fd into
+ * @container, like pskc_parse_from_memory().  Regular files are
+ * mapped into memory, other files such as pipes are read
+ * incrementally by the XML parser, so the data is never copied into
+ * a buffer of its own.  Either way @fd is read until end of file and
+ * its offset is left there, but it is not closed.
+ *
+ * Returns: On success, %PSKC_OK (zero) is returned, on memory
+ *   allocation errors %PSKC_MALLOC_ERROR is returned, on read or XML
+ *   library errors %PSKC_XML_ERROR is returned, on PSKC parse errors
+ *   %PSKC_PARSE_ERROR is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+pskc_parse_from_fd (pskc_t * container, int fd)
+{
+#if defined HAVE_SYS_MMAN_H && defined HAVE_MMAP
+  struct stat st;
+
+  /* xmlReadMemory takes an int length, larger files are streamed. */
+  if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode)
+      && st.st_size > 0 && st.st_size <= INT_MAX
+      && lseek (fd, 0, SEEK_CUR) == 0)
+    {
+      void *p = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (p != MAP_FAILED)
+	{
+	  xmlDocPtr xmldoc;
+
+	  PSKC_PROBE1 (parse_entry, st.st_size);
+	  xmldoc = xmlReadMemory (p, st.st_size, NULL, NULL, XML_PARSE_NONET);
+	  munmap (p, st.st_size);
+
+	  /* Leave the offset where read() would have. */
+	  lseek (fd, st.st_size, SEEK_SET);
+
+	  return parse_xmldoc (container, xmldoc);
+	}
+    }
+#endif
+
+  PSKC_PROBE1 (parse_entry, 0);
+
+  return parse_xmldoc (container, xmlReadIO (read_fd, NULL, &fd, NULL, NULL,
+					     XML_PARSE_NONET));
+}
+
+/**
+ * pskc_parse_from_file:
+ * @container: a #pskc_t handle, from pskc_init().
+ * @filename: name of file with XML data to parse.
+ *
+ * This function will parse the XML data in the file @filename into
+ * @container, see pskc_parse_from_fd().
+ *
+ * Returns: On success, %PSKC_OK (zero) is returned, on memory
+ *   allocation errors %PSKC_MALLOC_ERROR is returned, if the file
+ *   cannot be opened or read or on XML library errors
+ *   %PSKC_XML_ERROR is returned, on PSKC parse errors
+ *   %PSKC_PARSE_ERROR is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+pskc_parse_from_file (pskc_t * container, const char *filename)
+{
+  int fd = open (filename, O_RDONLY);
+  int rc;
+
+  if (fd < 0)
+    {
+      _pskc_debug ("cannot open %s", filename);
+      return PSKC_XML_ERROR;
+    }
+
+  rc = pskc_parse_from_fd (container, fd);
+  close (fd);
 
   return rc;
 }
@@ -0,0 +1,247 @@
+/*
+ * reader.c - Streaming parser of PSKC key packages.
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <pskc/pskc.h>
+
+#define INTERNAL_NEED_PSKC_KEY_STRUCT
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <libxml/xmlreader.h>
+
+struct pskc_reader
+{
+  xmlTextReaderPtr xmlreader;
+  /* Is the reader positioned on the expanded subtree of key? */
+  int expanded;
+  /* The current key package, pointing into the expanded subtree. */
+  struct pskc_key key;
+  /* Secrets of the current key package. */
+  struct pskc_arena arena;
+};
+
+static int
+reader_init (pskc_reader_t ** reader, xmlTextReaderPtr xmlreader)
+{
+  if (xmlreader == NULL)
+    return PSKC_XML_ERROR;
+
+  *reader = calloc (1, sizeof (**reader));
+  if (*reader == NULL)
+    {
+      xmlFreeTextReader (xmlreader);
+      return PSKC_MALLOC_ERROR;
+    }
+  (*reader)->xmlreader = xmlreader;
+
+  return PSKC_OK;
+}
+
+/**
+ * pskc_reader_open:
+ * @reader: pointer to a #pskc_reader_t handle to initialize.
+ * @filename: name of file with PSKC data to read.
+ *
+ * Create a streaming reader of the key packages in the PSKC data in
+ * @filename, see pskc_reader_next_keypackage().  The file is read
+ * incrementally as key packages are requested.  The memory allocated
+ * can be released by calling pskc_reader_done().
+ *
+ * Returns: On success, %PSKC_OK (zero) is returned, on memory
+ *   allocation errors %PSKC_MALLOC_ERROR is returned, and if the file
+ *   cannot be opened %PSKC_XML_ERROR is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+pskc_reader_open (pskc_reader_t ** reader, const char *filename)
+{
+  return reader_init (reader, xmlReaderForFile (filename, NULL,
+						XML_PARSE_NONET));
+}
+
+/**
+ * pskc_reader_open_memory:
+ * @reader: pointer to a #pskc_reader_t handle to initialize.
+ * @len: length of @buffer.
+ * @buffer: XML data to read.
+ *
+ * Create a streaming reader of the key packages in the PSKC data in
+ * @buffer of @len size, see pskc_reader_next_keypackage().  @buffer
+ * is not copied and must be kept until pskc_reader_done() is called.
+ *
+ * Returns: On success, %PSKC_OK (zero) is returned, on memory
+ *   allocation errors %PSKC_MALLOC_ERROR is returned, and on XML
+ *   library errors %PSKC_XML_ERROR is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+pskc_reader_open_memory (pskc_reader_t ** reader, size_t len,
+			 const char *buffer)
+{
+  return reader_init (reader, xmlReaderForMemory (buffer, len, NULL, NULL,
+						  XML_PARSE_NONET));
+}
+
+static void
+reader_clear_key (pskc_reader_t * reader)
+{
+  _pskc_arena_free (&reader->arena);
+  memset (&reader->key, 0, sizeof (reader->key));
+  reader->key.arena = &reader->arena;
+}
+
+/* Check the KeyContainer element the reader is positioned on. */
+static void
+reader_keycontainer (xmlTextReaderPtr r, int *rc)
+{
+  const char *name = (const char *) xmlTextReaderConstLocalName (r);
+
+  if (strcmp ("KeyContainer", name) != 0)
+    {
+      _pskc_debug ("unknown top-level element <%s>", name);
+      *rc = PSKC_PARSE_ERROR;
+    }
+
+  while (xmlTextReaderMoveToNextAttribute (r) == 1)
+    {
+      const char *attr_name = (const char *) xmlTextReaderConstLocalName (r);
+
+      if (xmlTextReaderIsNamespaceDecl (r) == 1
+	  || strcmp ("Version", attr_name) == 0
+	  || strcmp ("Id", attr_name) == 0)
+	continue;
+
+      _pskc_debug ("unknown <%s> attribute <%s>", name, attr_name);
+      *rc = PSKC_PARSE_ERROR;
+    }
+  xmlTextReaderMoveToElement (r);
+}
+
+/**
+ * pskc_reader_next_keypackage:
+ * @reader: a #pskc_reader_t handle, from pskc_reader_open().
+ * @key: output variable holding the next key package, or NULL.
+ *
+ * Read the next key package of the PSKC data into *@key, or set
+ * *@key to NULL when there are no more key packages.  The key
+ * package and all data it refers to belong to @reader, and are only
+ * valid until the next call to this function or pskc_reader_done().
+ * Only that key package is held in memory.
+ *
+ * Like pskc_parse_from_memory(), %PSKC_PARSE_ERROR means that some
+ * elements could not be parsed, but *@key holds the partially parsed
+ * key package and reading may continue.  Errors in elements after
+ * the last key package are returned together with a NULL *@key.
+ *
+ * Returns: On success, %PSKC_OK (zero) is returned, on memory
+ *   allocation errors %PSKC_MALLOC_ERROR is returned, on XML library
+ *   errors %PSKC_XML_ERROR is returned, on PSKC parse errors
+ *   %PSKC_PARSE_ERROR is returned.
+ *
+ * Since: 2.6.0
+ **/
+int
+pskc_reader_next_keypackage (pskc_reader_t * reader, pskc_key_t ** key)
+{
+  xmlTextReaderPtr r = reader->xmlreader;
+  int rc = PSKC_OK;
+  int ret;
+
+  *key = NULL;
+  reader_clear_key (reader);
+
+  /* Skip past, and so release, the previous key package. */
+  if (reader->expanded)
+    ret = xmlTextReaderNext (r);
+  else
+    ret = xmlTextReaderRead (r);
+  reader->expanded = 0;
+
+  while (ret == 1)
+    {
+      const char *name;
+      xmlNodePtr node;
+
+      if (xmlTextReaderNodeType (r) != XML_READER_TYPE_ELEMENT)
+	{
+	  ret = xmlTextReaderRead (r);
+	  continue;
+	}
+
+      if (xmlTextReaderDepth (r) == 0)
+	{
+	  reader_keycontainer (r, &rc);
+	  ret = xmlTextReaderRead (r);
+	  continue;
+	}
+
+      name = (const char *) xmlTextReaderConstLocalName (r);
+      if (strcmp ("KeyPackage", name) == 0)
+	{
+	  node = xmlTextReaderExpand (r);
+	  if (node == NULL)
+	    return PSKC_XML_ERROR;
+	  reader->expanded = 1;
+
+	  _pskc_parse_keypackage (node->children, &reader->key, &rc);
+	  *key = &reader->key;
+
+	  return rc;
+	}
+
+      if (strcmp ("Signature", name) != 0)
+	{
+	  _pskc_debug ("unknown <KeyContainer> element <%s>", name);
+	  rc = PSKC_PARSE_ERROR;
+	}
+      ret = xmlTextReaderNext (r);
+    }
+
+  if (ret < 0)
+    return PSKC_XML_ERROR;
+
+  return rc;
+}
+
+/**
+ * pskc_reader_done:
+ * @reader: a #pskc_reader_t handle, from pskc_reader_open().
+ *
+ * Release the resources associated with @reader, including the last
+ * key package returned by pskc_reader_next_keypackage().
+ *
+ * Since: 2.6.0
+ **/
+void
+pskc_reader_done (pskc_reader_t * reader)
+{
+  if (reader == NULL)
+    return;
+
+  reader_clear_key (reader);
+  xmlFreeTextReader (reader->xmlreader);
+  free (reader);
+}
@@ -50,6 +50,8 @@ pskc_sign_x509 (pskc_t * container,
   xmlNodePtr refNode = NULL;
   xmlSecDSigCtxPtr dsigCtx = NULL;
 
+  PSKC_PROBE (sign_entry);
+
   pskc_build_xml (container, NULL, NULL);
 
   /* create signature template for RSA-SHA1 enveloped signature */
@@ -129,6 +131,8 @@ pskc_sign_x509 (pskc_t * container,
       return PSKC_XMLSEC_ERROR;
     }
 
+  PSKC_PROBE (sign_keys_loaded);
+
   /* sign the template */
   if (xmlSecDSigCtxSign (dsigCtx, signNode) < 0)
     {
@@ -136,6 +140,8 @@ pskc_sign_x509 (pskc_t * container,
       return PSKC_XMLSEC_ERROR;
     }
 
+  PSKC_PROBE (sign_return);
+
   return PSKC_OK;
 }
 
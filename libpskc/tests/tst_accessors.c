@@ -245,6 +245,19 @@ const char *pskc_all =
   "        <Test/>"
   "      </Policy>" "    </Key>" "  </KeyPackage>" "</KeyContainerX>";
 
+const char *pskc_badsecret =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+  "<KeyContainer Version=\"1.0\""
+  "              xmlns=\"urn:ietf:params:xml:ns:keyprov:pskc\">"
+  "  <KeyPackage>"
+  "    <Key>"
+  "      <Data>"
+  "        <Secret><PlainValue>MTIzNA=</PlainValue></Secret>"
+  "      </Data>"
+  "    </Key>"
+  "  </KeyPackage>"
+  "</KeyContainer>";
+
 void
 my_log (const char *msg)
 {
@@ -256,6 +269,7 @@ main (void)
 {
   pskc_t *pskc;
   pskc_key_t *pskc_key;
+  const char *p;
   char *out;
   size_t len;
   int rc;
@@ -739,6 +753,44 @@ main (void)
 
   pskc_done (pskc);
 
+  /* Invalid secrets are reported when parsing, although the secret
+     is only decoded when it is asked for. */
+  rc = pskc_init (&pskc);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = pskc_parse_from_memory (pskc, strlen (pskc_badsecret),
+			       pskc_badsecret);
+  if (rc != PSKC_BASE64_ERROR)
+    {
+      printf ("pskc_parse_from_memory badsecret: %d\n", rc);
+      return 1;
+    }
+
+  pskc_key = pskc_get_keypackage (pskc, 0);
+  if (pskc_key == NULL
+      || pskc_get_key_data_secret (pskc_key, &len) != NULL || len != 0
+      || strcmp (pskc_get_key_data_b64secret (pskc_key), "MTIzNA=") != 0)
+    {
+      printf ("pskc_get_key_data_secret badsecret\n");
+      return 1;
+    }
+
+  /* The failure is remembered until a valid secret is set. */
+  if (pskc_get_key_data_secret (pskc_key, &len) != NULL
+      || pskc_set_key_data_b64secret (pskc_key, "MTIzNA==") != PSKC_OK
+      || (p = pskc_get_key_data_secret (pskc_key, &len)) == NULL
+      || len != 4 || memcmp (p, "1234", 4) != 0)
+    {
+      printf ("pskc_get_key_data_secret badsecret again\n");
+      return 1;
+    }
+
+  pskc_done (pskc);
+
   pskc_global_done ();
 
   return 0;
@@ -0,0 +1,181 @@
+/*
+ * tst_find.c - self-tests for libpskc key package lookup functions
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <pskc/pskc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 1000
+
+const char *pskc_users =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<KeyContainer Version=\"1.0\"\n"
+  "    xmlns=\"urn:ietf:params:xml:ns:keyprov:pskc\">\n"
+  "  <KeyPackage>\n"
+  "    <DeviceInfo><SerialNo>SN1</SerialNo><UserId>dev</UserId></DeviceInfo>\n"
+  "    <Key Id=\"K1\"><UserId>alice</UserId></Key>\n"
+  "  </KeyPackage>\n"
+  "  <KeyPackage>\n"
+  "    <DeviceInfo><SerialNo>SN2</SerialNo><UserId>bob</UserId></DeviceInfo>\n"
+  "    <Key Id=\"K2\"/>\n"
+  "  </KeyPackage>\n"
+  "  <KeyPackage>\n"
+  "    <DeviceInfo><SerialNo>SN1</SerialNo></DeviceInfo>\n"
+  "    <Key Id=\"K3\"><UserId>alice</UserId></Key>\n"
+  "  </KeyPackage>\n"
+  "</KeyContainer>\n";
+
+static char ids[NKEYS][20];
+static char serials[NKEYS][20];
+
+void
+my_log (const char *msg)
+{
+  if (msg == NULL)
+    {
+      printf ("log got NULL msg?\n");
+      exit (EXIT_FAILURE);
+    }
+}
+
+int
+main (void)
+{
+  pskc_t *pskc;
+  pskc_key_t *key;
+  size_t i;
+  int rc;
+
+  rc = pskc_global_init ();
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_global_init: %d\n", rc);
+      return 1;
+    }
+
+  pskc_global_log (my_log);
+
+  rc = pskc_init (&pskc);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = pskc_parse_from_memory (pskc, strlen (pskc_users), pskc_users);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_parse_from_memory: %d\n", rc);
+      return 1;
+    }
+
+  /* Duplicates give the first key package. */
+  if (pskc_find_by_serialno (pskc, "SN1") != pskc_get_keypackage (pskc, 0)
+      || pskc_find_by_serialno (pskc, "SN2") != pskc_get_keypackage (pskc, 1)
+      || pskc_find_by_serialno (pskc, "SN3") != NULL)
+    {
+      printf ("pskc_find_by_serialno\n");
+      return 1;
+    }
+
+  if (pskc_find_by_key_id (pskc, "K3") != pskc_get_keypackage (pskc, 2)
+      || pskc_find_by_key_id (pskc, NULL) != NULL)
+    {
+      printf ("pskc_find_by_key_id\n");
+      return 1;
+    }
+
+  /* Device user ids are only used without a Key UserId. */
+  if (pskc_find_by_userid (pskc, "alice") != pskc_get_keypackage (pskc, 0)
+      || pskc_find_by_userid (pskc, "bob") != pskc_get_keypackage (pskc, 1)
+      || pskc_find_by_userid (pskc, "dev") != NULL)
+    {
+      printf ("pskc_find_by_userid\n");
+      return 1;
+    }
+
+  /* Setters invalidate the index. */
+  pskc_set_key_userid (pskc_get_keypackage (pskc, 0), "carol");
+  if (pskc_find_by_userid (pskc, "alice") != pskc_get_keypackage (pskc, 2)
+      || pskc_find_by_userid (pskc, "carol") != pskc_get_keypackage (pskc, 0))
+    {
+      printf ("pskc_find_by_userid after pskc_set_key_userid\n");
+      return 1;
+    }
+
+  pskc_done (pskc);
+
+  /* Adding key packages invalidates the index. */
+  rc = pskc_init (&pskc);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_init: %d\n", rc);
+      return 1;
+    }
+
+  for (i = 0; i < NKEYS; i++)
+    {
+      rc = pskc_add_keypackage (pskc, &key);
+      if (rc != PSKC_OK)
+	{
+	  printf ("pskc_add_keypackage: %d\n", rc);
+	  return 1;
+	}
+
+      sprintf (ids[i], "id%ld", (long) i);
+      sprintf (serials[i], "sn%ld", (long) i);
+      pskc_set_key_id (key, ids[i]);
+      pskc_set_device_serialno (key, serials[i]);
+
+      if (pskc_find_by_key_id (pskc, ids[i]) != key)
+	{
+	  printf ("pskc_find_by_key_id[%ld]\n", (long) i);
+	  return 1;
+	}
+    }
+
+  for (i = 0; i < NKEYS; i++)
+    if (pskc_find_by_serialno (pskc, serials[i])
+	!= pskc_get_keypackage (pskc, i))
+      {
+	printf ("pskc_find_by_serialno[%ld]\n", (long) i);
+	return 1;
+      }
+
+  pskc_set_device_serialno (pskc_get_keypackage (pskc, 7), "moved");
+  if (pskc_find_by_serialno (pskc, serials[7]) != NULL
+      || pskc_find_by_serialno (pskc, "moved")
+      != pskc_get_keypackage (pskc, 7))
+    {
+      printf ("pskc_find_by_serialno after pskc_set_device_serialno\n");
+      return 1;
+    }
+
+  pskc_done (pskc);
+
+  pskc_global_done ();
+
+  return 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * tst_reader.c - self-tests for libpskc streaming reader functions
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <pskc/pskc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *pskc_multi =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<KeyContainer Version=\"1.0\" Id=\"KCID\"\n"
+  "    xmlns=\"urn:ietf:params:xml:ns:keyprov:pskc\">\n"
+  "  <KeyPackage>\n"
+  "    <DeviceInfo><SerialNo>SN1</SerialNo></DeviceInfo>\n"
+  "    <Key Id=\"K1\" Algorithm=\"urn:ietf:params:xml:ns:keyprov:pskc:hotp\">\n"
+  "      <Data><Secret><PlainValue>MTIzNA==</PlainValue></Secret></Data>\n"
+  "    </Key>\n"
+  "  </KeyPackage>\n"
+  "  <KeyPackage>\n"
+  "    <DeviceInfo><SerialNo>SN2</SerialNo></DeviceInfo>\n"
+  "    <Key Id=\"K2\" Algorithm=\"urn:ietf:params:xml:ns:keyprov:pskc:hotp\">\n"
+  "      <Data><Secret><PlainValue>NTY3OA==</PlainValue></Secret></Data>\n"
+  "    </Key>\n"
+  "  </KeyPackage>\n"
+  "  <KeyPackage>\n"
+  "    <DeviceInfo><SerialNo>SN3</SerialNo><Bogus/></DeviceInfo>\n"
+  "    <Key Id=\"K3\" Algorithm=\"urn:ietf:params:xml:ns:keyprov:pskc:hotp\">\n"
+  "    </Key>\n"
+  "  </KeyPackage>\n"
+  "</KeyContainer>\n";
+
+const char *pskc_trailing =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<KeyContainer Version=\"1.0\"\n"
+  "    xmlns=\"urn:ietf:params:xml:ns:keyprov:pskc\">\n"
+  "  <KeyPackage>\n"
+  "    <Key Id=\"K1\"></Key>\n"
+  "  </KeyPackage>\n"
+  "  <Foo/>\n"
+  "</KeyContainer>\n";
+
+void
+my_log (const char *msg)
+{
+  if (msg == NULL)
+    {
+      printf ("log got NULL msg?\n");
+      exit (EXIT_FAILURE);
+    }
+}
+
+int
+main (void)
+{
+  pskc_t *pskc;
+  pskc_reader_t *reader;
+  pskc_key_t *key;
+  size_t i;
+  int rc;
+
+  rc = pskc_global_init ();
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_global_init: %d\n", rc);
+      return 1;
+    }
+
+  pskc_global_log (my_log);
+
+  rc = pskc_init (&pskc);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_init: %d\n", rc);
+      return 1;
+    }
+
+  rc = pskc_parse_from_memory (pskc, strlen (pskc_multi), pskc_multi);
+  if (rc != PSKC_PARSE_ERROR)
+    {
+      printf ("pskc_parse_from_memory: %d\n", rc);
+      return 1;
+    }
+
+  rc = pskc_reader_open_memory (&reader, strlen (pskc_multi), pskc_multi);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_reader_open_memory: %d\n", rc);
+      return 1;
+    }
+
+  /* The reader must return the same key packages as the DOM parser. */
+  for (i = 0; i < 3; i++)
+    {
+      pskc_key_t *dom = pskc_get_keypackage (pskc, i);
+      const char *a, *b;
+
+      rc = pskc_reader_next_keypackage (reader, &key);
+      if (rc != (i == 2 ? PSKC_PARSE_ERROR : PSKC_OK) || key == NULL)
+	{
+	  printf ("pskc_reader_next_keypackage[%ld]: %d\n", (long) i, rc);
+	  return 1;
+	}
+
+      if (strcmp (pskc_get_key_id (key), pskc_get_key_id (dom)) != 0)
+	{
+	  printf ("pskc_get_key_id[%ld]\n", (long) i);
+	  return 1;
+	}
+
+      if (strcmp (pskc_get_device_serialno (key),
+		  pskc_get_device_serialno (dom)) != 0)
+	{
+	  printf ("pskc_get_device_serialno[%ld]\n", (long) i);
+	  return 1;
+	}
+
+      a = pskc_get_key_data_b64secret (key);
+      b = pskc_get_key_data_b64secret (dom);
+      if ((a == NULL) != (b == NULL) || (a && strcmp (a, b) != 0))
+	{
+	  printf ("pskc_get_key_data_b64secret[%ld]\n", (long) i);
+	  return 1;
+	}
+    }
+
+  rc = pskc_reader_next_keypackage (reader, &key);
+  if (rc != PSKC_OK || key != NULL)
+    {
+      printf ("pskc_reader_next_keypackage end: %d\n", rc);
+      return 1;
+    }
+
+  pskc_reader_done (reader);
+  pskc_done (pskc);
+
+  /* Errors after the last key package come with the end marker. */
+  rc = pskc_reader_open_memory (&reader, strlen (pskc_trailing),
+				pskc_trailing);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_reader_open_memory trailing: %d\n", rc);
+      return 1;
+    }
+
+  rc = pskc_reader_next_keypackage (reader, &key);
+  if (rc != PSKC_OK || key == NULL)
+    {
+      printf ("pskc_reader_next_keypackage trailing: %d\n", rc);
+      return 1;
+    }
+
+  rc = pskc_reader_next_keypackage (reader, &key);
+  if (rc != PSKC_PARSE_ERROR || key != NULL)
+    {
+      printf ("pskc_reader_next_keypackage trailing end: %d\n", rc);
+      return 1;
+    }
+
+  pskc_reader_done (reader);
+
+  rc = pskc_reader_open (&reader, "no-such-file.xml");
+  if (rc == PSKC_OK)
+    {
+      rc = pskc_reader_next_keypackage (reader, &key);
+      pskc_reader_done (reader);
+    }
+  if (rc != PSKC_XML_ERROR)
+    {
+      printf ("pskc_reader_open missing file: %d\n", rc);
+      return 1;
+    }
+
+  pskc_global_done ();
+
+  return 0;
+}
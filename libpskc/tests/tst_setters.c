@@ -680,6 +680,61 @@ main (void)
 
   pskc_done (pskc);
 
+  /* Key packages must keep their address as the container grows. */
+  rc = pskc_init (&pskc);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_init: %d\n", rc);
+      return 1;
+    }
+
+  {
+    pskc_key_t *first = NULL;
+    size_t i;
+
+    for (i = 0; i < 1000; i++)
+      {
+	rc = pskc_add_keypackage (pskc, &keyp);
+	if (rc != PSKC_OK || keyp != pskc_get_keypackage (pskc, i))
+	  {
+	    printf ("pskc_add_keypackage[%ld]: %d\n", (long) i, rc);
+	    return 1;
+	  }
+	if (i == 0)
+	  first = keyp;
+
+	rc = pskc_set_key_data_secret (keyp, (const char *) &i, sizeof (i));
+	if (rc != PSKC_OK)
+	  {
+	    printf ("pskc_set_key_data_secret[%ld]: %d\n", (long) i, rc);
+	    return 1;
+	  }
+      }
+
+    if (pskc_get_keypackage (pskc, 0) != first
+	|| pskc_get_keypackage (pskc, 1000) != NULL)
+      {
+	printf ("pskc_get_keypackage\n");
+	return 1;
+      }
+
+    for (i = 0; i < 1000; i++)
+      {
+	const char *secret;
+
+	secret = pskc_get_key_data_secret (pskc_get_keypackage (pskc, i),
+					   &len);
+	if (secret == NULL || len != sizeof (i)
+	    || memcmp (secret, &i, sizeof (i)) != 0)
+	  {
+	    printf ("pskc_get_key_data_secret[%ld]\n", (long) i);
+	    return 1;
+	  }
+      }
+  }
+
+  pskc_done (pskc);
+
   pskc_global_done ();
 
   return 0;
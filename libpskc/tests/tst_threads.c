@@ -0,0 +1,169 @@
+/*
+ * tst_threads.c - self-tests for libpskc parsing with threads
+ * Copyright (C) 2012-2013 Simon Josefsson
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 2.1 of
+ * the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <config.h>
+
+#include <pskc/pskc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NKEYS 1000
+
+/* Key package number badkey has a bad secret, and there is an unknown
+   element before key package number badelem, or -1 for none.  Which
+   error is returned depends on their order, in both directions. */
+static const struct
+{
+  int badkey, badelem;
+} cases[] = {
+  {-1, -1}, {700, -1}, {-1, 300}, {700, 300}, {300, 700}
+};
+
+static char xml[NKEYS * 400];
+
+static size_t
+make_xml (int badkey, int badelem)
+{
+  char *p = xml;
+  int i;
+
+  p += sprintf (p, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<KeyContainer Version=\"1.0\"\n"
+		"    xmlns=\"urn:ietf:params:xml:ns:keyprov:pskc\">\n");
+  for (i = 0; i < NKEYS; i++)
+    {
+      if (i == badelem)
+	p += sprintf (p, "  <Foo/>\n");
+      p += sprintf (p, "  <KeyPackage>\n"
+		    "    <DeviceInfo><SerialNo>%d</SerialNo></DeviceInfo>\n"
+		    "    <Key Id=\"%d\">\n", i, i);
+      if (i % 3 == 0)
+	p += sprintf (p, "      <FriendlyName>key %d</FriendlyName>\n", i);
+      p += sprintf (p, "      <Data><Secret><PlainValue>%s</PlainValue>"
+		    "</Secret><Counter><PlainValue>%d</PlainValue>"
+		    "</Counter></Data>\n", i == badkey
+		    ? "MTIzNA=" : "MTIzNDU2Nzg5MDEyMzQ1Njc4OTA=", i);
+      p += sprintf (p, "    </Key>\n  </KeyPackage>\n");
+    }
+  p += sprintf (p, "</KeyContainer>\n");
+
+  return p - xml;
+}
+
+static int
+parse (pskc_t ** pskc, unsigned threads, size_t len)
+{
+  int rc;
+
+  rc = pskc_init (pskc);
+  if (rc != PSKC_OK)
+    {
+      printf ("pskc_init: %d\n", rc);
+      exit (EXIT_FAILURE);
+    }
+
+  pskc_set_parse_threads (*pskc, threads);
+
+  return pskc_parse_from_memory (*pskc, len, xml);
+}
+
+static int
+same (const char *a, const char *b)
+{
+  return a == b || (a && b && strcmp (a, b) == 0);
+}
+
+static void
+compare (pskc_t * pskc1, pskc_t * pskc2)
+{
+  size_t i;
+
+  for (i = 0; i < NKEYS; i++)
+    {
+      pskc_key_t *k1 = pskc_get_keypackage (pskc1, i);
+      pskc_key_t *k2 = pskc_get_keypackage (pskc2, i);
+      const char *s1, *s2;
+      size_t l1 = 0, l2 = 0;
+
+      if (k1 == NULL || k2 == NULL
+	  || !same (pskc_get_key_id (k1), pskc_get_key_id (k2))
+	  || !same (pskc_get_device_serialno (k1),
+		    pskc_get_device_serialno (k2))
+	  || !same (pskc_get_key_friendlyname (k1),
+		    pskc_get_key_friendlyname (k2))
+	  || pskc_get_key_data_counter (k1, NULL)
+	  != pskc_get_key_data_counter (k2, NULL)
+	  || (s1 = pskc_get_key_data_secret (k1, &l1),
+	      s2 = pskc_get_key_data_secret (k2, &l2),
+	      (s1 == NULL) != (s2 == NULL))
+	  || l1 != l2 || (s1 && memcmp (s1, s2, l1) != 0))
+	{
+	  printf ("key package %ld differs\n", (long) i);
+	  exit (EXIT_FAILURE);
+	}
+    }
+
+  if (pskc_get_keypackage (pskc2, NKEYS) != NULL)
+    {
+      printf ("too many key packages\n");
+      exit (EXIT_FAILURE);
+    }
+}
+
+int
+main (void)
+{
+  pskc_t *pskc1, *pskc2;
+  size_t len;
+  int rc1, rc2;
+  size_t i;
+
+  rc1 = pskc_global_init ();
+  if (rc1 != PSKC_OK)
+    {
+      printf ("pskc_global_init: %d\n", rc1);
+      return 1;
+    }
+
+  for (i = 0; i < sizeof (cases) / sizeof (cases[0]); i++)
+    {
+      len = make_xml (cases[i].badkey, cases[i].badelem);
+
+      rc1 = parse (&pskc1, 1, len);
+      rc2 = parse (&pskc2, 4, len);
+      if (rc1 != rc2)
+	{
+	  printf ("parse %ld: %d != %d\n", (long) i, rc1, rc2);
+	  return 1;
+	}
+
+      compare (pskc1, pskc2);
+
+      pskc_done (pskc1);
+      pskc_done (pskc2);
+    }
+
+  pskc_global_done ();
+
+  return 0;
+}
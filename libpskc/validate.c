@@ -46,6 +46,8 @@ pskc_validate (pskc_t * container, int *isvalid)
   xmlSchemaPtr _pskc_schema = NULL;
   xmlSchemaValidCtxtPtr _pskc_schema_validctxt = NULL;
 
+  PSKC_PROBE (validate_entry);
+
   _pskc_parser_ctxt = xmlSchemaNewParserCtxt (PSKC_SCHEMA_URI);
   if (_pskc_parser_ctxt == NULL)
     {
@@ -70,6 +72,8 @@ pskc_validate (pskc_t * container, int *isvalid)
       return PSKC_XML_ERROR;
     }
 
+  PSKC_PROBE (validate_schema_loaded);
+
   *isvalid = xmlSchemaValidateDoc (_pskc_schema_validctxt,
 				   container->xmldoc) == 0;
 
@@ -77,5 +81,7 @@ pskc_validate (pskc_t * container, int *isvalid)
   xmlSchemaFree (_pskc_schema);
   xmlSchemaFreeParserCtxt (_pskc_parser_ctxt);
 
+  PSKC_PROBE1 (validate_return, *isvalid);
+
   return PSKC_OK;
 }
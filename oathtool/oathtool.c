@@ -26,6 +26,12 @@
 #include <string.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <time.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* Gnulib. */
 #include "progname.h"
@@ -90,31 +96,1010 @@ verbose_hotp (uint64_t moving_factor)
 }
 
 static void
-verbose_totp (time_t t0, time_t time_step_size, time_t when)
+format_time (time_t t, char *outstr, size_t len)
 {
   struct tm tmp;
-  char outstr[200];
 
-  if (gmtime_r (&t0, &tmp) == NULL)
+  if (gmtime_r (&t, &tmp) == NULL)
     error (EXIT_FAILURE, 0, "gmtime_r");
 
-  if (strftime (outstr, sizeof (outstr), "%Y-%m-%d %H:%M:%S UTC", &tmp) == 0)
+  if (strftime (outstr, len, "%Y-%m-%d %H:%M:%S UTC", &tmp) == 0)
     error (EXIT_FAILURE, 0, "strftime");
+}
+
+static void
+verbose_totp (time_t t0, time_t time_step_size, time_t when)
+{
+  char outstr[200];
+
+  format_time (t0, outstr, sizeof (outstr));
 
   printf ("Step size (seconds): %ld\n", time_step_size);
   printf ("Start time: %s (%ld)\n", outstr, t0);
 
-  if (gmtime_r (&when, &tmp) == NULL)
-    error (EXIT_FAILURE, 0, "gmtime_r");
-
-  if (strftime (outstr, sizeof (outstr), "%Y-%m-%d %H:%M:%S UTC", &tmp) == 0)
-    error (EXIT_FAILURE, 0, "strftime");
+  format_time (when, outstr, sizeof (outstr));
 
   printf ("Current time: %s (%ld)\n", outstr, when);
   printf ("Counter: 0x%lX (%ld)\n\n", (when - t0) / time_step_size,
 	  (when - t0) / time_step_size);
 }
 
+/* OTPs generated by each thread before the output is written. */
+#define GENERATE_CHUNK 65536
+
+/* A range of OTPs to generate into a buffer, one per line. */
+struct generate_work
+{
+  const char *secret;
+  size_t secretlen;
+  int totp;
+  uint64_t moving_factor;
+  time_t when, time_step_size, t0;
+  unsigned digits;
+  int totpflags;
+  size_t first, count;
+  char *buf;
+  size_t len;
+  int rc;
+};
+
+static void *
+generate_chunk (void *arg)
+{
+  struct generate_work *w = arg;
+  char otp[10];
+  size_t i;
+
+  w->len = 0;
+  w->rc = OATH_OK;
+
+  for (i = w->first; i < w->first + w->count; i++)
+    {
+      if (w->totp)
+	w->rc = oath_totp_generate2 (w->secret, w->secretlen,
+				     w->when + i * w->time_step_size,
+				     w->time_step_size, w->t0, w->digits,
+				     w->totpflags, otp);
+      else
+	w->rc = oath_hotp_generate (w->secret, w->secretlen,
+				    w->moving_factor + i, w->digits, false,
+				    OATH_HOTP_DYNAMIC_TRUNCATION, otp);
+      if (w->rc != OATH_OK)
+	return NULL;
+
+      memcpy (w->buf + w->len, otp, w->digits);
+      w->len += w->digits;
+      w->buf[w->len++] = '\n';
+    }
+
+  return NULL;
+}
+
+/* Upper limit for --threads. */
+#define MAX_THREADS 1024
+
+/* Call FN on each of the N work items of SIZE bytes at WORK, in
+   parallel threads where possible. */
+static void
+run_parallel (void *(*fn) (void *), void *work, size_t size, size_t n)
+{
+  char *p = work;
+  size_t i;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_t *tid = NULL;
+  size_t started = 1;
+
+  /* The main thread takes the first item itself, and any items no
+     thread could be started for. */
+  if (n > 1)
+    tid = malloc ((n - 1) * sizeof (*tid));
+  if (tid)
+    for (; started < n; started++)
+      if (pthread_create (&tid[started - 1], NULL, fn,
+			  p + started * size) != 0)
+	break;
+  fn (p);
+  for (i = 1; i < started; i++)
+    pthread_join (tid[i - 1], NULL);
+  free (tid);
+  for (i = started; i < n; i++)
+    fn (p + i * size);
+#else
+  for (i = 0; i < n; i++)
+    fn (p + i * size);
+#endif
+}
+
+/* Print the OTPs at positions 0 .. WINDOW of the OTP stream given by
+   TEMPLATE, one per line in order.  The positions are split into
+   rounds of up to THREADS chunks that are generated in parallel, each
+   into its own buffer, and then written out in order. */
+static void
+generate_window (const struct generate_work *template, size_t window,
+		 unsigned threads)
+{
+  struct generate_work *work;
+  size_t done = 0, chunk, i, n;
+
+  if (threads == 0)
+    threads = 1;
+  if (threads > window + 1)
+    threads = window + 1;
+  chunk = window / threads + 1;
+  if (chunk > GENERATE_CHUNK)
+    chunk = GENERATE_CHUNK;
+
+  work = calloc (threads, sizeof (*work));
+  if (!work)
+    error (EXIT_FAILURE, errno, "calloc");
+
+  for (i = 0; i < threads; i++)
+    {
+      work[i] = *template;
+      work[i].buf = malloc (chunk * (template->digits + 1));
+      if (!work[i].buf)
+	error (EXIT_FAILURE, errno, "malloc");
+    }
+
+  while (done <= window)
+    {
+      chunk = (window - done) / threads + 1;
+      if (chunk > GENERATE_CHUNK)
+	chunk = GENERATE_CHUNK;
+
+      for (n = 0; n < threads && done <= window; n++)
+	{
+	  work[n].first = done;
+	  work[n].count = window - done + 1;
+	  if (work[n].count > chunk)
+	    work[n].count = chunk;
+	  done += work[n].count;
+	}
+
+      run_parallel (generate_chunk, work, sizeof (*work), n);
+
+      for (i = 0; i < n; i++)
+	{
+	  if (work[i].rc != OATH_OK)
+	    error (EXIT_FAILURE, 0,
+		   "generating one-time password failed (%d)", work[i].rc);
+	  if (fwrite (work[i].buf, 1, work[i].len, stdout) != work[i].len)
+	    error (EXIT_FAILURE, errno, "write error");
+	}
+    }
+
+  for (i = 0; i < threads; i++)
+    free (work[i].buf);
+  free (work);
+}
+
+/* Time steps compared by each thread before the matches are printed. */
+#define SEARCH_CHUNK 65536
+
+/* A range of TOTP time steps to compare with an OTP. */
+struct search_work
+{
+  const char *secret;
+  size_t secretlen;
+  time_t time_step_size, t0;
+  int totpflags;
+  const char *otp;
+  uint64_t first, count;
+  uint64_t *matches;
+  size_t nmatches, size;
+  int rc;
+};
+
+static void *
+search_chunk (void *arg)
+{
+  struct search_work *w = arg;
+  unsigned digits = strlen (w->otp);
+  char otp[10];
+  uint64_t c;
+
+  w->nmatches = 0;
+  w->rc = OATH_OK;
+
+  for (c = w->first; c < w->first + w->count; c++)
+    {
+      w->rc = oath_totp_generate2 (w->secret, w->secretlen,
+				   w->t0 + c * w->time_step_size,
+				   w->time_step_size, w->t0, digits,
+				   w->totpflags, otp);
+      if (w->rc != OATH_OK)
+	return NULL;
+
+      if (strcmp (otp, w->otp) != 0)
+	continue;
+
+      if (w->nmatches == w->size)
+	{
+	  size_t size = w->size ? 2 * w->size : 16;
+	  uint64_t *tmp = realloc (w->matches, size * sizeof (*tmp));
+
+	  if (!tmp)
+	    {
+	      w->rc = OATH_MALLOC_ERROR;
+	      return NULL;
+	    }
+	  w->matches = tmp;
+	  w->size = size;
+	}
+      w->matches[w->nmatches++] = c;
+    }
+
+  return NULL;
+}
+
+/* Print the counter and start time of every time step between
+   counters FROM and TO (inclusive) where TEMPLATE's OTP was valid,
+   and return the number of them.  The steps are compared in rounds
+   of up to THREADS chunks in parallel. */
+static uint64_t
+search_range (const struct search_work *template, uint64_t from,
+	      uint64_t to, unsigned threads)
+{
+  struct search_work *work;
+  uint64_t next = from, found = 0, chunk;
+  char outstr[200];
+  size_t i, j, n;
+
+  if (threads == 0)
+    threads = 1;
+  if (to >= from && to - from < threads)
+    threads = to - from + 1;
+
+  work = calloc (threads, sizeof (*work));
+  if (!work)
+    error (EXIT_FAILURE, errno, "calloc");
+  for (i = 0; i < threads; i++)
+    work[i] = *template;
+
+  while (next <= to)
+    {
+      chunk = (to - next) / threads + 1;
+      if (chunk > SEARCH_CHUNK)
+	chunk = SEARCH_CHUNK;
+
+      for (n = 0; n < threads && next <= to; n++)
+	{
+	  work[n].first = next;
+	  work[n].count = to - next + 1;
+	  if (work[n].count > chunk)
+	    work[n].count = chunk;
+	  next += work[n].count;
+	}
+
+      run_parallel (search_chunk, work, sizeof (*work), n);
+
+      for (i = 0; i < n; i++)
+	{
+	  if (work[i].rc != OATH_OK)
+	    error (EXIT_FAILURE, 0,
+		   "generating one-time password failed (%d)", work[i].rc);
+	  for (j = 0; j < work[i].nmatches; j++)
+	    {
+	      format_time (template->t0
+			   + work[i].matches[j] * template->time_step_size,
+			   outstr, sizeof (outstr));
+	      printf ("%" PRIu64 " %s\n", work[i].matches[j], outstr);
+	    }
+	  found += work[i].nmatches;
+	}
+    }
+
+  for (i = 0; i < threads; i++)
+    free (work[i].matches);
+  free (work);
+
+  return found;
+}
+
+/* Decode the secret KEY, in hex or base32. */
+static int
+decode_key (const char *key, int base32, char **secret, size_t * secretlen)
+{
+  int rc;
+
+  if (base32)
+    return oath_base32_decode (key, strlen (key), secret, secretlen);
+
+  *secretlen = 1 + strlen (key) / 2;
+  *secret = malloc (*secretlen);
+  if (!*secret)
+    error (EXIT_FAILURE, errno, "malloc");
+
+  rc = oath_hex2bin (key, *secret, secretlen);
+  if (rc != OATH_OK)
+    {
+      free (*secret);
+      *secret = NULL;
+    }
+
+  return rc;
+}
+
+/* Number of decoded keys remembered in --batch mode. */
+#define BATCH_KEYS 256
+
+struct batch_key
+{
+  char *key;
+  char *secret;
+  size_t secretlen;
+};
+
+/* Return the decoded secret of KEY, from CACHE if it was seen
+   recently, or NULL with *RC set if it cannot be decoded. */
+static const struct batch_key *
+batch_lookup_key (struct batch_key *cache, const char *key, int base32,
+		  int *rc)
+{
+  struct batch_key *k;
+  unsigned h = 5381;
+  const char *p;
+
+  for (p = key; *p; p++)
+    h = h * 33 + (unsigned char) *p;
+  k = &cache[h % BATCH_KEYS];
+
+  if (k->key && strcmp (k->key, key) == 0)
+    return k;
+
+  free (k->key);
+  free (k->secret);
+  k->key = NULL;
+  k->secret = NULL;
+
+  *rc = decode_key (key, base32, &k->secret, &k->secretlen);
+  if (*rc != OATH_OK)
+    return NULL;
+
+  k->key = strdup (key);
+  if (!k->key)
+    error (EXIT_FAILURE, errno, "strdup");
+
+  return k;
+}
+
+/* Read records of "KEY MODE COUNTER|TIME [OTP [WINDOW]]" from
+   standard input and write one result per line to standard output:
+   the generated OTPs, separated by spaces, the position of a valid
+   OTP, "invalid", or "error: " and a message.  MODE is hotp, totp,
+   totp-sha256 or totp-sha512, and TIME (without spaces, for example
+   @1111111109) or "-" for the current time.  Returns the exit
+   status. */
+static int
+batch (const struct gengetopt_args_info *args_info, time_t t0,
+       time_t time_step_size)
+{
+  static struct batch_key cache[BATCH_KEYS];
+  char line[BUFSIZ];
+  size_t lineno = 0, i;
+  time_t now = time (NULL);
+  int status = EXIT_SUCCESS;
+
+  setvbuf (stdout, NULL, _IOFBF, 65536);
+
+  while (fgets (line, sizeof (line), stdin) != NULL)
+    {
+      char *key, *mode, *at, *otp, *win, *end;
+      const struct batch_key *k;
+      unsigned digits = args_info->digits_orig ? args_info->digits_arg : 6;
+      size_t window = args_info->window_orig ? args_info->window_arg : 0;
+      uint64_t moving_factor = 0;
+      time_t when = now;
+      int totpflags = 0, totp;
+      char buf[10];
+      int rc;
+
+      lineno++;
+      if (strchr (line, '\n') == NULL && !feof (stdin))
+	error (EXIT_FAILURE, 0, "line %zu too long", lineno);
+
+      key = strtok (line, " \t\r\n");
+      if (key == NULL || *key == '#')
+	continue;
+      mode = strtok (NULL, " \t\r\n");
+      at = strtok (NULL, " \t\r\n");
+      otp = strtok (NULL, " \t\r\n");
+      win = strtok (NULL, " \t\r\n");
+
+      if (mode == NULL || at == NULL)
+	{
+	  printf ("error: line %zu: missing mode or counter\n", lineno);
+	  status = EXIT_FAILURE;
+	  continue;
+	}
+
+      totp = strncmp (mode, "totp", 4) == 0;
+      if (strcmp (mode, "totp-sha256") == 0)
+	totpflags = OATH_TOTP_HMAC_SHA256;
+      else if (strcmp (mode, "totp-sha512") == 0)
+	totpflags = OATH_TOTP_HMAC_SHA512;
+      else if (strcmp (mode, "totp") != 0 && strcmp (mode, "hotp") != 0)
+	{
+	  printf ("error: line %zu: unknown mode `%s'\n", lineno, mode);
+	  status = EXIT_FAILURE;
+	  continue;
+	}
+
+      errno = 0;
+      if (!totp)
+	{
+	  moving_factor = strtoull (at, &end, 10);
+	  if (*end != '\0' || errno)
+	    {
+	      printf ("error: line %zu: invalid counter `%s'\n", lineno, at);
+	      status = EXIT_FAILURE;
+	      continue;
+	    }
+	}
+      else if (strcmp (at, "-") != 0
+	       && (when = parse_time (at, now)) == BAD_TIME)
+	{
+	  printf ("error: line %zu: cannot parse time `%s'\n", lineno, at);
+	  status = EXIT_FAILURE;
+	  continue;
+	}
+
+      if (otp && strcmp (otp, "-") == 0)
+	otp = NULL;
+
+      if (win)
+	{
+	  window = strtoul (win, &end, 10);
+	  if (*end != '\0' || errno)
+	    {
+	      printf ("error: line %zu: invalid window `%s'\n", lineno, win);
+	      status = EXIT_FAILURE;
+	      continue;
+	    }
+	}
+
+      k = batch_lookup_key (cache, key, args_info->base32_flag, &rc);
+      if (k == NULL)
+	{
+	  printf ("error: line %zu: decoding key failed: %s\n", lineno,
+		  oath_strerror (rc));
+	  status = EXIT_FAILURE;
+	  continue;
+	}
+
+      if (otp == NULL)
+	{
+	  size_t iter = 0;
+
+	  do
+	    {
+	      if (totp)
+		rc = oath_totp_generate2 (k->secret, k->secretlen,
+					  when + iter * time_step_size,
+					  time_step_size, t0, digits,
+					  totpflags, buf);
+	      else
+		rc = oath_hotp_generate (k->secret, k->secretlen,
+					 moving_factor + iter, digits, false,
+					 OATH_HOTP_DYNAMIC_TRUNCATION, buf);
+	      if (rc != OATH_OK)
+		break;
+	      printf (iter ? " %s" : "%s", buf);
+	    }
+	  while (window - iter++ > 0);
+	  if (rc != OATH_OK)
+	    printf ("%serror: %s", iter ? " " : "", oath_strerror (rc));
+	  putchar ('\n');
+	}
+      else
+	{
+	  if (totp)
+	    rc = oath_totp_validate4 (k->secret, k->secretlen, when,
+				      time_step_size, t0, window,
+				      NULL, NULL, totpflags, otp);
+	  else
+	    rc = oath_hotp_validate (k->secret, k->secretlen,
+				     moving_factor, window, otp);
+	  if (rc == OATH_INVALID_OTP)
+	    printf ("invalid\n");
+	  else if (rc < 0)
+	    printf ("error: %s\n", oath_strerror (rc));
+	  else
+	    printf ("%d\n", rc);
+	}
+
+      if (rc < 0 && rc != OATH_INVALID_OTP)
+	status = EXIT_FAILURE;
+    }
+
+  for (i = 0; i < BATCH_KEYS; i++)
+    {
+      free (cache[i].key);
+      free (cache[i].secret);
+    }
+
+  if (fflush (stdout) != 0)
+    error (EXIT_FAILURE, errno, "write error");
+
+  return status;
+}
+
+/* Minimum time spent on each --benchmark throughput measurement. */
+#define BENCH_NSEC 200000000ULL
+
+/* Validations timed to find the worst case latency of a window. */
+#define BENCH_RUNS 20
+
+/* Window used to measure the cost of each candidate OTP. */
+#define BENCH_WINDOW 1000
+
+struct bench
+{
+  char secret[64];
+  unsigned digits;
+  int totpflags;
+  char otp[10];
+};
+
+static uint64_t
+bench_clock (void)
+{
+  struct timespec ts;
+
+  if (clock_gettime (CLOCK_MONOTONIC, &ts) != 0)
+    error (EXIT_FAILURE, errno, "clock_gettime");
+
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Length of the key recommended for the HMAC in FLAGS. */
+static size_t
+bench_keylen (int flags)
+{
+  if (flags & OATH_TOTP_HMAC_SHA512)
+    return 64;
+  else if (flags & OATH_TOTP_HMAC_SHA256)
+    return 32;
+  return 20;
+}
+
+/* Return the number of OTPs per second generated with FLAGS. */
+static double
+bench_generate (const struct bench *b, int flags)
+{
+  uint64_t start = bench_clock (), elapsed;
+  unsigned long n = 0;
+  char otp[10];
+  int rc, i;
+
+  do
+    {
+      for (i = 0; i < 1000; i++, n++)
+	{
+	  rc = oath_totp_generate2 (b->secret, bench_keylen (flags), n * 30,
+				    30, 0, b->digits, flags, otp);
+	  if (rc != OATH_OK)
+	    error (EXIT_FAILURE, 0,
+		   "generating one-time password failed (%d)", rc);
+	}
+      elapsed = bench_clock () - start;
+    }
+  while (elapsed < BENCH_NSEC);
+
+  return n * 1e9 / elapsed;
+}
+
+/* Time one failed validation, which tries every candidate of WINDOW,
+   and return the nanoseconds it took. */
+static uint64_t
+bench_validate (const struct bench *b, int totp, size_t window)
+{
+  uint64_t start = bench_clock ();
+  int rc;
+
+  if (totp)
+    rc = oath_totp_validate4 (b->secret, bench_keylen (b->totpflags),
+			      1000000000, 30, 0, window, NULL, NULL,
+			      b->totpflags, b->otp);
+  else
+    rc = oath_hotp_validate (b->secret, 20, 0, window, b->otp);
+  if (rc != OATH_INVALID_OTP)
+    error (EXIT_FAILURE, 0, "validating one-time password failed (%d)", rc);
+
+  return bench_clock () - start;
+}
+
+/* Return the slowest of BENCH_RUNS failed validations over WINDOW. */
+static uint64_t
+bench_worst (const struct bench *b, int totp, size_t window)
+{
+  uint64_t worst = 0, t;
+  int i;
+
+  for (i = 0; i < BENCH_RUNS; i++)
+    if ((t = bench_validate (b, totp, window)) > worst)
+      worst = t;
+
+  return worst;
+}
+
+/* Return the nanoseconds spent on each candidate OTP of a window. */
+static double
+bench_candidate (const struct bench *b, int totp)
+{
+  size_t candidates = totp ? 2 * BENCH_WINDOW + 1 : BENCH_WINDOW + 1;
+  uint64_t elapsed = 0;
+  unsigned long n = 0;
+
+  do
+    {
+      elapsed += bench_validate (b, totp, BENCH_WINDOW);
+      n++;
+    }
+  while (elapsed < BENCH_NSEC);
+
+  return (double) elapsed / n / candidates;
+}
+
+/* Return the largest window whose worst case validation latency is
+   within BUDGET nanoseconds, starting from the estimate given by COST
+   per candidate and shrinking it while the measured latency is over
+   budget.  Store the measured latency in *WORST. */
+static size_t
+bench_recommend (const struct bench *b, int totp, double cost,
+		 double budget, uint64_t *worst)
+{
+  double candidates = budget / cost;
+  size_t window = 0;
+  int i;
+
+  for (i = 0; i < 10; i++)
+    {
+      if (candidates < 1)
+	candidates = 1;
+      window = totp ? (size_t) (candidates - 1) / 2
+	: (size_t) (candidates - 1);
+
+      *worst = bench_worst (b, totp, window);
+      if (*worst <= budget || window == 0)
+	break;
+
+      candidates = candidates * budget / *worst * 0.95;
+    }
+
+  return window;
+}
+
+/* Measure OTP generation and validation speed on this host and print
+   the largest HOTP and TOTP windows within the latency budget. */
+static void
+benchmark (const struct gengetopt_args_info *args_info)
+{
+  static const struct
+  {
+    const char *name;
+    int flags;
+  } algos[] =
+  {
+    { "SHA1", 0 },
+    { "SHA256", OATH_TOTP_HMAC_SHA256 },
+    { "SHA512", OATH_TOTP_HMAC_SHA512 }
+  };
+  static const size_t steps[] = { 1, 2, 5 };
+  struct bench b;
+  double budget = args_info->latency_budget_arg * 1e6;
+  double hotp_cost, totp_cost;
+  size_t max_window, decade, window, i;
+  uint64_t worst;
+
+  if (args_info->latency_budget_arg <= 0)
+    error (EXIT_FAILURE, 0, "latency budget must be positive");
+
+  memset (&b, 0, sizeof (b));
+  for (i = 0; i < sizeof (b.secret); i++)
+    b.secret[i] = i;
+  b.digits = args_info->digits_orig ? args_info->digits_arg : 6;
+  if (args_info->totp_given && strcmp (args_info->totp_arg, "sha256") == 0)
+    b.totpflags = OATH_TOTP_HMAC_SHA256;
+  else if (args_info->totp_given
+	   && strcmp (args_info->totp_arg, "sha512") == 0)
+    b.totpflags = OATH_TOTP_HMAC_SHA512;
+  /* Never matches, so every validation tries the whole window. */
+  memset (b.otp, '-', b.digits);
+  max_window = args_info->window_orig ? args_info->window_arg : 1000;
+
+  printf ("HMAC throughput (OTPs per second):\n");
+  for (i = 0; i < sizeof (algos) / sizeof (algos[0]); i++)
+    printf ("  %-8s %12.0f\n", algos[i].name,
+	    bench_generate (&b, algos[i].flags));
+
+  hotp_cost = bench_candidate (&b, 0);
+  totp_cost = bench_candidate (&b, 1);
+
+  printf ("\nCost per candidate OTP (microseconds):\n");
+  printf ("  %-20s %8.3f\n", "oath_hotp_validate", hotp_cost / 1e3);
+  printf ("  %-20s %8.3f\n", "oath_totp_validate4", totp_cost / 1e3);
+
+  printf ("\nWorst case validation latency (milliseconds):\n");
+  printf ("  %8s %10s %10s\n", "window", "hotp", "totp");
+  /* Windows of 1, 2, 5, 10, 20, 50, ... up to the --window value. */
+  for (decade = 1; decade <= max_window; decade *= 10)
+    for (i = 0; i < 3 && decade * steps[i] <= max_window; i++)
+      printf ("  %8zu %10.3f %10.3f\n", decade * steps[i],
+	      bench_worst (&b, 0, decade * steps[i]) / 1e6,
+	      bench_worst (&b, 1, decade * steps[i]) / 1e6);
+
+  printf ("\nLargest window within a %g ms latency budget:\n",
+	  args_info->latency_budget_arg);
+  window = bench_recommend (&b, 0, hotp_cost, budget, &worst);
+  printf ("  hotp window=%zu (worst case %.3f ms)\n", window, worst / 1e6);
+  window = bench_recommend (&b, 1, totp_cost, budget, &worst);
+  printf ("  totp window=%zu (worst case %.3f ms)\n", window, worst / 1e6);
+}
+
+/* Read lines of "USER TOKEN COUNTER [OTP [TIME]]" from standard input
+   and apply them all at once to the usersfile (or statefile), then
+   write the username filter if requested. */
+static void
+update_usersfile (const char *usersfile, const char *statefile,
+		  const char *filterfile)
+{
+  oath_usersfile_t *uf;
+  char line[BUFSIZ];
+  size_t lineno = 0;
+  time_t now = time (NULL);
+  int rc;
+
+  rc = oath_usersfile_init (&uf, usersfile);
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "usersfile initialization failed: %s",
+	   oath_strerror (rc));
+  oath_usersfile_set_statefile (uf, statefile);
+  oath_usersfile_set_filter (uf, filterfile);
+
+  while (fgets (line, sizeof (line), stdin) != NULL)
+    {
+      char *user, *token, *counter, *otp, *when, *end;
+      unsigned long long moving_factor;
+      unsigned long idx;
+      time_t t = now;
+
+      lineno++;
+      if (strchr (line, '\n') == NULL && !feof (stdin))
+	error (EXIT_FAILURE, 0, "line %zu too long", lineno);
+
+      user = strtok (line, " \t\r\n");
+      if (user == NULL || *user == '#')
+	continue;
+      token = strtok (NULL, " \t\r\n");
+      counter = strtok (NULL, " \t\r\n");
+      otp = strtok (NULL, " \t\r\n");
+      when = strtok (NULL, "\r\n");
+
+      if (token == NULL || counter == NULL)
+	error (EXIT_FAILURE, 0, "line %zu: missing token or counter",
+	       lineno);
+
+      errno = 0;
+      idx = strtoul (token, &end, 10);
+      if (*end != '\0' || errno)
+	error (EXIT_FAILURE, 0, "line %zu: invalid token `%s'", lineno,
+	       token);
+      moving_factor = strtoull (counter, &end, 10);
+      if (*end != '\0' || errno)
+	error (EXIT_FAILURE, 0, "line %zu: invalid counter `%s'", lineno,
+	       counter);
+      if (when)
+	{
+	  t = parse_time (when, now);
+	  if (t == BAD_TIME)
+	    error (EXIT_FAILURE, 0, "line %zu: cannot parse time `%s'",
+		   lineno, when);
+	}
+
+      rc = oath_usersfile_add_update (uf, user, idx, moving_factor, otp, t);
+      if (rc != OATH_OK)
+	error (EXIT_FAILURE, 0, "line %zu: %s", lineno, oath_strerror (rc));
+    }
+
+  rc = oath_usersfile_commit_updates (uf);
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "updating usersfile failed: %s",
+	   oath_strerror (rc));
+
+  if (filterfile)
+    {
+      rc = oath_usersfile_write_filter (uf);
+      if (rc != OATH_OK)
+	error (EXIT_FAILURE, 0, "writing filter failed: %s",
+	       oath_strerror (rc));
+    }
+
+  oath_usersfile_done (uf);
+}
+
+/* Token types of the usersfile, as counted by --usersfile-stats, in
+   order of time step size and then of digits. */
+static const char *const usersfile_types[] = {
+  "HOTP/E/6", "HOTP/E/7", "HOTP/E/8",
+  "HOTP/T30/6", "HOTP/T30/7", "HOTP/T30/8",
+  "HOTP/T60/6", "HOTP/T60/7", "HOTP/T60/8"
+};
+
+#define USERSFILE_TYPES (sizeof (usersfile_types) / sizeof (usersfile_types[0]))
+
+/* Bits and hash functions of the Bloom filters of usernames seen by
+   --usersfile-stats, which bound its memory use however large the
+   usersfile is. */
+#define STATS_SET_BITS (1UL << 24)
+#define STATS_SET_HASHES 4
+
+/* Add USER to the Bloom filter SET, and return true if it probably
+   was in it already. */
+static bool
+stats_set_add (unsigned char *set, const char *user)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  uint32_t h1, h2;
+  bool found = true;
+  unsigned i;
+
+  /* FNV-1a. */
+  for (; *user; user++)
+    {
+      h ^= (unsigned char) *user;
+      h *= 0x100000001b3ULL;
+    }
+
+  h1 = h & 0xFFFFFFFF;
+  h2 = (h >> 32) | 1;
+  for (i = 0; i < STATS_SET_HASHES; i++)
+    {
+      uint32_t bit = (h1 + i * h2) % STATS_SET_BITS;
+
+      if ((set[bit / 8] & (1 << (bit % 8))) == 0)
+	{
+	  found = false;
+	  set[bit / 8] |= 1 << (bit % 8);
+	}
+    }
+
+  return found;
+}
+
+/* Print statistics of USERSFILE, read in one pass. */
+static void
+usersfile_stats (const char *usersfile)
+{
+  uint64_t types[USERSFILE_TYPES] = { 0 };
+  uint64_t lines = 0, blank = 0, comments = 0, malformed = 0;
+  uint64_t tokens = 0, users = 0, repeated = 0, bytes = 0, longest = 0;
+  unsigned char *seen, *twice;
+  char *line = NULL;
+  size_t n = 0, i;
+  ssize_t len;
+  struct stat st;
+  FILE *fh;
+
+  fh = fopen (usersfile, "r");
+  if (fh == NULL || fstat (fileno (fh), &st) != 0)
+    error (EXIT_FAILURE, errno, "%s", usersfile);
+
+  /* Users seen once, and users seen more than once. */
+  seen = calloc (2, STATS_SET_BITS / 8);
+  if (seen == NULL)
+    error (EXIT_FAILURE, errno, "calloc");
+  twice = seen + STATS_SET_BITS / 8;
+
+  while ((len = getline (&line, &n, fh)) != -1)
+    {
+      unsigned digits, totpstepsize;
+      const char *user;
+      char *p;
+
+      lines++;
+      bytes += len;
+      if ((uint64_t) len > longest)
+	longest = len;
+
+      p = line + strspn (line, " \t\r\n");
+      if (*p == '\0')
+	{
+	  blank++;
+	  continue;
+	}
+      if (*p == '#')
+	{
+	  comments++;
+	  continue;
+	}
+
+      if (oath_usersfile_parse_line (line, &user, &digits, &totpstepsize)
+	  != OATH_OK)
+	{
+	  malformed++;
+	  continue;
+	}
+
+      tokens++;
+      types[totpstepsize / 30 * 3 + digits - 6]++;
+      if (!stats_set_add (seen, user))
+	users++;
+      else if (!stats_set_add (twice, user))
+	repeated++;
+    }
+
+  if (ferror (fh))
+    error (EXIT_FAILURE, errno, "%s", usersfile);
+  fclose (fh);
+  free (line);
+  free (seen);
+
+  printf ("File size: %" PRIu64 " bytes\n", (uint64_t) st.st_size);
+  printf ("Lines: %" PRIu64 "\n", lines);
+  printf ("  blank: %" PRIu64 "\n", blank);
+  printf ("  comments: %" PRIu64 "\n", comments);
+  printf ("  malformed: %" PRIu64 "\n", malformed);
+  printf ("Longest line: %" PRIu64 " bytes\n", longest);
+  printf ("Average line: %.1f bytes\n", lines ? (double) bytes / lines : 0);
+  printf ("Tokens: %" PRIu64 "\n", tokens);
+  for (i = 0; i < USERSFILE_TYPES; i++)
+    if (types[i])
+      printf ("  %s: %" PRIu64 "\n", usersfile_types[i], types[i]);
+  printf ("Users: %" PRIu64 " (approximate)\n", users);
+  printf ("Users with several tokens: %" PRIu64 " (approximate)\n",
+	  repeated);
+}
+
+/* Rewrite USERSFILE without unusable lines, and rebuild its filter. */
+static void
+compact_usersfile (const char *usersfile, const char *statefile,
+		   const char *filterfile, int verbose)
+{
+  oath_usersfile_t *uf;
+  size_t dropped;
+  int rc;
+
+  rc = oath_usersfile_init (&uf, usersfile);
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "usersfile initialization failed: %s",
+	   oath_strerror (rc));
+  oath_usersfile_set_statefile (uf, statefile);
+  oath_usersfile_set_filter (uf, filterfile);
+
+  rc = oath_usersfile_compact (uf, &dropped);
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "compacting usersfile failed: %s",
+	   oath_strerror (rc));
+
+  if (verbose)
+    printf ("Dropped lines: %lu\n", (unsigned long) dropped);
+
+  oath_usersfile_done (uf);
+}
+
+/* Build the username filter of USERSFILE in FILTERFILE. */
+static void
+index_usersfile (const char *usersfile, const char *filterfile)
+{
+  oath_usersfile_t *uf;
+  int rc;
+
+  rc = oath_usersfile_init (&uf, usersfile);
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "usersfile initialization failed: %s",
+	   oath_strerror (rc));
+  oath_usersfile_set_filter (uf, filterfile);
+
+  rc = oath_usersfile_write_filter (uf);
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "writing filter failed: %s",
+	   oath_strerror (rc));
+
+  oath_usersfile_done (uf);
+}
+
 #define generate_otp_p(n) ((n) == 1)
 #define validate_otp_p(n) ((n) == 2)
 
@@ -130,7 +1115,6 @@ main (int argc, char *argv[])
   size_t window;
   uint64_t moving_factor;
   unsigned digits;
-  char otp[10];
   time_t now, when, t0, time_step_size;
   int totpflags = 0;
 
@@ -160,39 +1144,108 @@ main (int argc, char *argv[])
   if (args_info.help_given)
     usage (EXIT_SUCCESS);
 
-  if (args_info.inputs_num == 0)
+  if (args_info.update_usersfile_given || args_info.usersfile_stats_given
+      || args_info.usersfile_compact_given || args_info.usersfile_index_given)
     {
-      cmdline_parser_print_help ();
-      emit_bug_reporting_address ();
+      if (args_info.inputs_num > 0)
+	error (EXIT_FAILURE, 0, "too many parameters");
+
+      if (args_info.usersfile_index_given && !args_info.filterfile_given)
+	error (EXIT_FAILURE, 0, "--usersfile-index requires --filterfile");
+
+      rc = oath_init ();
+      if (rc != OATH_OK)
+	error (EXIT_FAILURE, 0, "liboath initialization failed: %s",
+	       oath_strerror (rc));
+
+      if (args_info.update_usersfile_given)
+	update_usersfile (args_info.update_usersfile_arg,
+			  args_info.statefile_arg, args_info.filterfile_arg);
+      else if (args_info.usersfile_stats_given)
+	usersfile_stats (args_info.usersfile_stats_arg);
+      else if (args_info.usersfile_compact_given)
+	compact_usersfile (args_info.usersfile_compact_arg,
+			   args_info.statefile_arg, args_info.filterfile_arg,
+			   args_info.verbose_flag);
+      else
+	index_usersfile (args_info.usersfile_index_arg,
+			 args_info.filterfile_arg);
+
+      oath_done ();
       return EXIT_SUCCESS;
     }
 
-  rc = oath_init ();
-  if (rc != OATH_OK)
-    error (EXIT_FAILURE, 0, "liboath initialization failed: %s",
-	   oath_strerror (rc));
-
-  if (args_info.base32_flag)
+  if (args_info.batch_flag)
     {
-      rc = oath_base32_decode (args_info.inputs[0],
-			       strlen (args_info.inputs[0]),
-			       &secret, &secretlen);
+      if (args_info.inputs_num > 0)
+	error (EXIT_FAILURE, 0, "too many parameters");
+
+      now = time (NULL);
+      t0 = parse_time (args_info.start_time_arg, now);
+      time_step_size = parse_duration (args_info.time_step_size_arg);
+
+      if (t0 == BAD_TIME)
+	error (EXIT_FAILURE, 0, "cannot parse time `%s'",
+	       args_info.start_time_arg);
+
+      if (time_step_size == BAD_TIME)
+	error (EXIT_FAILURE, 0, "cannot parse time `%s'",
+	       args_info.time_step_size_arg);
+
+      if (args_info.digits_orig && args_info.digits_arg != 6
+	  && args_info.digits_arg != 7 && args_info.digits_arg != 8)
+	error (EXIT_FAILURE, 0, "only digits 6, 7 and 8 are supported");
+
+      rc = oath_init ();
       if (rc != OATH_OK)
-	error (EXIT_FAILURE, 0, "base32 decoding failed: %s",
+	error (EXIT_FAILURE, 0, "liboath initialization failed: %s",
 	       oath_strerror (rc));
+
+      rc = batch (&args_info, t0, time_step_size);
+
+      oath_done ();
+      return rc;
     }
-  else
+
+  if (args_info.benchmark_flag)
     {
-      secretlen = 1 + strlen (args_info.inputs[0]) / 2;
-      secret = malloc (secretlen);
-      if (!secret)
-	error (EXIT_FAILURE, errno, "malloc");
+      if (args_info.inputs_num > 0)
+	error (EXIT_FAILURE, 0, "too many parameters");
+
+      if (args_info.digits_orig && args_info.digits_arg != 6
+	  && args_info.digits_arg != 7 && args_info.digits_arg != 8)
+	error (EXIT_FAILURE, 0, "only digits 6, 7 and 8 are supported");
 
-      rc = oath_hex2bin (args_info.inputs[0], secret, &secretlen);
+      rc = oath_init ();
       if (rc != OATH_OK)
-	error (EXIT_FAILURE, 0, "hex decoding of secret key failed");
+	error (EXIT_FAILURE, 0, "liboath initialization failed: %s",
+	       oath_strerror (rc));
+
+      benchmark (&args_info);
+
+      oath_done ();
+      return EXIT_SUCCESS;
     }
 
+  if (args_info.inputs_num == 0)
+    {
+      cmdline_parser_print_help ();
+      emit_bug_reporting_address ();
+      return EXIT_SUCCESS;
+    }
+
+  rc = oath_init ();
+  if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "liboath initialization failed: %s",
+	   oath_strerror (rc));
+
+  rc = decode_key (args_info.inputs[0], args_info.base32_flag,
+		   &secret, &secretlen);
+  if (rc != OATH_OK && args_info.base32_flag)
+    error (EXIT_FAILURE, 0, "base32 decoding failed: %s", oath_strerror (rc));
+  else if (rc != OATH_OK)
+    error (EXIT_FAILURE, 0, "hex decoding of secret key failed");
+
   if (args_info.counter_orig)
     moving_factor = args_info.counter_arg;
   else
@@ -211,6 +1264,18 @@ main (int argc, char *argv[])
   if (digits != 6 && digits != 7 && digits != 8)
     error (EXIT_FAILURE, 0, "only digits 6, 7 and 8 are supported");
 
+  if (args_info.threads_given
+      && (args_info.threads_arg < 1 || args_info.threads_arg > MAX_THREADS))
+    error (EXIT_FAILURE, 0, "number of threads must be between 1 and %d",
+	   MAX_THREADS);
+
+  if ((args_info.search_from_given || args_info.search_to_given)
+      && (!args_info.totp_given || !validate_otp_p (args_info.inputs_num)))
+    error (EXIT_FAILURE, 0, "searching a time range requires --totp and OTP");
+
+  if (args_info.search_to_given && !args_info.search_from_given)
+    error (EXIT_FAILURE, 0, "--search-to requires --search-from");
+
   if (validate_otp_p (args_info.inputs_num) && !args_info.digits_orig)
     digits = strlen (args_info.inputs[1]);
   else if (validate_otp_p (args_info.inputs_num) && args_info.digits_orig &&
@@ -281,43 +1346,26 @@ main (int argc, char *argv[])
 	verbose_hotp (moving_factor);
     }
 
-  if (generate_otp_p (args_info.inputs_num) && !args_info.totp_given)
+  if (generate_otp_p (args_info.inputs_num))
     {
-      size_t iter = 0;
+      struct generate_work w;
 
-      do
+      memset (&w, 0, sizeof (w));
+      w.secret = secret;
+      w.secretlen = secretlen;
+      w.totp = args_info.totp_given;
+      w.moving_factor = moving_factor;
+      if (w.totp)
 	{
-	  rc = oath_hotp_generate (secret,
-				   secretlen,
-				   moving_factor + iter,
-				   digits,
-				   false, OATH_HOTP_DYNAMIC_TRUNCATION, otp);
-	  if (rc != OATH_OK)
-	    error (EXIT_FAILURE, 0,
-		   "generating one-time password failed (%d)", rc);
-
-	  printf ("%s\n", otp);
+	  w.when = when;
+	  w.time_step_size = time_step_size;
+	  w.t0 = t0;
+	  w.totpflags = totpflags;
 	}
-      while (window - iter++ > 0);
-    }
-  else if (generate_otp_p (args_info.inputs_num) && args_info.totp_given)
-    {
-      size_t iter = 0;
-
-      do
-	{
-	  rc = oath_totp_generate2 (secret,
-				    secretlen,
-				    when + iter * time_step_size,
-				    time_step_size, t0, digits, totpflags,
-				    otp);
-	  if (rc != OATH_OK)
-	    error (EXIT_FAILURE, 0,
-		   "generating one-time password failed (%d)", rc);
+      w.digits = digits;
 
-	  printf ("%s\n", otp);
-	}
-      while (window - iter++ > 0);
+      generate_window (&w, window,
+		       args_info.threads_given ? args_info.threads_arg : 1);
     }
   else if (validate_otp_p (args_info.inputs_num) && !args_info.totp_given)
     {
@@ -334,6 +1382,47 @@ main (int argc, char *argv[])
 	       "validating one-time password failed (%d)", rc);
       printf ("%d\n", rc);
     }
+  else if (validate_otp_p (args_info.inputs_num)
+	   && args_info.search_from_given)
+    {
+      struct search_work w;
+      time_t from, to;
+      uint64_t found;
+
+      from = parse_time (args_info.search_from_arg, now);
+      if (from == BAD_TIME)
+	error (EXIT_FAILURE, 0, "cannot parse time `%s'",
+	       args_info.search_from_arg);
+
+      to = when;
+      if (args_info.search_to_given)
+	to = parse_time (args_info.search_to_arg, now);
+      if (to == BAD_TIME)
+	error (EXIT_FAILURE, 0, "cannot parse time `%s'",
+	       args_info.search_to_arg);
+
+      if (to < from || to < t0)
+	error (EXIT_FAILURE, 0, "empty time range to search");
+      if (from < t0)
+	from = t0;
+
+      memset (&w, 0, sizeof (w));
+      w.secret = secret;
+      w.secretlen = secretlen;
+      w.time_step_size = time_step_size;
+      w.t0 = t0;
+      w.totpflags = totpflags;
+      w.otp = args_info.inputs[1];
+
+      found = search_range (&w, (from - t0) / time_step_size,
+			    (to - t0) / time_step_size,
+			    args_info.threads_given ?
+			    args_info.threads_arg : 1);
+      if (found == 0)
+	error (EXIT_OTP_INVALID, 0,
+	       "password \"%s\" not found in time range",
+	       args_info.inputs[1]);
+    }
   else if (validate_otp_p (args_info.inputs_num) && args_info.totp_given)
     {
       rc = oath_totp_validate4 (secret,
@@ -108,4 +108,63 @@ dotest "--totp --now @1111111109 -w 5 $sha1key" "081804 050471 266759 306183 466
 dotest "--totp=sha256 --now @1111111109 -w 5 $sha256key" "084774 062674 267535 096086 328915 956967"
 dotest "--hotp --counter 1099511627776 00" "363425"
 
+# Batched usersfile updates from standard input.
+printf 'HOTP\tuser1\t-\t00\nHOTP\tuser2\t-\t00\nHOTP\tuser2\t-\t01\n' \
+    > tmp.oath
+printf 'user2 1 17 123456 @1000000000\nuser1 0 3\n' | \
+    $OATHTOOL --update-usersfile=tmp.oath || fail_ "--update-usersfile"
+got="`cut -f1-6 tmp.oath | tr '\t\n' ' '`"
+expect="HOTP user1 - 00 3 - HOTP user2 - 00 HOTP user2 - 01 17 123456 "
+test "$got" = "$expect" || fail_ "--update-usersfile got: -$got-"
+echo 'nosuchuser 0 1' | $OATHTOOL --update-usersfile=tmp.oath 2> /dev/null \
+    && fail_ "--update-usersfile with unknown user"
+got="`cut -f1-6 tmp.oath | tr '\t\n' ' '`"
+test "$got" = "$expect" || fail_ "--update-usersfile changed file on error"
+rm -f tmp.oath
+
+printf '%s\n' '# users' 'HOTP/E  alice  -  00' 'HOTP/T30 alice - 01 0' \
+    'HOTP bob - 0g' '' 'BOGUS carol - 00' \
+    "HOTP dave - `printf '%066d' 0`" > tmp.oath
+got="`$OATHTOOL --usersfile-stats=tmp.oath | grep -v bytes | tr '\n' ,`"
+expect="Lines: 7,  blank: 1,  comments: 1,  malformed: 3,Tokens: 2,  HOTP/E/6: 1,  HOTP/T30/6: 1,Users: 1 (approximate),Users with several tokens: 1 (approximate),"
+test "$got" = "$expect" || fail_ "--usersfile-stats got: -$got-"
+$OATHTOOL --usersfile-compact=tmp.oath || fail_ "--usersfile-compact"
+got="`tr '\t\n' ' ,' < tmp.oath`"
+expect="# users,HOTP/E alice - 00,HOTP/T30 alice - 01 0,"
+test "$got" = "$expect" || fail_ "--usersfile-compact got: -$got-"
+$OATHTOOL --usersfile-index=tmp.oath --filterfile=tmp.filter \
+    && test -s tmp.filter || fail_ "--usersfile-index"
+rm -f tmp.oath tmp.filter
+
+got="`printf '%s\n' \
+    '3132333435363738393031323334353637383930 hotp 0 - 3' \
+    '3132333435363738393031323334353637383930 hotp 0 969429 10' \
+    '3132333435363738393031323334353637383930 totp @59 94287082' \
+    '00 hotp 0 123456' | $OATHTOOL --batch | tr '\n' ','`"
+expect="755224 287082 359152 969429,3,0,invalid,"
+test "$got" = "$expect" || fail_ "--batch got: -$got-"
+echo 'zz hotp 0' | $OATHTOOL --batch > /dev/null \
+    && fail_ "--batch with invalid key"
+
+for mode in "" "--totp -N @0"; do
+    expect="`$OATHTOOL $mode -w 100 00`"
+    got="`$OATHTOOL $mode -w 100 --threads=4 00`"
+    test "$got" = "$expect" || fail_ "--threads $mode output differs"
+done
+
+got="`$OATHTOOL --totp --search-from=@0 --search-to=1970-01-02 --threads=3 \
+    3132333435363738393031323334353637383930 94287082`"
+test "$got" = "1 1970-01-01 00:00:30 UTC" || fail_ "--search-from got: -$got-"
+$OATHTOOL --totp --search-from=@0 --search-to=@100 00 000000 \
+    && fail_ "--search-from found missing OTP"
+got="`$OATHTOOL --totp --search-from=@0 --search-to=@59 --threads=1024 \
+    3132333435363738393031323334353637383930 94287082`"
+test "$got" = "1 1970-01-01 00:00:30 UTC" \
+    || fail_ "--search-from with more threads than steps got: -$got-"
+$OATHTOOL --threads=1025 00 > /dev/null \
+    && fail_ "--threads above the limit accepted"
+
+$OATHTOOL --benchmark -w 2 --latency-budget=1 | grep '^  totp window=' \
+    > /dev/null || fail_ "--benchmark gave no recommendation"
+
 exit 0
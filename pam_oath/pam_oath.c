@@ -26,6 +26,15 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <syslog.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /* Libtool defines PIC for shared objects */
 #ifndef PIC
@@ -60,6 +69,51 @@
 #endif
 #endif
 
+/* The module holds one liboath reference for as long as it is
+   loaded, instead of initializing the library on every call.  A
+   failed initialization is retried by the next call. */
+static int oath_init_rc = OATH_CRYPTO_ERROR;
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t oath_init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t oath_init_lock;
+
+static void
+init_lock (void)
+{
+  pthread_mutex_init (&oath_init_lock, NULL);
+}
+#endif
+
+static int
+pam_oath_init (void)
+{
+  int rc;
+
+#ifdef HAVE_PTHREAD_H
+  pthread_once (&oath_init_once, init_lock);
+  pthread_mutex_lock (&oath_init_lock);
+#endif
+  if (oath_init_rc != OATH_OK)
+    oath_init_rc = oath_init ();
+  rc = oath_init_rc;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock (&oath_init_lock);
+#endif
+
+  return rc;
+}
+
+#ifdef __GNUC__
+static void pam_oath_fini (void) __attribute__ ((destructor));
+
+static void
+pam_oath_fini (void)
+{
+  if (oath_init_rc == OATH_OK)
+    oath_done ();
+}
+#endif
+
 #define MIN_OTP_LEN 6
 #define MAX_OTP_LEN 8
 
@@ -70,13 +124,41 @@ struct cfg
   int try_first_pass;
   int use_first_pass;
   char *usersfile;
+  char *statefile;
+  char *filterfile;
   unsigned digits;
   unsigned window;
+  unsigned backoff;
+  unsigned max_failures;
+  char *timings;
 };
 
-static void
+/* Parse the value of option @name in @arg as a non-negative number
+   into *@value. */
+static int
+parse_unsigned (const char *name, const char *arg, unsigned *value)
+{
+  unsigned long l;
+  char *end;
+
+  errno = 0;
+  l = strtoul (arg, &end, 10);
+  if (!isdigit ((unsigned char) *arg) || *end != '\0' || errno != 0
+      || l > UINT_MAX)
+    {
+      D (("invalid value for %s: %s", name, arg));
+      return -1;
+    }
+
+  *value = l;
+
+  return 0;
+}
+
+static int
 parse_cfg (int flags, int argc, const char **argv, struct cfg *cfg)
 {
+  int rc = 0;
   int i;
 
   cfg->debug = 0;
@@ -84,8 +166,13 @@ parse_cfg (int flags, int argc, const char **argv, struct cfg *cfg)
   cfg->try_first_pass = 0;
   cfg->use_first_pass = 0;
   cfg->usersfile = NULL;
+  cfg->statefile = NULL;
+  cfg->filterfile = NULL;
   cfg->digits = -1;
   cfg->window = 5;
+  cfg->backoff = 0;
+  cfg->max_failures = 0;
+  cfg->timings = NULL;
 
   for (i = 0; i < argc; i++)
     {
@@ -99,10 +186,23 @@ parse_cfg (int flags, int argc, const char **argv, struct cfg *cfg)
 	cfg->use_first_pass = 1;
       if (strncmp (argv[i], "usersfile=", 10) == 0)
 	cfg->usersfile = (char *) argv[i] + 10;
+      if (strncmp (argv[i], "statefile=", 10) == 0)
+	cfg->statefile = (char *) argv[i] + 10;
+      if (strncmp (argv[i], "filterfile=", 11) == 0)
+	cfg->filterfile = (char *) argv[i] + 11;
       if (strncmp (argv[i], "digits=", 7) == 0)
 	cfg->digits = atoi (argv[i] + 7);
       if (strncmp (argv[i], "window=", 7) == 0)
 	cfg->window = atoi (argv[i] + 7);
+      if (strncmp (argv[i], "backoff=", 8) == 0
+	  && parse_unsigned ("backoff", argv[i] + 8, &cfg->backoff) != 0)
+	rc = -1;
+      if (strncmp (argv[i], "max_failures=", 13) == 0
+	  && parse_unsigned ("max_failures", argv[i] + 13,
+			     &cfg->max_failures) != 0)
+	rc = -1;
+      if (strncmp (argv[i], "timings=", 8) == 0)
+	cfg->timings = (char *) argv[i] + 8;
     }
 
   if (cfg->digits != 6 && cfg->digits != 7 && cfg->digits != 8)
@@ -124,9 +224,189 @@ parse_cfg (int flags, int argc, const char **argv, struct cfg *cfg)
       D (("try_first_pass=%d", cfg->try_first_pass));
       D (("use_first_pass=%d", cfg->use_first_pass));
       D (("usersfile=%s", cfg->usersfile ? cfg->usersfile : "(null)"));
+      D (("statefile=%s", cfg->statefile ? cfg->statefile : "(null)"));
+      D (("filterfile=%s", cfg->filterfile ? cfg->filterfile : "(null)"));
       D (("digits=%d", cfg->digits));
       D (("window=%d", cfg->window));
+      D (("backoff=%u", cfg->backoff));
+      D (("max_failures=%u", cfg->max_failures));
+      D (("timings=%s", cfg->timings ? cfg->timings : "(null)"));
+    }
+
+  return rc;
+}
+
+static const char *phase_name[OATH_USERSFILE_PHASES] = {
+  "parse", "validate", "lock_wait", "write", "fsync", "rename"
+};
+
+/* Upper bounds in seconds of the histogram buckets, besides +Inf. */
+static const double phase_bucket[] = { 0.0001, 0.001, 0.01, 0.1, 1 };
+
+#define NBUCKETS (sizeof (phase_bucket) / sizeof (phase_bucket[0]))
+
+/* Values kept per phase: the buckets, +Inf, sum and count. */
+#define NVALUES (NBUCKETS + 3)
+
+struct timings
+{
+  int seen[OATH_USERSFILE_PHASES];
+  uint64_t nsec[OATH_USERSFILE_PHASES];
+};
+
+static void
+record_timing (void *handle, oath_usersfile_phase phase, uint64_t nsec)
+{
+  struct timings *t = handle;
+
+  t->seen[phase] = 1;
+  t->nsec[phase] = nsec;
+}
+
+static void
+log_timings (const char *user, const struct timings *t)
+{
+  char buf[256];
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < OATH_USERSFILE_PHASES; i++)
+    if (t->seen[i] && len < sizeof (buf))
+      len += snprintf (buf + len, sizeof (buf) - len, " %s=%.6f",
+		       phase_name[i], t->nsec[i] / 1e9);
+
+  syslog (LOG_AUTHPRIV | LOG_INFO, "pam_oath: timings for user %s:%s",
+	  user, len ? buf : " none");
+}
+
+static void
+metric_name (char *buf, size_t len, int phase, size_t value)
+{
+  if (value < NBUCKETS)
+    snprintf (buf, len, "pam_oath_phase_seconds_bucket"
+	      "{phase=\"%s\",le=\"%g\"}", phase_name[phase],
+	      phase_bucket[value]);
+  else if (value == NBUCKETS)
+    snprintf (buf, len, "pam_oath_phase_seconds_bucket"
+	      "{phase=\"%s\",le=\"+Inf\"}", phase_name[phase]);
+  else
+    snprintf (buf, len, "pam_oath_phase_seconds_%s{phase=\"%s\"}",
+	      value == NBUCKETS + 1 ? "sum" : "count", phase_name[phase]);
+}
+
+/* Add the timings to the cumulative histogram in METRICSFILE, written
+   in the Prometheus text format so that it can be picked up by the
+   textfile collector of node_exporter.  Concurrent logins are
+   serialized by a lock on METRICSFILE.lock, and the file is replaced
+   atomically so the collector never sees a partial file. */
+static int
+write_timings (const char *metricsfile, const struct timings *t)
+{
+  double v[OATH_USERSFILE_PHASES][NVALUES];
+  char name[128], line[256];
+  char *lockfile = NULL, *newfile = NULL;
+  size_t len = strlen (metricsfile) + sizeof (".lock");
+  struct flock l;
+  FILE *fh;
+  int lockfd = -1, fd, rc = -1;
+  int synced;
+  int i;
+  size_t j;
+
+  memset (v, 0, sizeof (v));
+
+  lockfile = malloc (len);
+  newfile = malloc (len);
+  if (lockfile == NULL || newfile == NULL)
+    goto done;
+  sprintf (lockfile, "%s.lock", metricsfile);
+  sprintf (newfile, "%s.new", metricsfile);
+
+  lockfd = open (lockfile, O_RDWR | O_CREAT, 0600);
+  if (lockfd < 0)
+    goto done;
+
+  memset (&l, 0, sizeof (l));
+  l.l_type = F_WRLCK;
+  l.l_whence = SEEK_SET;
+  if (fcntl (lockfd, F_SETLKW, &l) != 0)
+    goto done;
+
+  fh = fopen (metricsfile, "r");
+  if (fh)
+    {
+      double value;
+
+      while (fgets (line, sizeof (line), fh))
+	{
+	  if (line[0] == '#' || sscanf (line, "%127s %lf", name, &value) != 2)
+	    continue;
+
+	  for (i = 0; i < OATH_USERSFILE_PHASES; i++)
+	    for (j = 0; j < NVALUES; j++)
+	      {
+		char known[128];
+
+		metric_name (known, sizeof (known), i, j);
+		if (strcmp (name, known) == 0)
+		  v[i][j] = value;
+	      }
+	}
+      fclose (fh);
+    }
+
+  for (i = 0; i < OATH_USERSFILE_PHASES; i++)
+    {
+      double sec = t->nsec[i] / 1e9;
+
+      if (!t->seen[i])
+	continue;
+
+      for (j = 0; j < NBUCKETS; j++)
+	if (sec <= phase_bucket[j])
+	  v[i][j]++;
+      v[i][NBUCKETS]++;
+      v[i][NBUCKETS + 1] += sec;
+      v[i][NBUCKETS + 2]++;
     }
+
+  /* The textfile is read by the metrics collector, which usually does
+     not run as root. */
+  fd = open (newfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    goto done;
+  fh = fdopen (fd, "w");
+  if (fh == NULL)
+    {
+      close (fd);
+      unlink (newfile);
+      goto done;
+    }
+
+  fprintf (fh, "# HELP pam_oath_phase_seconds Time spent in each phase "
+	   "of pam_oath authentications.\n");
+  fprintf (fh, "# TYPE pam_oath_phase_seconds histogram\n");
+  for (i = 0; i < OATH_USERSFILE_PHASES; i++)
+    for (j = 0; j < NVALUES; j++)
+      {
+	metric_name (name, sizeof (name), i, j);
+	fprintf (fh, "%s %.17g\n", name, v[i][j]);
+      }
+
+  /* Make sure the data is on disk before it replaces the old file. */
+  synced = fflush (fh) == 0 && fsync (fd) == 0;
+  if (fclose (fh) == 0 && synced && rename (newfile, metricsfile) == 0)
+    rc = 0;
+  else
+    unlink (newfile);
+
+done:
+  if (lockfd >= 0)
+    close (lockfd);
+  free (lockfile);
+  free (newfile);
+
+  return rc;
 }
 
 PAM_EXTERN int
@@ -146,7 +426,11 @@ pam_sm_authenticate (pam_handle_t * pamh,
   char *query_prompt = NULL;
   char *onlypasswd = strdup ("");	/* empty passwords never match */
 
-  parse_cfg (flags, argc, argv, &cfg);
+  if (parse_cfg (flags, argc, argv, &cfg) != 0)
+    {
+      retval = PAM_AUTHINFO_UNAVAIL;
+      goto done;
+    }
 
   retval = pam_get_user (pamh, &user, NULL);
   if (retval != PAM_SUCCESS)
@@ -175,7 +459,7 @@ pam_sm_authenticate (pam_handle_t * pamh,
       goto done;
     }
 
-  rc = oath_init ();
+  rc = pam_oath_init ();
   if (rc != OATH_OK)
     {
       DBG (("oath_init() failed (%d)", rc));
@@ -292,16 +576,40 @@ pam_sm_authenticate (pam_handle_t * pamh,
 
   {
     time_t last_otp;
+    oath_usersfile_t *uf;
+    struct timings t;
+
+    memset (&t, 0, sizeof (t));
+
+    rc = oath_usersfile_init (&uf, cfg.usersfile);
+    if (rc == OATH_OK)
+      {
+	oath_usersfile_set_statefile (uf, cfg.statefile);
+	oath_usersfile_set_throttle (uf, cfg.backoff, cfg.max_failures);
+	oath_usersfile_set_filter (uf, cfg.filterfile);
+	if (cfg.timings)
+	  oath_usersfile_set_timing_callback (uf, record_timing, &t);
+	rc = oath_usersfile_authenticate (uf, user, otp, cfg.window,
+					  onlypasswd, &last_otp);
+	oath_usersfile_done (uf);
+      }
 
-    rc = oath_authenticate_usersfile (cfg.usersfile,
-				      user,
-				      otp, cfg.window, onlypasswd, &last_otp);
+    if (cfg.timings && strcmp (cfg.timings, "syslog") == 0)
+      log_timings (user, &t);
+    else if (cfg.timings && write_timings (cfg.timings, &t) != 0)
+      DBG (("could not write timings to %s", cfg.timings));
     DBG (("authenticate rc %d (%s: %s) last otp %s", rc,
 	  oath_strerror_name (rc) ? oath_strerror_name (rc) : "UNKNOWN",
 	  oath_strerror (rc), ctime (&last_otp)));
   }
 
-  if (rc != OATH_OK)
+  if (rc == OATH_THROTTLED)
+    {
+      DBG (("Too many failed logins for user '%s'", user));
+      retval = PAM_MAXTRIES;
+      goto done;
+    }
+  else if (rc != OATH_OK)
     {
       DBG (("One-time password not authorized to login as user '%s'", user));
       retval = PAM_AUTH_ERR;
@@ -311,7 +619,6 @@ pam_sm_authenticate (pam_handle_t * pamh,
   retval = PAM_SUCCESS;
 
 done:
-  oath_done ();
   free (query_prompt);
   free (onlypasswd);
   if (cfg.alwaysok && retval != PAM_SUCCESS)
@@ -25,12 +25,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>		/* open */
+#include <unistd.h>		/* close */
 
 /* Gnulib. */
 #include "progname.h"
 #include "error.h"
 #include "version-etc.h"
-#include "read-file.h"
 
 #include "pskctool_cmd.h"
 
@@ -84,8 +85,7 @@ get_container (const struct gengetopt_args_info *args_info)
   const char *filename = args_info->inputs ? args_info->inputs[0] : NULL;
   int strict = args_info->strict_flag;
   pskc_t *container;
-  char *buffer;
-  size_t len;
+  int fd = STDIN_FILENO;
   int rc;
 
   rc = pskc_init (&container);
@@ -94,20 +94,22 @@ get_container (const struct gengetopt_args_info *args_info)
 	   pskc_strerror (rc));
 
   if (filename)
-    buffer = read_binary_file (filename, &len);
-  else
-    buffer = fread_file (stdin, &len);
-  if (buffer == NULL)
-    error (EXIT_FAILURE, errno, "read");
+    {
+      fd = open (filename, O_RDONLY);
+      if (fd < 0)
+	error (EXIT_FAILURE, errno, "%s", filename);
+    }
 
-  rc = pskc_parse_from_memory (container, len, buffer);
+  /* Files are mapped and pipes streamed, without a copy of the data. */
+  rc = pskc_parse_from_fd (container, fd);
   if (!strict && rc == PSKC_PARSE_ERROR)
     fprintf (stderr, "warning: parse error (use -d to diagnose), output "
 	     "may be incomplete\n");
   else if (rc != PSKC_OK)
     error (EXIT_FAILURE, 0, "parsing PSKC data: %s", pskc_strerror (rc));
 
-  free (buffer);
+  if (filename)
+    close (fd);
 
   return container;
 }
@@ -32,6 +32,15 @@ $PSKCTOOL --info --debug $pskc_all > tmp 2>&1
 
 diff -ur $pskc_all_human tmp
 
+# Read from a pipe rather than a mapped file.
+cat $pskc_all | $PSKCTOOL --info --debug > tmp 2>&1
+
+diff -ur $pskc_all_human tmp
+
+# A mapped file is consumed like one that is read.
+{ $PSKCTOOL --info > /dev/null; cat > tmp; } < $pskc_all
+test ! -s tmp
+
 rm -f tmp
 
 exit 0